@@ -19,15 +19,22 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
 
 #include "accessor.h"
 #include "world.h"
 #include "log.h"
+#include "logspool.h"
 #include "misc.h"
 #include "crypt.h"
 
 
 
+/* The names of the log sync policies, indexed by LOG_SYNC_*. */
+static char *log_sync_names[] = { "none", "interval", "bytes", "group", NULL };
+
+
+
 static int set_string( char *, char **, char ** );
 static int set_long( char *, long *, char ** );
 static int set_long_ranged( char *, long *, char **, long, long, char * );
@@ -223,6 +230,15 @@ extern int aset_context_lines( World *wld, char *key, char *value,
 
 
 
+extern int aset_recall_page( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->recall_page, err, 0,
+			LONG_MAX / 1024, "Recall page size" );
+}
+
+
+
 extern int aset_buffer_size( World *wld, char *key, char *value,
 		int src, char **err )
 {
@@ -241,6 +257,45 @@ extern int aset_logbuffer_size( World *wld, char *key, char *value,
 
 
 
+extern int aset_spill_size( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	/* Give the spill file another chance, if it failed before. */
+	wld->spill_broken = 0;
+
+	return set_long_ranged( value, &wld->spill_size, err, 0,
+			LONG_MAX / 1024, "Max spill size" );
+}
+
+
+
+extern int aset_netbuffer_size( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->netbuffer_size, err,
+			NET_BUFFER_MINSIZE / 1024, LONG_MAX / 1024 / 2,
+			"Max network buffer size" );
+}
+
+
+
+extern int aset_line_limit( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->line_limit, err,
+			1, LONG_MAX / 1024, "Max line length" );
+}
+
+
+
+extern int aset_intern_lines( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_bool( value, &wld->intern_lines, err );
+}
+
+
+
 extern int aset_logging( World *wld, char *key, char *value,
 		int src, char **err )
 {
@@ -259,6 +314,105 @@ extern int aset_log_timestamps( World *wld, char *key, char *value,
 
 
 
+extern int aset_log_sync( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	int i;
+
+	for( i = 0; log_sync_names[i] != NULL; i++ )
+		if( !strcasecmp( value, log_sync_names[i] ) )
+		{
+			wld->log_sync = i;
+			return SET_KEY_OK;
+		}
+
+	*err = xstrdup( "Log sync must be one of none, interval, bytes, "
+			"or group." );
+	return SET_KEY_BAD;
+}
+
+
+
+extern int aset_log_sync_interval( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->log_sync_interval, err,
+			1, LONG_MAX, "Log sync interval" );
+}
+
+
+
+extern int aset_log_sync_bytes( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->log_sync_bytes, err,
+			1, LONG_MAX / 1024, "Log sync bytes" );
+}
+
+
+
+extern int aset_log_compress( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->log_compress, err, 0, 9,
+			"Log compression level" );
+}
+
+
+
+extern int aset_log_recompress( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->log_recompress, err, 0, 9,
+			"Log recompression level" );
+}
+
+
+
+extern int aset_log_spool_size( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	/* Give the log spool another chance, if it failed before. */
+	wld->logspool_broken = 0;
+
+	return set_long_ranged( value, &wld->log_spool_size, err, 0,
+			LONG_MAX / 1024, "Max log spool size" );
+}
+
+
+
+extern int aset_log_spool_dir( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	/* An empty spool can move right away. Otherwise, the new directory
+	 * is used once the spool is empty. */
+	if( wld->logspool_count == 0 )
+		world_logspool_close( wld );
+
+	return set_string( value, &wld->log_spool_dir, err );
+}
+
+
+
+extern int aset_log_tail( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	wld->flags |= WLD_LOGTAILUPDATE;
+
+	return set_bool( value, &wld->log_tail, err );
+}
+
+
+
+extern int aset_log_tail_queue( World *wld, char *key, char *value,
+		int src, char **err )
+{
+	return set_long_ranged( value, &wld->log_tail_queue, err, 1,
+			LONG_MAX / 1024, "Max log tail queue size" );
+}
+
+
+
 extern int aset_easteregg_version( World *wld, char *key, char *value,
 		int src, char **err )
 {
@@ -353,6 +507,14 @@ extern int aget_context_lines( World *wld, char *key, char **value,
 
 
 
+extern int aget_recall_page( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->recall_page, value );
+}
+
+
+
 extern int aget_buffer_size( World *wld, char *key, char **value,
 		int src )
 {
@@ -369,6 +531,36 @@ extern int aget_logbuffer_size( World *wld,
 
 
 
+extern int aget_spill_size( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->spill_size, value );
+}
+
+
+
+extern int aget_netbuffer_size( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->netbuffer_size, value );
+}
+
+
+
+extern int aget_line_limit( World *wld, char *key, char **value, int src )
+{
+	return get_long( wld->line_limit, value );
+}
+
+
+
+extern int aget_intern_lines( World *wld, char *key, char **value, int src )
+{
+	return get_bool( wld->intern_lines, value );
+}
+
+
+
 extern int aget_logging( World *wld, char *key, char **value, int src )
 {
 	return get_bool( wld->logging, value );
@@ -383,6 +575,76 @@ extern int aget_log_timestamps( World *wld, char *key, char **value, int src )
 
 
 
+extern int aget_log_sync( World *wld, char *key, char **value, int src )
+{
+	return get_string( log_sync_names[wld->log_sync], value );
+}
+
+
+
+extern int aget_log_sync_interval( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->log_sync_interval, value );
+}
+
+
+
+extern int aget_log_sync_bytes( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->log_sync_bytes, value );
+}
+
+
+
+extern int aget_log_compress( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->log_compress, value );
+}
+
+
+
+extern int aget_log_recompress( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->log_recompress, value );
+}
+
+
+
+extern int aget_log_spool_size( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->log_spool_size, value );
+}
+
+
+
+extern int aget_log_spool_dir( World *wld, char *key, char **value,
+		int src )
+{
+	return get_string( wld->log_spool_dir, value );
+}
+
+
+
+extern int aget_log_tail( World *wld, char *key, char **value, int src )
+{
+	return get_bool( wld->log_tail, value );
+}
+
+
+
+extern int aget_log_tail_queue( World *wld, char *key, char **value,
+		int src )
+{
+	return get_long( wld->log_tail_queue, value );
+}
+
+
+
 extern int aget_easteregg_version( World *wld, char *key, char **value, int src )
 {
 	return get_bool( wld->easteregg_version, value );
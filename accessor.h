@@ -60,10 +60,24 @@ extern int aset_strict_commands( World *, char *, char *, int, char ** );
 extern int aset_infostring( World *, char *, char *, int, char ** );
 extern int aset_newinfostring( World *, char *, char *, int, char ** );
 extern int aset_context_lines( World *, char *, char *, int, char ** );
+extern int aset_recall_page( World *, char *, char *, int, char ** );
 extern int aset_buffer_size( World *, char *, char *, int, char ** );
 extern int aset_logbuffer_size( World *, char *, char *, int, char ** );
+extern int aset_spill_size( World *, char *, char *, int, char ** );
+extern int aset_netbuffer_size( World *, char *, char *, int, char ** );
+extern int aset_line_limit( World *, char *, char *, int, char ** );
+extern int aset_intern_lines( World *, char *, char *, int, char ** );
 extern int aset_logging( World *, char *, char *, int, char ** );
 extern int aset_log_timestamps( World *, char *, char *, int, char ** );
+extern int aset_log_sync( World *, char *, char *, int, char ** );
+extern int aset_log_sync_interval( World *, char *, char *, int, char ** );
+extern int aset_log_sync_bytes( World *, char *, char *, int, char ** );
+extern int aset_log_compress( World *, char *, char *, int, char ** );
+extern int aset_log_recompress( World *, char *, char *, int, char ** );
+extern int aset_log_spool_size( World *, char *, char *, int, char ** );
+extern int aset_log_spool_dir( World *, char *, char *, int, char ** );
+extern int aset_log_tail( World *, char *, char *, int, char ** );
+extern int aset_log_tail_queue( World *, char *, char *, int, char ** );
 extern int aset_easteregg_version( World *, char *, char *, int, char ** );
 
 
@@ -96,10 +110,24 @@ extern int aget_strict_commands( World *, char *, char **, int );
 extern int aget_infostring( World *, char *, char **, int );
 extern int aget_newinfostring( World *, char *, char **, int );
 extern int aget_context_lines( World *, char *, char **, int );
+extern int aget_recall_page( World *, char *, char **, int );
 extern int aget_buffer_size( World *, char *, char **, int );
 extern int aget_logbuffer_size( World *, char *, char **, int );
+extern int aget_spill_size( World *, char *, char **, int );
+extern int aget_netbuffer_size( World *, char *, char **, int );
+extern int aget_line_limit( World *, char *, char **, int );
+extern int aget_intern_lines( World *, char *, char **, int );
 extern int aget_logging( World *, char *, char **, int );
 extern int aget_log_timestamps( World *, char *, char **, int );
+extern int aget_log_sync( World *, char *, char **, int );
+extern int aget_log_sync_interval( World *, char *, char **, int );
+extern int aget_log_sync_bytes( World *, char *, char **, int );
+extern int aget_log_compress( World *, char *, char **, int );
+extern int aget_log_recompress( World *, char *, char **, int );
+extern int aget_log_spool_size( World *, char *, char **, int );
+extern int aget_log_spool_dir( World *, char *, char **, int );
+extern int aget_log_tail( World *, char *, char **, int );
+extern int aget_log_tail_queue( World *, char *, char **, int );
 extern int aget_easteregg_version( World *, char *, char **, int );
 
 
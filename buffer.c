@@ -0,0 +1,143 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#include <stdlib.h>
+
+#include "global.h"
+#include "buffer.h"
+#include "misc.h"
+#include "line.h"
+
+
+
+static void resize_buffer( Buffer *buf, long size );
+
+
+
+extern Buffer *buffer_create( void )
+{
+	Buffer *buf;
+
+	buf = xmalloc( sizeof( Buffer ) );
+	buf->data = xmalloc( NET_BUFFER_MINSIZE + NET_BUFFER_SLACK );
+	buf->full = 0;
+	buf->size = NET_BUFFER_MINSIZE;
+	buf->lastbusy = 0;
+	buf->line = NULL;
+	buf->lineoffset = 0;
+
+	return buf;
+}
+
+
+
+extern void buffer_destroy( Buffer *buf )
+{
+	if( buf )
+	{
+		line_destroy( buf->line );
+		free( buf->data );
+	}
+	free( buf );
+}
+
+
+
+extern void buffer_clear( Buffer *buf )
+{
+	line_destroy( buf->line );
+	buf->line = NULL;
+	buf->lineoffset = 0;
+	buf->full = 0;
+}
+
+
+
+extern void buffer_swap( Buffer *a, Buffer *b )
+{
+	Buffer tmp = *a;
+
+	a->data = b->data;
+	a->full = b->full;
+	a->size = b->size;
+	a->lastbusy = b->lastbusy;
+
+	b->data = tmp.data;
+	b->full = tmp.full;
+	b->size = tmp.size;
+	b->lastbusy = tmp.lastbusy;
+}
+
+
+
+extern long buffer_reserve( Buffer *buf, long room, long max )
+{
+	long size = buf->size;
+
+	/* Most of the buffer is needed, so it's busy. */
+	if( buf->full + room > size / 2 )
+		buf->lastbusy = current_time();
+
+	/* Double until it fits, or until we hit the maximum. */
+	while( size - buf->full < room && size < max )
+		size *= 2;
+	if( size > max && max >= buf->size )
+		size = max;
+
+	if( size > buf->size )
+		resize_buffer( buf, size );
+
+	return buf->size - buf->full;
+}
+
+
+
+extern void buffer_shrink( Buffer *buf, long idle )
+{
+	long size = NET_BUFFER_MINSIZE;
+
+	if( buf->size <= NET_BUFFER_MINSIZE )
+		return;
+	if( current_time() - buf->lastbusy < idle )
+		return;
+
+	/* Retain the contents, of course. */
+	while( size < buf->full )
+		size *= 2;
+
+	if( size < buf->size )
+		resize_buffer( buf, size );
+}
+
+
+
+extern unsigned long buffer_cost( Buffer *buf )
+{
+	return malloc_cost( sizeof( Buffer ) ) +
+			malloc_cost( buf->size + NET_BUFFER_SLACK ) +
+			( buf->line ? line_cost( buf->line ) : 0 );
+}
+
+
+
+/* Reallocate the data of buf to hold size bytes (plus the slack). */
+static void resize_buffer( Buffer *buf, long size )
+{
+	buf->data = xrealloc( buf->data, size + NET_BUFFER_SLACK );
+	buf->size = size;
+}
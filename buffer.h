@@ -0,0 +1,83 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#ifndef MOOPROXY__HEADER__BUFFER
+#define MOOPROXY__HEADER__BUFFER
+
+
+
+#include <time.h>
+
+#include "line.h"
+
+
+
+/* Buffer type. A block of memory that starts small, and grows and shrinks
+ * with demand. The allocation is NET_BUFFER_SLACK bytes larger than size,
+ * so some additional things can be fit in even when the buffer is full.
+ * See (1) in world.c for details. */
+typedef struct Buffer Buffer;
+struct Buffer
+{
+	char *data;
+	/* Number of bytes in use. */
+	long full;
+	/* Number of bytes the buffer pretends to hold. */
+	long size;
+	/* The last time the buffer needed most of its size. */
+	time_t lastbusy;
+	/* A line too long to fit in the buffer, which is being written
+	 * piece by piece. lineoffset bytes of it have been written. */
+	Line *line;
+	long lineoffset;
+};
+
+
+
+/* Allocate and initialize a buffer of NET_BUFFER_MINSIZE bytes.
+ * Return value: the new buffer. */
+extern Buffer *buffer_create( void );
+
+/* Free the buffer and its data. */
+extern void buffer_destroy( Buffer *buf );
+
+/* Discard the contents of the buffer, including any partially written
+ * line. */
+extern void buffer_clear( Buffer *buf );
+
+/* Exchange the contents (data, size and fill) of buffers a and b. A
+ * partially written line stays where it is. */
+extern void buffer_swap( Buffer *a, Buffer *b );
+
+/* Try to make sure at least room bytes are free, by doubling the size of
+ * the buffer, but not beyond max bytes.
+ * Return value: the number of free bytes, which may be less than room. */
+extern long buffer_reserve( Buffer *buf, long room, long max );
+
+/* If the buffer has not been busy for at least idle seconds, shrink it
+ * to the smallest size that holds its contents. */
+extern void buffer_shrink( Buffer *buf, long idle );
+
+/* Return the estimated number of bytes of memory the buffer occupies,
+ * including allocator overhead (see malloc_cost()) and any partially
+ * written line. */
+extern unsigned long buffer_cost( Buffer *buf );
+
+
+
+#endif  /* ifndef MOOPROXY__HEADER__BUFFER */
@@ -31,6 +31,7 @@
 #include "daemon.h"
 #include "resolve.h"
 #include "recall.h"
+#include "spill.h"
 
 
 
@@ -58,6 +59,7 @@ static void command_uptime( World *wld, char *cmd, char *args );
 static void command_world( World *wld, char *cmd, char *args );
 static void command_forget( World *wld, char *cmd, char *args );
 static void command_authinfo( World *wld, char *cmd, char *args );
+static void command_memory( World *wld, char *cmd, char *args );
 
 
 
@@ -109,11 +111,16 @@ cmd_db[] =
 	"\n"
 	"Will recall the last <number> lines.\n"
 	"\n"
-	"  recall [from <timespec>] [to <timespec>] [search <text>]\n"
+	"  recall [from <timespec>] [to <timespec>] [case] [search <text>]\n"
+	"  recall [from <timespec>] [to <timespec>] [case] any|all <terms>\n"
+	"  recall [from <timespec>] [to <timespec>] [find <words>]\n"
 	"\n"
 	"Will recall the lines from <timespec> to <timespec> that match the\n"
-	"search <text>, where <text> is a case-insensitive primitive regexp\n"
-	"(supporting . and .*), and <timespec> is one or more of:\n"
+	"search <text>, where <text> is a POSIX extended regexp (case\n"
+	"insensitive, unless case is given), that contain any or all of the\n"
+	"space separated <terms> (likewise), or that contain all of the\n"
+	"<words>, using the word index of the logfiles. <timespec> is one or\n"
+	"more of:\n"
 	"\n"
 	"  now\n"
 	"  today\n"
@@ -127,11 +134,21 @@ cmd_db[] =
 	"Examples:\n"
 	"\n"
 	"  recall from 10:00 to 11:00 search gandalf.*morning\n"
+	"  recall from today case search ^(Gandalf|Frodo)\n"
 	"  recall from yesterday 16:00 to +20 lines\n"
 	"  recall from -30m search joke\n"
+	"  recall from 03/01 find gandalf ring\n"
+	"  recall from yesterday any frodo sam merry pippin\n"
 	"  recall from last monday to next wednesday search weather\n"
 	"  recall from 04/22 next wed 11:35 to +1 hour\n"
 	"\n"
+	"Lines older than the history are recalled from the logfiles.\n"
+	"\n"
+	"  recall more\n"
+	"  recall cancel\n"
+	"\n"
+	"A recall pauses after recall_page lines (if that's not 0). Use\n"
+	"recall more to continue it, or recall cancel to stop it.\n"
 	"For more details, see the README file.\n" },
 
 	{ "ace", command_ace, "[<C>x<R> | off]",
@@ -184,6 +201,13 @@ cmd_db[] =
 	"Shows some authentication information.",
 	NULL },
 
+	{ "memory", command_memory, "",
+	"Shows the memory usage of the world.",
+	"Shows an estimate of the memory used by this world, broken down\n"
+	"by line queue and buffer. The estimate includes the overhead of\n"
+	"the memory allocator, and is what buffer_size and logbuffer_size\n"
+	"are enforced against." },
+
 	{ NULL, NULL, NULL, NULL, NULL }
 };
 
@@ -769,6 +793,7 @@ static void command_settings( World *wld, char *cmd, char *args )
 static void command_recall( World *wld, char *cmd, char *args )
 {
 	Linequeue *queue;
+	Line *line;
 	long count;
 	char *str;
 
@@ -784,12 +809,25 @@ static void command_recall( World *wld, char *cmd, char *args )
 		return;
 	}
 
+	/* Continue or stop the recall in progress. */
+	if( !strcmp( args, "more" ) )
+	{
+		world_recall_more( wld );
+		return;
+	}
+	if( !strcmp( args, "cancel" ) )
+	{
+		world_recall_cancel( wld );
+		return;
+	}
+
 	/* We want to include the inactive lines in our recall as well, so
 	 * we move them to the history right now. */
 	world_inactive_to_history( wld );
 
 	/* Check if there are any lines to recall. */
-	if( wld->history_lines->count == 0 )
+	if( wld->history_lines->count == 0 &&
+			wld->spill_count[SPILL_HISTORY] == 0 )
 	{
 		world_msg_client( wld, "There are no lines to recall." );
 		return;
@@ -815,8 +853,11 @@ static void command_recall( World *wld, char *cmd, char *args )
 		return;
 	}
 
-	/* Get the recalled lines. */
+	/* Get the recalled lines. They may be overtaken by the lines from
+	 * the server. */
 	queue = world_recall_history( wld, count );
+	for( line = queue->head; line; line = line->next )
+		line->flags |= LINE_BULK;
 
 	/* Announce the recall. */
 	world_msg_client( wld, "Recalling %lu line%s.", queue->count,
@@ -993,7 +1034,8 @@ static void command_forget( World *wld, char *cmd, char *args )
 
 	world_inactive_to_history( wld );
 
-	linequeue_clear( wld->history_lines );
+	world_history_forget( wld );
+	world_spill_forget( wld );
 
 	world_msg_client( wld, "All history lines have been forgotten." );
 }
@@ -1049,3 +1091,14 @@ static void command_authinfo( World *wld, char *cmd, char *args )
 			"Refill rate: %i/sec.", wld->auth_tokenbucket,
 			NET_AUTH_BUCKETSIZE, NET_AUTH_TOKENSPERSEC );
 }
+
+
+
+/* Print the memory usage of the world. No arguments. */
+static void command_memory( World *wld, char *cmd, char *args )
+{
+	if( refuse_arguments( wld, cmd, args ) )
+		return;
+
+	world_memory_report( wld );
+}
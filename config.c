@@ -150,6 +150,12 @@ key_db[] =
 	"history to the client, in order to provide the user with\n"
 	"context. This setting sets the number of reproduced lines." },
 
+	{ 0, "recall_page", aset_recall_page, aget_recall_page,
+	"Lines /recall sends before it pauses.",
+	"The number of lines a /recall sends before it pauses, until\n"
+	"you ask for more with /recall more (or stop it with\n"
+	"/recall cancel). Set to 0 to never pause." },
+
 	{ 0, "buffer_size", aset_buffer_size, aget_buffer_size,
 	"Max memory to spend on new/history lines.",
 	"The maximum amount of memory in KiB used to hold history\n"
@@ -158,18 +164,52 @@ key_db[] =
 	"\n"
 	"If the amount of lines mooproxy receives from the server\n"
 	"while the client is not connected exceeds this amount of\n"
-	"memory, mooproxy will have to drop unread lines (but it will\n"
-	"still attempt to log those lines, see logbuffer_size)." },
+	"memory, mooproxy will move the oldest lines to disk (see\n"
+	"spill_size)." },
 
 	{ 0, "logbuffer_size", aset_logbuffer_size, aget_logbuffer_size,
 	"Max memory to spend on unlogged lines.",
 	"The maximum amount of memory in KiB used to hold loggable\n"
 	"lines that have not yet been written to disk.\n"
 	"\n"
-	"If your disk space runs out, and the amount of unlogged\n"
-	"lines exceeds this amount of memory, new lines will NOT be\n"
+	"If the log can't keep up (slow disk, disk full), and the\n"
+	"amount of unlogged lines exceeds this amount of memory,\n"
+	"mooproxy will move the newest lines to disk (see\n"
+	"log_spool_size). If that fails too, new lines will NOT be\n"
 	"logged." },
 
+	{ 0, "spill_size", aset_spill_size, aget_spill_size,
+	"Max disk space to spend on evicted lines.",
+	"The maximum amount of disk space in KiB used to hold lines\n"
+	"that no longer fit in buffer_size. Such lines are moved to a\n"
+	"spill file in ~/.mooproxy/spill/, and are still available\n"
+	"for recall, and as new lines when you connect.\n"
+	"\n"
+	"If this is exceeded as well, mooproxy will drop the oldest\n"
+	"lines from the spill file. Set to 0 to disable spilling." },
+
+	{ 0, "netbuffer_size", aset_netbuffer_size, aget_netbuffer_size,
+	"Max memory to spend on each network buffer.",
+	"The maximum size in KiB of each of the buffers used to send\n"
+	"and receive data, and to write the log. The buffers start\n"
+	"out small, grow when needed, and shrink again after some\n"
+	"minutes of little use.\n"
+	"\n"
+	"Lines longer than this still pass through intact, they\n"
+	"just take more than one read or write." },
+
+	{ 0, "line_limit", aset_line_limit, aget_line_limit,
+	"Max length of a line.",
+	"The maximum length in KiB of a single line received from the\n"
+	"server or the client. Longer lines are split. Memory for a\n"
+	"line is only taken as the line arrives, not in advance." },
+
+	{ 0, "intern_lines", aset_intern_lines, aget_intern_lines,
+	"Share memory between identical lines.",
+	"If true, lines from the server that are identical to a recent\n"
+	"line (like prompts and banners) share its memory, instead of\n"
+	"being stored separately." },
+
 	{ 0, "logging", aset_logging, aget_logging,
 	"Log everything from the server.",
 	"If true, mooproxy will log all lines from the server (and a\n"
@@ -180,6 +220,79 @@ key_db[] =
 	"If true, all logged lines are prefixed with a [HH:MM:SS]\n"
 	"timestamp." },
 
+	{ 0, "log_sync", aset_log_sync, aget_log_sync,
+	"When to make sure the log is on disk.",
+	"How often mooproxy makes sure written log data is actually\n"
+	"on disk (rather than just in the OS cache). One of:\n"
+	"  none:     never, leave it to the OS.\n"
+	"  interval: every log_sync_interval seconds.\n"
+	"  bytes:    every log_sync_bytes KiB.\n"
+	"  group:    like interval, but important mooproxy messages\n"
+	"            (like shutdown and day change) are synced right\n"
+	"            away, and reach the client only after that.\n"
+	"            Lines that arrive meanwhile are synced together." },
+
+	{ 0, "log_sync_interval", aset_log_sync_interval,
+	aget_log_sync_interval,
+	"Seconds between log syncs.",
+	"The number of seconds between log syncs, for log_sync\n"
+	"interval and group." },
+
+	{ 0, "log_sync_bytes", aset_log_sync_bytes, aget_log_sync_bytes,
+	"KiB between log syncs.",
+	"The amount of log data in KiB between log syncs, for\n"
+	"log_sync bytes." },
+
+	{ 0, "log_compress", aset_log_compress, aget_log_compress,
+	"Compress the logfiles.",
+	"The gzip compression level (1 to 9) for new logfiles, or 0\n"
+	"to write plain text. Compressed logfiles end in .log.gz,\n"
+	"and can be read with zcat or zless. They are flushed when\n"
+	"the log is synced (see log_sync), so after a crash they can\n"
+	"be read up to that point.\n"
+	"\n"
+	"A change takes effect with the next logfile." },
+
+	{ 0, "log_recompress", aset_log_recompress, aget_log_recompress,
+	"Recompress logfiles of earlier days.",
+	"If not 0, the logfile of a day is recompressed at this gzip\n"
+	"level (1 to 9) when the day is over, in the background, at\n"
+	"low priority. This also compresses plain logfiles. Use a\n"
+	"level higher than log_compress to save more disk space." },
+
+	{ 0, "log_spool_size", aset_log_spool_size, aget_log_spool_size,
+	"Max disk space to spend on unlogged lines.",
+	"The maximum amount of disk space in KiB used to hold\n"
+	"unlogged lines that no longer fit in logbuffer_size. Such\n"
+	"lines are moved to a spool file (see log_spool_dir), and\n"
+	"are logged once the log can keep up again. Lines still in\n"
+	"the spool when mooproxy stops are logged when it starts\n"
+	"again.\n"
+	"\n"
+	"If this is exceeded as well, new lines will NOT be logged.\n"
+	"Set to 0 to disable the log spool." },
+
+	{ 0, "log_spool_dir", aset_log_spool_dir, aget_log_spool_dir,
+	"Directory for the log spool.",
+	"The directory to put the log spool file in. Preferably on\n"
+	"another disk than the logs. If empty, ~/.mooproxy/spool/ is\n"
+	"used." },
+
+	{ 0, "log_tail", aset_log_tail, aget_log_tail,
+	"Offer the log as it's written on a local socket.",
+	"If true, mooproxy listens on the unix domain socket\n"
+	"~/.mooproxy/tail/<world>. Programs connecting to it receive\n"
+	"each logged line as it is logged. A program can send a line\n"
+	"of text to only receive the lines containing that text, or\n"
+	"an empty line to receive all lines again." },
+
+	{ 0, "log_tail_queue", aset_log_tail_queue, aget_log_tail_queue,
+	"Max memory to spend on each log tail subscriber.",
+	"The maximum amount of memory in KiB used to hold lines for\n"
+	"a program connected to the log tail (see log_tail). If the\n"
+	"program can't keep up, lines that don't fit are dropped, and\n"
+	"the program is told how many." },
+
 	{ 1, "easteregg_version", aset_easteregg_version,
 	aget_easteregg_version, NULL, NULL },
 
@@ -580,6 +693,21 @@ extern int create_configdirs( char **err )
 		goto create_failed;
 	free( path );
 
+	xasprintf( &path, "%s/%s/%s", get_homedir(), CONFIGDIR, SPILLDIR );
+	if( attempt_createdir( path, &errstr ) )
+		goto create_failed;
+	free( path );
+
+	xasprintf( &path, "%s/%s/%s", get_homedir(), CONFIGDIR, SPOOLDIR );
+	if( attempt_createdir( path, &errstr ) )
+		goto create_failed;
+	free( path );
+
+	xasprintf( &path, "%s/%s/%s", get_homedir(), CONFIGDIR, TAILDIR );
+	if( attempt_createdir( path, &errstr ) )
+		goto create_failed;
+	free( path );
+
 	return 0;
 
 create_failed:
@@ -31,6 +31,9 @@
 #define WORLDSDIR "worlds"
 #define LOGSDIR "logs"
 #define LOCKSDIR "locks"
+#define SPILLDIR "spill"
+#define SPOOLDIR "spool"
+#define TAILDIR "tail"
 
 /* Some default option values */
 #define DEFAULT_AUTOLOGIN 0
@@ -40,10 +43,24 @@
 #define DEFAULT_NEWINFOSTRING "%C%% "
 #define DEFAULT_LOGGING 1
 #define DEFAULT_CONTEXTLINES 100
+#define DEFAULT_RECALLPAGE 0
 #define DEFAULT_BUFFERSIZE 4096
 #define DEFAULT_LOGBUFFERSIZE 4096
+#define DEFAULT_SPILLSIZE 65536
+#define DEFAULT_NETBUFFERSIZE 64
+#define DEFAULT_LINELIMIT 1024
+#define DEFAULT_INTERNLINES 1
 #define DEFAULT_STRICTCMDS 1
 #define DEFAULT_LOGTIMESTAMPS 1
+#define DEFAULT_LOGSYNC LOG_SYNC_INTERVAL
+#define DEFAULT_LOGSYNCINTERVAL 60
+#define DEFAULT_LOGSYNCBYTES 1024
+#define DEFAULT_LOGCOMPRESS 0
+#define DEFAULT_LOGRECOMPRESS 0
+#define DEFAULT_LOGSPOOLSIZE 65536
+#define DEFAULT_LOGSPOOLDIR ""
+#define DEFAULT_LOGTAIL 0
+#define DEFAULT_LOGTAILQUEUE 256
 #define DEFAULT_EASTEREGGS 1
 
 /* Parameters for the token bucket controlling authentication attempts. */
@@ -60,12 +77,45 @@
 /* Maximum number of characters accepted from an authenticating client.
  * This effectively also limits the authentication string length */
 #define NET_MAXAUTHLEN 128
-/* Size of blocks-to-lines buffer in bytes.
- * Note that this limits the maximum line length. */
-#define NET_BBUFFER_LEN 65536
-/* The actual size (rather than "pretend size") of the buffers.
+/* Initial (and minimum) size of the network and log buffers in bytes.
+ * They grow on demand, up to netbuffer_size. */
+#define NET_BUFFER_MINSIZE 1024
+/* The number of bytes allocated beyond the "pretend size" of the buffers.
  * See (1) in world.c for details. */
-#define NET_BBUFFER_ALLOC ( NET_BBUFFER_LEN + 512 )
+#define NET_BUFFER_SLACK 512
+/* Buffers that have not been busy for this many seconds are shrunk. */
+#define NET_BUFFER_IDLE 300
+/* Live lines and bulk lines (replays and recalls) take turns going to the
+ * client, by deficit round robin. Each turn, they may send this many bytes
+ * of lines, so live lines get four times the bandwidth of bulk lines when
+ * both are waiting. Bulk lines are only added while the client transmit
+ * buffer and the socket together hold less than NET_BULK_BUFFERED bytes, so
+ * a live line never waits behind much of them. Bulk lines held back this
+ * way are looked at again after NET_BULK_POLL microseconds, twice as long
+ * each time they're still held back, up to NET_BULK_POLL_MAX. */
+#define NET_LIVE_QUANTUM 4096
+#define NET_BULK_QUANTUM 1024
+#define NET_BULK_BUFFERED 32768
+#define NET_BULK_POLL 2000
+#define NET_BULK_POLL_MAX 128000
+/* The number of slots in the table used to share the text of identical
+ * lines from the server. */
+#define INTERN_TABLE_SIZE 1024
+/* Put every this many history lines in the time index. Each such block of
+ * lines gets a bloom filter of this many bytes, of the trigrams in them,
+ * so searches can pass over the blocks that can't have a match. The main
+ * loop adds at most HISTORY_BLOOM_BUDGET bytes of lines to them at a time. */
+#define HISTORY_INDEX_STEP 64
+#define HISTORY_BLOOM_SIZE 256
+#define HISTORY_BLOOM_BUDGET 16384
+/* Put every this many records of the spill file in its time index. Each
+ * such block of records gets a bloom filter of this many bytes, of the
+ * words in them (see logindex.h). */
+#define SPILL_INDEX_STEP 64
+#define SPILL_BLOOM_SIZE 128
+/* When a client connects, spilled new lines are passed to it at most this
+ * many at a time, once it has taken the previous ones. */
+#define SPILL_REPLAY_BATCH 256
 
 /* The maximum time in seconds to delay between two autoreconnects. */
 #define AUTORECONNECT_MAX_DELAY 1800
@@ -75,12 +125,21 @@
 /* The minimum number of seconds between two identical complaints about
  * the logfiles */
 #define LOG_MSGINTERVAL 600
+/* The maximum number of subscribers to the log tail, and the maximum
+ * length of a filter they can send. */
+#define LOGTAIL_MAXSUBS 8
+#define LOGTAIL_MAXFILTER 256
 /* The minimum number of seconds between two "not connected" messages.*/
 #define NOTCONN_MSGINTERVAL 3
 
 /* The strftime() format, and string length of the log timestamp. */
 #define LOG_TIMESTAMP_FORMAT "[%H:%M:%S] "
 #define LOG_TIMESTAMP_LENGTH 11
+/* The length of an entry in the index of a logfile ("HH:MM offset\n"). */
+#define LOG_INDEX_ENTRYLEN 19
+/* The number of seconds before midnight the logfile of the next day is
+ * opened, so the switch at midnight is quick. */
+#define LOG_PREPARE_AHEAD 300
 
 /* When malloc() fails, mooproxy will sleep for a bit and then try again.
  * This setting determines how often mooproxy will try before giving up. */
@@ -24,9 +24,8 @@
 
 
 
-/* The estimated memory cost of a line object: the size of the object itself,
- * and some random guess at memory management overhead */
-#define LINE_BYTE_COST ( sizeof( Line ) + sizeof( void * ) * 2 + 8 )
+static void add_holder( Sharedstr *shared, Line *line );
+static void release_shared( Line *line );
 
 
 
@@ -42,6 +41,12 @@ extern Line *line_create( char *str, long len )
 	line->next = NULL;
 	line->time = current_time();
 	line->day = current_day();
+	line->shared = NULL;
+	line->sharenext = NULL;
+	line->shareprev = NULL;
+	line->cost = malloc_cost( sizeof( Line ) ) +
+			malloc_cost( line->len + 1 );
+	line->queue = NULL;
 
 	return line;
 }
@@ -50,7 +55,9 @@ extern Line *line_create( char *str, long len )
 
 extern void line_destroy( Line *line )
 {
-	if( line )
+	if( line && line->shared )
+		release_shared( line );
+	else if( line )
 		free( line->str );
 	free( line );
 }
@@ -62,8 +69,19 @@ extern Line *line_dup( Line *line )
 	Line *newline;
 
 	newline = xmalloc( sizeof( Line ) );
-	newline->str = xmalloc( line->len + 1 );
-	strcpy( newline->str, line->str );
+	newline->shared = line->shared;
+	if( line->shared )
+	{
+		newline->str = line->str;
+		newline->cost = malloc_cost( sizeof( Line ) );
+		add_holder( line->shared, newline );
+	}
+	else
+	{
+		newline->str = xmalloc( line->len + 1 );
+		strcpy( newline->str, line->str );
+		newline->cost = line->cost;
+	}
 	newline->len = line->len;
 	newline->flags = line->flags;
 	newline->time = line->time;
@@ -71,12 +89,120 @@ extern Line *line_dup( Line *line )
 
 	newline->prev = NULL;
 	newline->next = NULL;
+	newline->queue = NULL;
 
 	return newline;
 }
 
 
 
+extern Line *line_intern( Interntable *tab, char *str, long len )
+{
+	unsigned long hash = 2166136261UL;
+	Sharedstr *shared = NULL, **slot = NULL;
+	Line *line;
+	long i;
+
+	/* FNV-1a, it's fast and good enough for this. */
+	if( tab != NULL )
+	{
+		for( i = 0; i < len; i++ )
+			hash = ( hash ^ (unsigned char) str[i] ) * 16777619UL;
+		slot = &tab->slots[hash % tab->size];
+		shared = *slot;
+	}
+
+	line = xmalloc( sizeof( Line ) );
+
+	if( shared != NULL && shared->len == len &&
+			!memcmp( shared->str, str, len ) )
+	{
+		/* A hit. The line just joins the others using it. */
+		tab->hits++;
+		line->cost = malloc_cost( sizeof( Line ) );
+		add_holder( shared, line );
+	}
+	else
+	{
+		/* Evict the previous occupant of the slot (if any), the
+		 * lines using it keep it. Put a new copy in its place. */
+		if( shared != NULL )
+			shared->slot = NULL;
+
+		shared = xmalloc( sizeof( Sharedstr ) + len );
+		memcpy( shared->str, str, len );
+		shared->str[len] = '\0';
+		shared->slot = slot;
+		shared->cost = malloc_cost( sizeof( Sharedstr ) + len );
+		shared->len = len;
+		if( slot != NULL )
+			*slot = shared;
+		line->cost = malloc_cost( sizeof( Line ) ) + shared->cost;
+		line->sharenext = NULL;
+		line->shareprev = NULL;
+		shared->holders = line;
+	}
+
+	line->str = shared->str;
+	line->shared = shared;
+	line->len = len;
+	line->flags = LINE_REGULAR;
+	line->prev = NULL;
+	line->next = NULL;
+	line->time = current_time();
+	line->day = current_day();
+	line->queue = NULL;
+
+	return line;
+}
+
+
+
+extern unsigned long line_cost( Line *line )
+{
+	/* Calculated once, when the line was created. */
+	return line->cost;
+}
+
+
+
+extern Interntable *interntable_create( unsigned long size )
+{
+	Interntable *tab;
+	unsigned long i;
+
+	tab = xmalloc( sizeof( Interntable ) );
+	tab->slots = xmalloc( size * sizeof( Sharedstr * ) );
+	tab->size = size;
+	tab->hits = 0;
+
+	for( i = 0; i < size; i++ )
+		tab->slots[i] = NULL;
+
+	return tab;
+}
+
+
+
+extern void interntable_destroy( Interntable *tab )
+{
+	unsigned long i;
+
+	if( tab == NULL )
+		return;
+
+	/* Detach the strings from the table, the lines using them will
+	 * free them eventually. */
+	for( i = 0; i < tab->size; i++ )
+		if( tab->slots[i] != NULL )
+			tab->slots[i]->slot = NULL;
+
+	free( tab->slots );
+	free( tab );
+}
+
+
+
 extern Linequeue *linequeue_create( void )
 {
 	Linequeue *queue;
@@ -143,7 +269,8 @@ extern void linequeue_append( Linequeue *queue, Line *line )
 	queue->tail = line;
 
 	queue->count++;
-	queue->size += line->len + LINE_BYTE_COST;
+	queue->size += line_cost( line );
+	line->queue = queue;
 }
 
 
@@ -178,10 +305,11 @@ extern Line *linequeue_remove( Linequeue *queue, Line *line )
 		queue->head = line->next;
 
 	queue->count--;
-	queue->size -= line->len + LINE_BYTE_COST;
+	queue->size -= line_cost( line );
 
 	line->prev = NULL;
 	line->next = NULL;
+	line->queue = NULL;
 	return line;
 }
 
@@ -189,10 +317,15 @@ extern Line *linequeue_remove( Linequeue *queue, Line *line )
 
 extern void linequeue_merge( Linequeue *one, Linequeue *two )
 {
+	Line *line;
+
 	/* If the second list is empty, nop. */
 	if( two->head == NULL || two->tail == NULL )
 		return;
 
+	for( line = two->head; line != NULL; line = line->next )
+		line->queue = one;
+
 	/* If the first list is empty, simply copy the references. */
 	if( one->head == NULL || one->tail == NULL )
 	{
@@ -215,3 +348,50 @@ extern void linequeue_merge( Linequeue *one, Linequeue *two )
 	two->count = 0;
 	two->size = 0;
 }
+
+
+
+/* Add line to the lines using shared. It goes after the first one, which
+ * keeps paying for the string. */
+static void add_holder( Sharedstr *shared, Line *line )
+{
+	Line *first = shared->holders;
+
+	line->shareprev = first;
+	line->sharenext = first->sharenext;
+	if( first->sharenext != NULL )
+		first->sharenext->shareprev = line;
+	first->sharenext = line;
+}
+
+
+
+/* Remove line from the lines using its shared string. If it paid for the
+ * string, the next one pays from now on. If it was the last one, remove
+ * the string from its interning table slot (if any), and free it. */
+static void release_shared( Line *line )
+{
+	Sharedstr *shared = line->shared;
+	Line *heir;
+
+	if( line->sharenext != NULL )
+		line->sharenext->shareprev = line->shareprev;
+	if( line->shareprev != NULL )
+	{
+		line->shareprev->sharenext = line->sharenext;
+		return;
+	}
+
+	heir = shared->holders = line->sharenext;
+	if( heir != NULL )
+	{
+		heir->cost += shared->cost;
+		if( heir->queue != NULL )
+			heir->queue->size += shared->cost;
+		return;
+	}
+
+	if( shared->slot != NULL )
+		*shared->slot = NULL;
+	free( shared );
+}
@@ -30,6 +30,8 @@
 #define LINE_DONTBUF 0x00000002 /* Don't buffer the line. */
 #define LINE_NOHIST  0x00000004 /* Don't put the line in history. */
 #define LINE_LOGONLY 0x00000008 /* Only send to the log. */
+#define LINE_SYNC    0x00000010 /* Sync the log before passing it on. */
+#define LINE_BULK    0x00000020 /* Replayed or recalled, may be overtaken. */
 
 /* Regular server->client or client->server lines. */
 #define LINE_REGULAR ( 0 )
@@ -37,8 +39,10 @@
 #define LINE_MCP ( LINE_DONTLOG | LINE_DONTBUF | LINE_NOHIST )
 /* Mooproxy checkpoint message.
  * These are mooproxy messages that are so important that they
- * deserve to be buffered and logged (e.g. day rollover, shutdown). */
-#define LINE_CHECKPOINT ( 0 )
+ * deserve to be buffered and logged (e.g. day rollover, shutdown).
+ * With log_sync = group, they also reach the client only after they
+ * have been synced to disk. */
+#define LINE_CHECKPOINT ( LINE_SYNC )
 /* Mooproxy normal message (e.g. /settings output). */
 #define LINE_MESSAGE ( LINE_DONTLOG | LINE_NOHIST )
 /* Recalled lines, like context and possibly-new. */
@@ -46,8 +50,39 @@
 
 
 
-/* Line type */
 typedef struct Line Line;
+typedef struct Linequeue Linequeue;
+
+/* Shared string type. A string which is shared by several lines with
+ * identical text. See line_intern(). */
+typedef struct Sharedstr Sharedstr;
+struct Sharedstr
+{
+	/* The interning table slot pointing to this string, or NULL. */
+	Sharedstr **slot;
+	/* The lines using this string, linked through their sharenext and
+	 * shareprev. The first of them pays for the string: its cost
+	 * includes the cost of the string. */
+	Line *holders;
+	/* The cost of the string, see malloc_cost(). */
+	unsigned long cost;
+	long len;
+	/* The string itself. Allocated along with the structure. */
+	char str[1];
+};
+
+/* Interning table type. Remembers, for each hash slot, the most recently
+ * received string, so identical lines that follow can share it. */
+typedef struct Interntable Interntable;
+struct Interntable
+{
+	Sharedstr **slots;
+	unsigned long size;
+	/* Number of lines that found their string in the table. */
+	unsigned long hits;
+};
+
+/* Line type */
 struct Line
 {
 	char *str;
@@ -57,17 +92,26 @@ struct Line
 	long day;     /* Day of the line's creation. Used in logging. */
 	time_t time;  /* Time of the line's creation. */
 	int flags;
+	/* If not NULL, str belongs to this shared string, and these are
+	 * the other lines using it. */
+	Sharedstr *shared;
+	Line *sharenext;
+	Line *shareprev;
+	/* The number of bytes accounted to this line. See line_cost(). */
+	unsigned long cost;
+	/* The queue the line is in, or NULL. */
+	Linequeue *queue;
 };
 
 /* Linequeue type */
-typedef struct Linequeue Linequeue;
 struct Linequeue
 {
 	Line *head;
 	Line *tail;
 	/* Number of lines in this queue. */
 	unsigned long count;
-	/* Total number of bytes this queue occupies. */
+	/* Total number of bytes the lines in this queue occupy, including
+	 * the estimated allocator overhead. See line_cost(). */
 	unsigned long size;
 };
 
@@ -84,9 +128,34 @@ extern Line *line_create( char *str, long len );
 extern void line_destroy( Line *line );
 
 /* Duplicate line (and its string). All fields are copied, except for
- * prev and next, which are set to NULL. Returns the new line. */
+ * prev and next, which are set to NULL. If the string of line is shared,
+ * the new line shares it too. Returns the new line. */
 extern Line *line_dup( Line *line );
 
+/* Like line_create(), but the len bytes at str are copied rather than
+ * consumed. If the table holds an identical string, the new line shares
+ * that string. Otherwise, the copy is placed in the table, so later lines
+ * can share it. The string in the table is replaced by any newer string
+ * that hashes to the same slot, so only recent lines are shared.
+ * If tab is NULL, nothing is looked up or remembered, but the string is
+ * still allocated as a shared string, so line_dup() can share it. */
+extern Line *line_intern( Interntable *tab, char *str, long len );
+
+/* Return the estimated number of bytes of memory line occupies: the line
+ * object and its string, including allocator overhead (see malloc_cost()).
+ * A shared string is accounted to one of the lines using it. When that line
+ * is destroyed, the cost moves on to another one, and to the size of its
+ * queue. */
+extern unsigned long line_cost( Line *line );
+
+/* Allocate and initialize an interning table with size slots.
+ * Return value: the new table. */
+extern Interntable *interntable_create( unsigned long size );
+
+/* Destroy the table. Shared strings remain valid for the lines using
+ * them. */
+extern void interntable_destroy( Interntable *tab );
+
 /* Allocate and initialize a line queue. The queue is empty.
  * Return value: the new queue. */
 extern Linequeue *linequeue_create( void );
@@ -16,6 +16,7 @@
 
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -24,73 +25,285 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <zlib.h>
 
 #include "global.h"
 #include "world.h"
 #include "log.h"
 #include "misc.h"
 #include "line.h"
+#include "logspool.h"
+#include "logindex.h"
+#include "logtail.h"
+
+
+
+/* The size of the buffer for compressed data, in the writer thread. */
+#define LOG_ZBUFSIZE 16384
+
+/* States of the log writer job. */
+#define JOB_IDLE 0   /* No job, the main thread owns the job. */
+#define JOB_QUEUED 1 /* Job handed to the writer thread, which owns it. */
+#define JOB_DONE 2   /* Job done, results are waiting for the main thread. */
+
+/* A task for the logfile of an earlier day, on a thread of its own at low
+ * priority. The main thread sets stop to make the task give up, the task
+ * sets done when it's done, with status 0 on success. Both are accessed
+ * atomically. */
+typedef struct Logtask Logtask;
+struct Logtask
+{
+	pthread_t thread;
+	/* The logfile, or NULL if there's no task. */
+	char *file;
+	int level;
+	int stop;
+	int done;
+	int status;
+};
+
+/* The log writer thread. The main thread renders lines into log_buffer,
+ * and hands the filled buffer to the writer thread by swapping it with
+ * the (empty) job buffer. The writer thread writes the job buffer to the
+ * logfile, while the main thread goes on filling log_buffer. So writes
+ * (and syncs) to a slow disk never stall the main thread.
+ *
+ * The job fields are owned by the thread indicated by state, which is
+ * only accessed atomically. The main thread wakes the writer thread
+ * through a semaphore. The writer thread wakes the main thread by
+ * writing a byte to a pipe, the read end of which is log_writer_fd.
+ *
+ * If the logfile is compressed, the writer thread does the compressing.
+ * The data is flushed out of the compressor at every sync (or every
+ * log_sync_interval seconds, if log_sync is none), so after a crash the
+ * logfile can be read up to that point.
+ *
+ * Along with the logfile, the writer thread maintains its index. The main
+ * thread marks the positions in log_buffer where a new minute starts, and
+ * hands the marks over along with the buffer. It also maintains the journal
+ * of the word index (see logindex.h). When a day is over, the index is
+ * compacted on a thread of its own, so logging goes on meanwhile. */
+typedef struct Logmark Logmark;
+struct Logmark
+{
+	/* Position in the buffer. */
+	long pos;
+	/* The minute, as HH:MM. */
+	char minute[6];
+};
+
+/* A logfile that has been opened, along with its index and the journal
+ * of its word index. */
+typedef struct Logfile Logfile;
+struct Logfile
+{
+	char *file;
+	/* The day of the logfile, as YYYY-MM-DD, and its compression. */
+	char date[11];
+	int level;
+	int fd;
+	int idxfd;
+	int jnlfd;
+	/* The amount of text in the logfile when it was opened. */
+	long textpos;
+};
+
+struct Logwriter
+{
+	pthread_t thread;
+	sem_t wakeup;
+	int notify[2];
+	int state;
+
+	/* The job. */
+	Buffer *buf;
+	Logmark *marks;
+	long nmarks;
+	long marksalloc;
+	int fd;
+	int idxfd;
+	int jnlfd;
+	long textstart;
+	int stamps;
+	int level;
+	int sync;
+	int flush;
+	int close;
+	int quit;
+	int errnum;
+
+	/* The compressor, and compressed data that could not be written
+	 * yet. Owned like the job. */
+	z_stream zs;
+	int zactive;
+	char zbuf[LOG_ZBUFSIZE];
+	long zlen;
+
+	/* Number of LINE_SYNC lines in the job buffer. */
+	long syncs;
+
+	/* Indexing the words in the logfile. Private to the writer thread. */
+	Logtokenizer tok;
+
+	/* Private to the main thread. */
+	long submitted;
+	int wantsync;
+	int wantflush;
+	time_t retryat;
+	/* The logfile that's open, its index, its compression level, and
+	 * the one that is being closed, if it should be recompressed
+	 * afterwards. Also the journal of its word index, and the amount of
+	 * text in it when it was opened (or -1 if the writer thread has been
+	 * told). */
+	char *file;
+	int fileidxfd;
+	int filejnlfd;
+	long filetextpos;
+	int filestamps;
+	int filelevel;
+	char *closing;
+	/* The minute marks in log_buffer, and the minute of the last line
+	 * rendered (in minutes since the epoch). */
+	Logmark *bufmarks;
+	long nbufmarks;
+	long bufmarksalloc;
+	time_t lastminute;
+	/* The directory with the logs of the world, and the directory of
+	 * the month (YYYY-MM) we're logging in, kept open so the logfile of
+	 * the next day can be opened without walking the whole path. */
+	int dirfd;
+	int monthfd;
+	char month[8];
+	/* The logfile of the next day, if it has been opened ahead of time
+	 * (see world_log_prepare_next()). */
+	Logfile next;
+	/* Recompressing a logfile, and that logfile (without .gz). */
+	Logtask recompress;
+	char *recompressing;
+	/* Compacting the word index of a logfile. Also the logfile that's
+	 * being closed whose index is to be compacted next, and the closed
+	 * one whose index is waiting to be compacted. */
+	Logtask compaction;
+	char *compact;
+	char *compactnext;
+	/* Number of LINE_SYNC lines in log_buffer. */
+	long syncs_inbuf;
+	/* Bytes written since the last sync, and the time of that sync. */
+	long unsynced;
+	time_t lastsync;
+};
 
 
 
 static void update_one_link( World *wld, char *link, time_t timestamp );
+static char *open_logdirs( World *wld, time_t timestamp, char **file,
+		char **err );
+static void close_logdirs( Logwriter *lw );
+static char *open_logfile( World *wld, time_t timestamp, Logfile *lf,
+		char **err );
+static void discard_next( Logwriter *lw );
+static void close_if_empty( int fd, char *file );
 static void log_init( World *, time_t );
 static void log_deinit( World * );
 static void log_write( World * );
+static void log_render( World * );
+static long render_line( World *wld, char *dst, Line *line );
+static void add_mark( Logwriter *lw, long pos, time_t t );
 static void nag_client_error( World *, char *, char *, char * );
-
-
-
-extern void world_log_line( World *wld, Line *line )
+static int writer_start( World *wld, char **err );
+static void *writer_main( void *arg );
+static int writer_write( Logwriter *lw );
+static int writer_put( Logwriter *lw, char *data, long len, int flush,
+		long *used );
+static void writer_index( Logwriter *lw, Logmark *mark );
+static int write_all( int fd, char *data, long len, long *done );
+static void writer_take_buffer( World *wld );
+static void writer_submit( Logwriter *lw, int fd, int sync, int flush,
+		int close, int quit );
+static void writer_collect( World *wld );
+static void writer_wait( World *wld );
+static int writer_busy( World *wld );
+static void release_held( World *wld );
+static int task_start( World *wld, Logtask *task, char *file, int level,
+		void *(*main)( void * ) );
+static int task_finished( Logtask *task );
+static void task_stop( Logtask *task );
+static void task_nice( void );
+static void recompress_start( World *wld, char *file );
+static void recompress_cancel( World *wld, char *file );
+static void *recompress_main( void *arg );
+static void compact_start( World *wld );
+static void compact_cancel( World *wld, char *file );
+static void *compact_main( void *arg );
+static char *strip_gz( char *file );
+
+
+
+extern int world_log_line( World *wld, Line *line )
 {
-	Line *newline;
-	char *str;
-	long len;
-
-	/* Do we prepend a timestamp? */
-	if( wld->log_timestamps )
+	Line *copy;
+	int hold = 0;
+
+	/* Queue a copy of the line. If the string of the line is shared,
+	 * the copy shares it too, so usually just the line object itself is
+	 * allocated. Once the line is evicted from history, the copy pays
+	 * for the string (see line_cost()), so it counts towards
+	 * logbuffer_size then. The timestamp and stripping of ANSI are done
+	 * when the line is rendered into the log buffer, see log_render(). */
+	copy = line_dup( line );
+
+	/* With group commit, the line should be synced to disk before
+	 * the client gets it. */
+	if( wld->log_sync == LOG_SYNC_GROUP && line->flags & LINE_SYNC )
 	{
-		/* First, make sure the timestamp is up to date. */
-		if( wld->log_currenttime != line->time )
-		{
-			free( wld->log_currenttimestr );
-			wld->log_currenttimestr = xstrdup( time_string(
-				line->time, LOG_TIMESTAMP_FORMAT ) );
-			wld->log_currenttime = line->time;
-		}
-
-		/* Duplicate the line, but with ANSI stripped,
-		 * prepending the timestamp. */
-		str = xmalloc( line->len + 1 + LOG_TIMESTAMP_LENGTH );
-		strcpy( str, wld->log_currenttimestr );
-		len = strcpy_noansi( str + LOG_TIMESTAMP_LENGTH, line->str );
-		len += LOG_TIMESTAMP_LENGTH;
+		wld->log_syncs_wanted++;
+		hold = 1;
 	}
 	else
-	{
-		/* Duplicate the line, but with ANSI stripped. */
-		str = xmalloc( line->len + 1 );
-		len = strcpy_noansi( str, line->str );
-	}
+		copy->flags &= ~LINE_SYNC;
 
-	/* Process the string into a logline. */
-	str = xrealloc( str, len + 1 );
-	newline = line_create( str, len );
-	newline->flags = line->flags;
-	newline->time = line->time;
-	newline->day = line->day;
+	/* Subscribers to the log tail get the line right away. */
+	world_logtail_line( wld, line );
 
-	/* Put the new line in the to-be-logged queue. */
-	linequeue_append( wld->log_queue, newline );
+	/* While the log spool holds lines, newer lines go there as well, so
+	 * they stay in order. */
+	if( wld->logspool_count > 0 && !world_logspool_append( wld, copy ) )
+		line_destroy( copy );
+	else
+		linequeue_append( wld->log_queue, copy );
+
+	return hold;
 }
 
 
 
 extern void world_flush_client_logqueue( World *wld )
 {
+	/* Process the results of the log writer thread, if any, and pass
+	 * on the lines that were waiting for them. */
+	writer_collect( wld );
+	release_held( wld );
+
+	/* Once the logfile is being written again, and there's room in
+	 * memory, take lines back from the log spool. */
+	if( wld->logspool_count > 0 && wld->log_queue->count == 0 &&
+			wld->log_lasterror == NULL )
+	{
+		unsigned long used = world_logbuffer_usage( wld );
+		unsigned long room = wld->logbuffer_size * 1024 / 2;
+
+		if( used < room )
+			world_logspool_drain( wld, room - used );
+	}
+
 	/* See if there's anything to log at all */
 	if( wld->log_queue->count + wld->log_current->count +
-			wld->log_bfull == 0 )
+			world_log_unwritten( wld ) == 0 )
 	{
 		/* If:
 		 *   - There's nothing to log, and
@@ -124,7 +337,8 @@ extern void world_flush_client_logqueue( World *wld )
 			wld->log_lasterror = NULL;
 		}
 
-		/* Nothing to log, we're done. */
+		/* Nothing to log, but perhaps a sync to do. */
+		log_write( wld );
 		return;
 	}
 
@@ -134,13 +348,18 @@ extern void world_flush_client_logqueue( World *wld )
 	{
 		/* If the current day queue is empty, and there are lines
 		 * from a different day waiting, the current day is done. */
-		if( wld->log_current->count + wld->log_bfull == 0 &&
+		if( wld->log_current->count + world_log_unwritten( wld ) == 0 &&
 			wld->log_queue->head->day != wld->log_currentday )
 		{
 			/* Close the current logfile.
-			 * A new one will be opened automatically. */
+			 * A new one will be opened automatically. If the
+			 * writer thread still holds on to it (a sync, or
+			 * data left over from a failed write), try again
+			 * later, or the new day ends up in the old file. */
 			log_deinit( wld );
-			wld->log_currentday = wld->log_queue->head->day;
+			if( wld->log_fd == -1 )
+				wld->log_currentday =
+					wld->log_queue->head->day;
 			return;
 		}
 
@@ -162,14 +381,156 @@ extern void world_flush_client_logqueue( World *wld )
 
 
 
-extern void world_sync_logdata( World *wld )
+extern long world_log_unwritten( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+	long unwritten = wld->log_buffer->full;
+
+	if( lw == NULL )
+		return unwritten;
+
+	/* While the writer thread is busy, we can't look at its buffers.
+	 * When it's idle, they hold what a failed write left over. */
+	if( __atomic_load_n( &lw->state, __ATOMIC_ACQUIRE ) == JOB_IDLE )
+		return unwritten + lw->buf->full + lw->zlen;
+	else
+		return unwritten + lw->submitted;
+}
+
+
+
+extern unsigned long world_log_writer_cost( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+
+	if( lw == NULL )
+		return 0;
+
+	/* The compressor state is about 256 KiB, see zconf.h. */
+	return malloc_cost( sizeof( Logwriter ) ) + buffer_cost( lw->buf ) +
+			( ( lw->filelevel > 0 ) ? ( 1 << 17 ) + ( 1 << 17 ) +
+			6 * 1024 : 0 );
+}
+
+
+
+extern void world_log_handle_writer_fd( World *wld )
+{
+	char junk[64];
+
+	/* Just drain the pipe. world_flush_client_logqueue() will process
+	 * the results. */
+	while( read( wld->log_writer_fd, junk, sizeof( junk ) ) > 0 )
+		continue;
+}
+
+
+
+extern void world_log_stop( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+	int fd = wld->log_fd;
+	long lost;
+
+	if( lw == NULL )
+	{
+		if( fd > -1 )
+			close( fd );
+		wld->log_fd = -1;
+		return;
+	}
+
+	/* Wait for the current job to finish. */
+	writer_wait( wld );
+	writer_collect( wld );
+
+	/* Write whatever we can still write: the data left over from a
+	 * failed write first, then the rest of the lines of the day, a
+	 * buffer at a time. Give up at the first failure. */
+	while( wld->log_queue->count > 0 && wld->log_queue->head->day ==
+			wld->log_currentday )
+		linequeue_append( wld->log_current,
+				linequeue_pop( wld->log_queue ) );
+	while( fd > -1 )
+	{
+		if( lw->buf->full == 0 && lw->zlen == 0 )
+		{
+			log_render( wld );
+			if( wld->log_buffer->full == 0 )
+				break;
+			writer_take_buffer( wld );
+		}
+		writer_submit( lw, fd, 0, 0, 0, 0 );
+		writer_wait( wld );
+		writer_collect( wld );
+		if( lw->errnum != 0 )
+			break;
+	}
+
+	/* Have the thread sync, close the logfile, and exit. */
+	writer_submit( lw, fd, fd > -1 && wld->log_sync != LOG_SYNC_NONE, 0,
+			fd > -1, 1 );
+	pthread_join( lw->thread, NULL );
+
+	/* Whatever is left now is lost. Say so. */
+	lost = wld->log_queue->count + wld->log_current->count +
+			( wld->log_buffer->full + lw->buf->full ) / 80;
+	if( lost > 0 )
+		world_msg_client( wld, "Approximately %li loggable lines "
+				"could not be written to the logfile, and are "
+				"lost.", lost );
+
+	discard_next( lw );
+	close_logdirs( lw );
+	close( lw->notify[0] );
+	close( lw->notify[1] );
+	sem_destroy( &lw->wakeup );
+	buffer_destroy( lw->buf );
+	free( lw->marks );
+	free( lw->bufmarks );
+	free( lw->tok.out );
+	free( lw->file );
+	free( lw->closing );
+	task_stop( &lw->recompress );
+	free( lw->recompressing );
+	task_stop( &lw->compaction );
+	free( lw->compact );
+	free( lw->compactnext );
+	free( lw );
+
+	wld->log_writer = NULL;
+	wld->log_writer_fd = -1;
+	wld->log_fd = -1;
+}
+
+
+
+extern void world_log_prepare_next( World *wld, time_t t )
 {
-	if( wld->log_fd == -1 )
+	Logwriter *lw = wld->log_writer;
+	time_t next = t + LOG_PREPARE_AHEAD;
+	char *err = NULL;
+
+	/* Only while we're logging, and only if it's nearly midnight. */
+	if( lw == NULL || wld->log_fd == -1 || !wld->logging )
+		return;
+	if( !strcmp( time_string( next, "%F" ), time_string( t, "%F" ) ) )
 		return;
 
-	/* Sync all data written to the logfile FD to disk.
-	 * This is best effort, we don't check errors atm. */
-	fdatasync( wld->log_fd );
+	/* Already done? */
+	if( lw->next.fd > -1 && lw->next.level == wld->log_compress &&
+			!strcmp( lw->next.date, time_string( next, "%F" ) ) )
+		return;
+
+	/* If this fails, log_init() will try again at midnight, and
+	 * complain if it fails then. */
+	discard_next( lw );
+	if( open_logfile( wld, next, &lw->next, &err ) != NULL )
+	{
+		free( lw->next.file );
+		lw->next.file = NULL;
+		free( err );
+	}
 }
 
 
@@ -219,18 +580,30 @@ extern void world_log_link_update( World *wld )
 
 static void update_one_link( World *wld, char *linkname, time_t timestamp )
 {
-	char *link, *target, *fulltarget;
+	static char *suffixes[] = { ".log", ".log.gz" };
+	char *dir, *link, *target, *fulltarget;
 	struct stat statinfo;
-	int ret;
+	int ret, i, dirfd = AT_FDCWD;
+
+	/* The paths are relative to the directory with the logs of the
+	 * world. If we have it open, use it. */
+	if( wld->log_writer != NULL && wld->log_writer->dirfd > -1 )
+	{
+		dirfd = wld->log_writer->dirfd;
+		dir = xstrdup( "" );
+	}
+	else
+		xasprintf( &dir, "%s/%s/%s/%s/", get_homedir(), CONFIGDIR,
+				LOGSDIR, wld->name );
 
 	/* Construct the link path+filename. */
-	xasprintf( &link, "%s/%s/%s/%s/%s", get_homedir(), CONFIGDIR,
-			LOGSDIR, wld->name, linkname );
+	xasprintf( &link, "%s%s", dir, linkname );
 
-	ret = lstat( link, &statinfo );
+	ret = fstatat( dirfd, link, &statinfo, AT_SYMLINK_NOFOLLOW );
 	/* We give up if stat() fails with anything besides 'file not found'. */
 	if( ret == -1 && errno != ENOENT )
 	{
+		free( dir );
 		free( link );
 		return;
 	}
@@ -238,54 +611,263 @@ static void update_one_link( World *wld, char *linkname, time_t timestamp )
 	/* Also, if the file exists but isn't a symlink, we leave it alone. */
 	if( ret > -1 && !S_ISLNK( statinfo.st_mode ) )
 	{
+		free( dir );
 		free( link );
 		return;
 	}
 
 	/* Old link, begone. */
-	unlink( link );
+	unlinkat( dirfd, link, 0 );
 
 	/* If logging is disabled, we won't create any new symlinks.
 	 * Therefore, we're done. */
 	if( !wld->logging )
 	{
+		free( dir );
 		free( link );
 		return;
 	}
 
-	/* Create the absolute path+filename of the target file. */
-	xasprintf( &fulltarget, "%s/%s/%s/%s/%s/%s - %s.log", get_homedir(),
-			CONFIGDIR, LOGSDIR, wld->name,
-			time_string( timestamp, "%Y-%m" ),
-			wld->name, time_string( timestamp, "%F" ) );
+	/* Create the relative path+filename of the target file. The file
+	 * may be compressed; we prefer the kind we're writing now. */
+	for( i = 0; i < 2; i++ )
+	{
+		xasprintf( &target, "%s/%s - %s%s",
+				time_string( timestamp, "%Y-%m" ), wld->name,
+				time_string( timestamp, "%F" ),
+				suffixes[( wld->log_compress > 0 ) ^ i] );
+		xasprintf( &fulltarget, "%s%s", dir, target );
+
+		ret = fstatat( dirfd, fulltarget, &statinfo,
+				AT_SYMLINK_NOFOLLOW );
+		free( fulltarget );
+		if( ret > -1 )
+			break;
+		free( target );
+	}
 
-	ret = lstat( fulltarget, &statinfo );
 	/* If we can't get to the file, there's no sense in linking to it,
 	 * so we bail out. */
 	if( ret == -1 )
 	{
+		free( dir );
 		free( link );
-		free( fulltarget );
 		return;
 	}
 
-	/* Create the relative path+filename of the target file. */
-	xasprintf( &target, "%s/%s - %s.log", time_string( timestamp, "%Y-%m" ),
-			wld->name, time_string( timestamp, "%F" ) );
-
-	symlink( target, link );
+	symlinkat( target, dirfd, link );
 
+	free( dir );
 	free( link );
 	free( target );
-	free( fulltarget );
+}
+
+
+
+/* Make sure the directory with the logs of the world, and the directory
+ * of the month of timestamp, exist and are open. Returns NULL on success.
+ * On failure, returns the complaint, and puts the path that failed in
+ * file and the error in err (both should be freed). */
+static char *open_logdirs( World *wld, time_t timestamp, char **file,
+		char **err )
+{
+	Logwriter *lw = wld->log_writer;
+	char *month = time_string( timestamp, "%Y-%m" ), *prev = NULL;
+	struct stat st;
+
+	/* If the directories were removed under us, start over. */
+	if( ( lw->dirfd > -1 && ( fstat( lw->dirfd, &st ) == -1 ||
+			st.st_nlink == 0 ) ) || ( lw->monthfd > -1 &&
+			( fstat( lw->monthfd, &st ) == -1 ||
+			st.st_nlink == 0 ) ) )
+		close_logdirs( lw );
+
+	if( lw->dirfd == -1 )
+	{
+		/* Try to create ~/CONFIGDIR */
+		xasprintf( file, "%s/%s", get_homedir(), CONFIGDIR );
+		if( attempt_createdir( *file, err ) )
+			return "Could not create";
+
+		/* Try to create .../LOGSDIR */
+		prev = *file;
+		xasprintf( file, "%s/%s", prev, LOGSDIR );
+		free( prev );
+		if( attempt_createdir( *file, err ) )
+			return "Could not create";
+
+		/* Try to create .../$world */
+		prev = *file;
+		xasprintf( file, "%s/%s", prev, wld->name );
+		free( prev );
+		if( attempt_createdir( *file, err ) )
+			return "Could not create";
+
+		lw->dirfd = open( *file, O_RDONLY | O_DIRECTORY );
+		if( lw->dirfd == -1 )
+		{
+			*err = xstrdup( strerror( errno ) );
+			return "Could not open";
+		}
+		free( *file );
+		*file = NULL;
+	}
+
+	if( lw->monthfd > -1 && !strcmp( lw->month, month ) )
+		return NULL;
+
+	/* Try to create .../YYYY-MM */
+	if( lw->monthfd > -1 )
+		close( lw->monthfd );
+	strncpy( lw->month, month, sizeof( lw->month ) - 1 );
+	lw->month[sizeof( lw->month ) - 1] = '\0';
+	if( mkdirat( lw->dirfd, lw->month, S_IRUSR | S_IWUSR | S_IXUSR ) == -1
+			&& errno != EEXIST )
+		lw->monthfd = -1;
+	else
+		lw->monthfd = openat( lw->dirfd, lw->month,
+				O_RDONLY | O_DIRECTORY );
+
+	if( lw->monthfd == -1 )
+	{
+		*err = xstrdup( strerror( errno ) );
+		xasprintf( file, "%s/%s/%s/%s/%s", get_homedir(), CONFIGDIR,
+				LOGSDIR, wld->name, lw->month );
+		return "Could not create";
+	}
+
+	return NULL;
+}
+
+
+
+/* Close the directories opened by open_logdirs(). */
+static void close_logdirs( Logwriter *lw )
+{
+	if( lw->dirfd > -1 )
+		close( lw->dirfd );
+	if( lw->monthfd > -1 )
+		close( lw->monthfd );
+	lw->dirfd = -1;
+	lw->monthfd = -1;
+}
+
+
+
+/* Open the logfile of the day of timestamp, and its index and journal,
+ * in lf. Creates the directories if needed. Returns NULL on success. On
+ * failure, returns the complaint, and puts the error in err (should be
+ * freed); lf->file is the path that failed then (should be freed too). */
+static char *open_logfile( World *wld, time_t timestamp, Logfile *lf,
+		char **err )
+{
+	Logwriter *lw = wld->log_writer;
+	char *name, *msg, *jnl;
+
+	lf->file = NULL;
+	lf->fd = -1;
+	lf->idxfd = -1;
+	lf->jnlfd = -1;
+	lf->textpos = -1;
+	lf->level = wld->log_compress;
+	strcpy( lf->date, time_string( timestamp, "%F" ) );
+
+	msg = open_logdirs( wld, timestamp, &lf->file, err );
+	if( msg != NULL )
+		return msg;
+
+	/* Filename: .../$world - YYYY-MM-DD.log, with .gz if compressed */
+	xasprintf( &name, "%s - %s.log%s", wld->name, lf->date,
+			( lf->level > 0 ) ? ".gz" : "" );
+	xasprintf( &lf->file, "%s/%s/%s/%s/%s/%s", get_homedir(), CONFIGDIR,
+			LOGSDIR, wld->name, lw->month, name );
+
+	/* If this file is being recompressed or its index compacted (we're
+	 * logging lines from an earlier day), we're not done with it after
+	 * all. */
+	recompress_cancel( wld, lf->file );
+	compact_cancel( wld, lf->file );
+
+	/* Try and open the logfile. The writer thread does the writing, so
+	 * it's fine if writes block. If the compressed logfile exists
+	 * already, we append a new gzip member, which gunzip handles fine. */
+	lf->fd = openat( lw->monthfd, name, O_WRONLY | O_CREAT | O_APPEND,
+			S_IRUSR | S_IWUSR );
+	free( name );
+	if( lf->fd == -1 )
+	{
+		*err = xstrdup( strerror( errno ) );
+		return "Could not open";
+	}
+
+	/* Open the index of the logfile. Without it, the logfile is still
+	 * fine, so this is best effort. */
+	xasprintf( &name, "%s.idx", strrchr( lf->file, '/' ) + 1 );
+	lf->idxfd = openat( lw->monthfd, name, O_WRONLY | O_CREAT | O_APPEND,
+			S_IRUSR | S_IWUSR );
+	free( name );
+
+	/* The same goes for the journal of the word index. Its offsets are
+	 * in the text of the logfile, so we need to know how much of that
+	 * there is already. */
+	jnl = logindex_journal( lf->file );
+	lf->jnlfd = openat( lw->monthfd, strrchr( jnl, '/' ) + 1,
+			O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR );
+	lf->textpos = logindex_textsize( lf->file );
+	free( jnl );
+
+	return NULL;
+}
+
+
+
+/* Close the logfile of the next day, if it was opened ahead of time. If
+ * it's still empty, remove it, so it doesn't look like we logged that day
+ * (along with its index and journal, which are empty as well then). */
+static void discard_next( Logwriter *lw )
+{
+	char *file;
+
+	if( lw->next.fd == -1 )
+		return;
+
+	close_if_empty( lw->next.fd, lw->next.file );
+	xasprintf( &file, "%s.idx", lw->next.file );
+	close_if_empty( lw->next.idxfd, file );
+	free( file );
+	file = logindex_journal( lw->next.file );
+	close_if_empty( lw->next.jnlfd, file );
+	free( file );
+
+	free( lw->next.file );
+	lw->next.file = NULL;
+	lw->next.fd = -1;
+	lw->next.idxfd = -1;
+	lw->next.jnlfd = -1;
+}
+
+
+
+/* Close fd, and remove file (which fd refers to) if it's empty. */
+static void close_if_empty( int fd, char *file )
+{
+	struct stat st;
+
+	if( fd == -1 )
+		return;
+
+	if( fstat( fd, &st ) == 0 && st.st_size == 0 )
+		unlink( file );
+	close( fd );
 }
 
 
 
 static void log_init( World *wld, time_t timestamp )
 {
-	char *file = NULL, *errstr = NULL, *prev = NULL;
-	int fd;
+	char *errstr = NULL, *msg;
+	Logwriter *lw;
+	Logfile lf;
 
 	/* Close the current log first. */
 	if( wld->log_fd > -1 )
@@ -295,85 +877,89 @@ static void log_init( World *wld, time_t timestamp )
 	if( wld->log_fd > -1 )
 		return;
 
-	/* Try to create ~/CONFIGDIR */
-	xasprintf( &file, "%s/%s", get_homedir(), CONFIGDIR );
-	if( attempt_createdir( file, &errstr ) )
-		goto createdir_failed;
-
-	/* Try to create .../LOGSDIR */
-	prev = file;
-	xasprintf( &file, "%s/%s", prev, LOGSDIR );
-	if( attempt_createdir( file, &errstr ) )
-		goto createdir_failed;
-	free( prev );
-
-	/* Try to create .../$world */
-	prev = file;
-	xasprintf( &file, "%s/%s", prev, wld->name );
-	if( attempt_createdir( file, &errstr ) )
-		goto createdir_failed;
-	free( prev );
-
-	/* Try to create .../YYYY-MM */
-	prev = file;
-	xasprintf( &file, "%s/%s", prev, time_string( timestamp, "%Y-%m" ) );
-	if( attempt_createdir( file, &errstr ) )
-		goto createdir_failed;
-	free( prev );
-
-	/* Filename: .../$world - YYYY-MM-DD.log */
-	prev = file;
-	xasprintf( &file, "%s/%s - %s.log", prev,
-			wld->name, time_string( timestamp, "%F" ) );
-	free( prev );
-
-	/* Try and open the logfile. */
-	fd = open( file, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK,
-			S_IRUSR | S_IWUSR );
+	/* Start the writer thread, if it's not running yet. */
+	if( wld->log_writer == NULL && writer_start( wld, &errstr ) )
+	{
+		nag_client_error( wld, "Could not start log writer", NULL,
+				errstr );
+		free( errstr );
+		return;
+	}
+	lw = wld->log_writer;
 
-	/* Error opening logfile? Complain. */
-	if( fd == -1 )
+	/* Usually, at midnight, the logfile has been opened ahead of time,
+	 * and we just take it. Otherwise, open it now. */
+	if( lw->next.fd > -1 && lw->next.level == wld->log_compress &&
+			!strcmp( lw->next.date, time_string( timestamp, "%F" ) ) )
+	{
+		lf = lw->next;
+		lw->next.file = NULL;
+		lw->next.fd = -1;
+	}
+	else if( ( msg = open_logfile( wld, timestamp, &lf, &errstr ) ) )
 	{
-		nag_client_error( wld, "Could not open", file,
-				strerror( errno ) );
-		free( file );
+		nag_client_error( wld, msg, lf.file, errstr );
+		free( lf.file );
+		free( errstr );
 		return;
 	}
 
-	wld->log_fd = fd;
-	free( file );
+	wld->log_fd = lf.fd;
+	free( lw->file );
+	lw->file = lf.file;
+	lw->filelevel = lf.level;
+	lw->fileidxfd = lf.idxfd;
+	lw->filejnlfd = lf.jnlfd;
+	lw->filetextpos = lf.textpos;
+	lw->filestamps = wld->log_timestamps;
+	lw->lastminute = -1;
 
 	/* Update the log symlinks later. */
 	wld->flags |= WLD_LOGLINKUPDATE;
-
-	return;
-
-createdir_failed:
-	nag_client_error( wld, "Could not create", file, errstr );
-	free( file );
-	/* Prevent double free()s ;) */
-	if( file != prev )
-		free( prev );
-	free( errstr );
 }
 
 
 
 static void log_deinit( World *wld )
 {
-	/* Refuse if there's something left in the buffer. */
-	if( wld->log_bfull > 0 )
+	/* Refuse if there's something left in the buffer, or if the
+	 * writer thread is still busy with the logfile. */
+	if( wld->log_buffer->full > 0 || writer_busy( wld ) )
 		return;
 
 	/* We're closing the logfile, it'd be nice if stuff ended up on
-	 * disk now. */
-	world_sync_logdata( wld );
-
-	if( wld->log_fd != -1 )
+	 * disk now. The writer thread syncs and closes it. If it's from an
+	 * earlier day, it won't be written to again, so it can be
+	 * recompressed once it's closed. */
+	if( wld->log_fd != -1 && wld->log_writer != NULL )
+	{
+		Logwriter *lw = wld->log_writer;
+
+		if( wld->log_currentday != current_day() &&
+				lw->filejnlfd > -1 )
+			lw->compact = xstrdup( lw->file );
+
+		if( wld->log_recompress > 0 &&
+				wld->log_currentday != current_day() )
+			lw->closing = lw->file;
+		else
+			free( lw->file );
+		lw->file = NULL;
+
+		writer_submit( lw, wld->log_fd,
+				wld->log_sync != LOG_SYNC_NONE, 0, 1, 0 );
+		lw->fileidxfd = -1;
+		lw->filejnlfd = -1;
+	}
+	else if( wld->log_fd != -1 )
 		close( wld->log_fd );
 
 	wld->log_fd = -1;
 
+	/* If logging was disabled, we won't need tomorrow's logfile. */
+	if( wld->log_writer != NULL && !wld->logging )
+		discard_next( wld->log_writer );
+
 	/* Update the log symlinks later. */
 	wld->flags |= WLD_LOGLINKUPDATE;
 }
@@ -382,21 +968,172 @@ static void log_deinit( World *wld )
 
 static void log_write( World *wld )
 {
-	int ret, errnum;
+	Logwriter *lw = wld->log_writer;
 
 	/* No logfile, no writes */
-	if( wld->log_fd == -1 )
+	if( wld->log_fd == -1 || lw == NULL )
 		return;
 
-	ret = flush_buffer( wld->log_fd, wld->log_buffer, &wld->log_bfull,
-			wld->log_current, NULL, 0, NULL, NULL, &errnum );
+	/* Fill our buffer, while the writer thread may be writing its. */
+	log_render( wld );
 
-	if( ret == 1 )
-		nag_client_error( wld, "Could not write to logfile", NULL,
-				"file descriptor is congested" );
-	if( ret == 2 )
-		nag_client_error( wld, "Could not write to logfile", NULL,
-				strerror( errnum ) );
+	/* The writer thread is busy, try again later. */
+	if( __atomic_load_n( &lw->state, __ATOMIC_ACQUIRE ) != JOB_IDLE )
+		return;
+
+	/* If the previous write failed, retry the remaining data first,
+	 * but not too often. */
+	if( lw->buf->full > 0 || lw->zlen > 0 )
+	{
+		if( current_time() >= lw->retryat )
+			writer_submit( lw, wld->log_fd, lw->syncs > 0, 0, 0, 0 );
+		return;
+	}
+
+	/* See if the sync policy calls for a sync. With group commit, all
+	 * the LINE_SYNC lines that accumulated while the writer thread was
+	 * busy share a single sync. */
+	switch( wld->log_sync )
+	{
+		case LOG_SYNC_GROUP:
+		if( lw->syncs_inbuf > 0 )
+			lw->wantsync = 1;
+		/* Fallthrough, group commit also syncs periodically. */
+
+		case LOG_SYNC_INTERVAL:
+		if( lw->unsynced > 0 && current_time() - lw->lastsync >=
+				wld->log_sync_interval )
+			lw->wantsync = 1;
+		break;
+
+		case LOG_SYNC_BYTES:
+		if( lw->unsynced + wld->log_buffer->full >=
+				wld->log_sync_bytes * 1024 )
+			lw->wantsync = 1;
+		break;
+
+		case LOG_SYNC_NONE:
+		/* No syncs, but a compressed logfile still gets flushed
+		 * now and then, so it's readable after a crash. */
+		if( lw->filelevel > 0 && lw->unsynced > 0 && current_time() -
+				lw->lastsync >= wld->log_sync_interval )
+			lw->wantflush = 1;
+		break;
+	}
+
+	if( wld->log_buffer->full == 0 && !lw->wantsync && !lw->wantflush )
+		return;
+
+	/* Hand our buffer to the writer thread, and take its empty one. */
+	writer_take_buffer( wld );
+	lw->syncs = lw->syncs_inbuf;
+	lw->syncs_inbuf = 0;
+	writer_submit( lw, wld->log_fd, lw->wantsync, lw->wantflush, 0, 0 );
+	lw->wantsync = 0;
+	lw->wantflush = 0;
+}
+
+
+
+/* Render as many lines from log_current into the log buffer as will fit,
+ * in the form they appear in the logfile: with ANSI stripped, and
+ * prepended by a timestamp (if enabled). */
+static void log_render( World *wld )
+{
+	static Linequeue empty = { NULL, NULL, 0, 0 };
+	Logwriter *lw = wld->log_writer;
+	Buffer *buf = wld->log_buffer;
+	long max = wld->netbuffer_size * 1024, need, len;
+	Line *line;
+	char *str;
+
+	/* Continue writing a line that was too long for the buffer. */
+	if( buf->line != NULL )
+		fill_buffer( buf, max, &empty, NULL, 0, NULL, NULL );
+
+	while( buf->line == NULL && wld->log_current->count > 0 )
+	{
+		line = wld->log_current->head;
+
+		/* The rendered line is never longer than this, including
+		 * the newline. */
+		need = LOG_TIMESTAMP_LENGTH + line->len + 1;
+
+		/* If it doesn't fit, try to grow the buffer. */
+		if( buf->full + need > buf->size )
+			buffer_reserve( buf, need, max );
+
+		/* If it still doesn't fit, bail out. */
+		if( buf->full + need > buf->size && buf->full > 0 )
+			break;
+
+		linequeue_pop( wld->log_current );
+		if( line->flags & LINE_SYNC )
+			lw->syncs_inbuf++;
+
+		/* Mark where a new minute starts, for the index. */
+		if( line->time / 60 != lw->lastminute )
+			add_mark( lw, buf->full, line->time );
+
+		/* Too large for the buffer, even though it's empty. Render
+		 * it separately, and write it piece by piece. */
+		if( buf->full + need > buf->size )
+		{
+			str = xmalloc( need );
+			len = render_line( wld, str, line );
+			line_destroy( line );
+			buf->line = line_create( str, len );
+			fill_buffer( buf, max, &empty, NULL, 0, NULL, NULL );
+			break;
+		}
+
+		buf->full += render_line( wld, buf->data + buf->full, line );
+		buf->data[buf->full++] = '\n';
+		line_destroy( line );
+	}
+}
+
+
+
+/* Add a mark for the minute of t, at pos in log_buffer. */
+static void add_mark( Logwriter *lw, long pos, time_t t )
+{
+	if( lw->nbufmarks == lw->bufmarksalloc )
+	{
+		lw->bufmarksalloc = lw->bufmarksalloc * 2 + 4;
+		lw->bufmarks = xrealloc( lw->bufmarks, lw->bufmarksalloc *
+				sizeof( Logmark ) );
+	}
+
+	lw->bufmarks[lw->nbufmarks].pos = pos;
+	strcpy( lw->bufmarks[lw->nbufmarks].minute, time_string( t, "%H:%M" ) );
+	lw->nbufmarks++;
+	lw->lastminute = t / 60;
+}
+
+
+
+/* Render line into dst, with ANSI stripped, and prepended by a timestamp
+ * (if enabled). dst must have room for LOG_TIMESTAMP_LENGTH + line->len + 1
+ * bytes. Returns the length of the rendered line (excluding the \0). */
+static long render_line( World *wld, char *dst, Line *line )
+{
+	/* Do we prepend a timestamp? */
+	if( !wld->log_timestamps )
+		return strcpy_noansi( dst, line->str );
+
+	/* First, make sure the timestamp is up to date. */
+	if( wld->log_currenttime != line->time )
+	{
+		free( wld->log_currenttimestr );
+		wld->log_currenttimestr = xstrdup( time_string(
+			line->time, LOG_TIMESTAMP_FORMAT ) );
+		wld->log_currenttime = line->time;
+	}
+
+	strcpy( dst, wld->log_currenttimestr );
+	return LOG_TIMESTAMP_LENGTH + strcpy_noansi( dst +
+			LOG_TIMESTAMP_LENGTH, line->str );
 }
 
 
@@ -441,7 +1178,8 @@ static void nag_client_error( World *wld, char *msg, char *file, char *err )
 	/* Next, inform the user that logging failed and how much logbuffer
 	 * space is left. */
 	line = world_msg_client( wld, "LOGGING FAILED! Approximately %lu lines"
-		" not yet logged (%.1f%% of logbuffer).", wld->log_bfull / 80 +
+		" not yet logged (%.1f%% of logbuffer).",
+		world_log_unwritten( wld ) / 80 +
 		wld->log_queue->count + wld->log_current->count + 1, 
 		( wld->log_queue->size + wld->log_current->size )
 		/ 10.24 / wld->logbuffer_size );
@@ -456,3 +1194,831 @@ static void nag_client_error( World *wld, char *msg, char *file, char *err )
 	free( wld->log_lasterror );
 	wld->log_lasterror = str;
 }
+
+
+
+/* Start the log writer thread. On failure, return non-zero, and put the
+ * error in err (err should be freed). */
+static int writer_start( World *wld, char **err )
+{
+	Logwriter *lw;
+	sigset_t all, old;
+	int ret;
+
+	lw = xmalloc( sizeof( Logwriter ) );
+	lw->state = JOB_IDLE;
+	lw->buf = buffer_create();
+	lw->errnum = 0;
+	lw->zactive = 0;
+	lw->zlen = 0;
+	lw->submitted = 0;
+	lw->wantsync = 0;
+	lw->wantflush = 0;
+	lw->retryat = 0;
+	lw->marks = NULL;
+	lw->nmarks = 0;
+	lw->marksalloc = 0;
+	lw->file = NULL;
+	lw->fileidxfd = -1;
+	lw->filejnlfd = -1;
+	lw->filetextpos = -1;
+	lw->filestamps = 0;
+	lw->compact = NULL;
+	lw->tok.out = NULL;
+	lw->tok.outlen = 0;
+	lw->tok.outsize = 0;
+	lw->filelevel = 0;
+	lw->closing = NULL;
+	lw->bufmarks = NULL;
+	lw->nbufmarks = 0;
+	lw->bufmarksalloc = 0;
+	lw->lastminute = -1;
+	lw->dirfd = -1;
+	lw->monthfd = -1;
+	lw->month[0] = '\0';
+	lw->next.file = NULL;
+	lw->next.fd = -1;
+	lw->recompress.file = NULL;
+	lw->recompressing = NULL;
+	lw->compaction.file = NULL;
+	lw->compactnext = NULL;
+	lw->syncs = 0;
+	lw->syncs_inbuf = 0;
+	lw->unsynced = 0;
+	lw->lastsync = current_time();
+
+	if( pipe( lw->notify ) == -1 )
+	{
+		*err = xstrdup( strerror( errno ) );
+		buffer_destroy( lw->buf );
+		free( lw );
+		return 1;
+	}
+	fcntl( lw->notify[0], F_SETFL, O_NONBLOCK );
+	fcntl( lw->notify[1], F_SETFL, O_NONBLOCK );
+	sem_init( &lw->wakeup, 0, 0 );
+
+	/* Signals are for the main thread, the writer thread won't have
+	 * any of them. The new thread inherits our signal mask. */
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+	ret = pthread_create( &lw->thread, NULL, writer_main, lw );
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+	if( ret != 0 )
+	{
+		*err = xstrdup( strerror( ret ) );
+		close( lw->notify[0] );
+		close( lw->notify[1] );
+		sem_destroy( &lw->wakeup );
+		buffer_destroy( lw->buf );
+		free( lw );
+		return 1;
+	}
+
+	wld->log_writer = lw;
+	wld->log_writer_fd = lw->notify[0];
+	return 0;
+}
+
+
+
+/* The writer thread. Waits for jobs, and executes them. This thread must
+ * not touch anything but the job. */
+static void *writer_main( void *arg )
+{
+	Logwriter *lw = arg;
+	int quit;
+
+	for(;;)
+	{
+		/* Wait for a job. */
+		if( sem_wait( &lw->wakeup ) == -1 ||
+				__atomic_load_n( &lw->state, __ATOMIC_ACQUIRE )
+				!= JOB_QUEUED )
+			continue;
+
+		/* A new logfile, start indexing where its text ends. */
+		if( lw->textstart != -1 )
+			logindex_reset( &lw->tok, lw->textstart, lw->stamps );
+
+		/* Write the entire buffer, even if it takes a while. What
+		 * could not be written is kept, for a retry. */
+		lw->errnum = ( lw->fd == -1 ) ? 0 : writer_write( lw );
+
+		/* Sync all data written to the logfile FD to disk.
+		 * This is best effort, we don't check errors atm. */
+		if( lw->sync )
+			fdatasync( lw->fd );
+		if( lw->close )
+			close( lw->fd );
+		if( lw->close && lw->idxfd > -1 )
+			close( lw->idxfd );
+		if( lw->close && lw->jnlfd > -1 )
+			close( lw->jnlfd );
+
+		/* The compressor is done when the logfile is, or when
+		 * we are. */
+		if( lw->zactive && ( lw->close || lw->quit ) )
+		{
+			deflateEnd( &lw->zs );
+			lw->zactive = 0;
+			lw->zlen = 0;
+		}
+
+		/* Hand the job back, and wake up the main thread. */
+		quit = lw->quit;
+		__atomic_store_n( &lw->state, JOB_DONE, __ATOMIC_RELEASE );
+		while( write( lw->notify[1], "", 1 ) == -1 && errno == EINTR )
+			continue;
+
+		if( quit )
+			return NULL;
+	}
+}
+
+
+
+/* Write the job buffer to the logfile, compressed or not, and add its
+ * minute marks to the index. Returns 0 on success, or an errno value.
+ * What could not be written is kept, along with its marks. */
+static int writer_write( Logwriter *lw )
+{
+	Buffer *buf = lw->buf;
+	long pos = 0, used, i;
+	int flush = Z_NO_FLUSH, err = 0;
+
+	/* Write everything before a mark first, so we know the offset where
+	 * its minute starts. For a compressed logfile, a full flush makes
+	 * that a point where decompression can start. The entry goes in
+	 * the index after the data, so the index never points beyond the
+	 * end of the logfile. */
+	for( i = 0; i < lw->nmarks; i++ )
+	{
+		err = writer_put( lw, buf->data + pos, lw->marks[i].pos - pos,
+				Z_FULL_FLUSH, &used );
+		pos += used;
+		if( err != 0 )
+			break;
+		writer_index( lw, &lw->marks[i] );
+	}
+
+	if( lw->close )
+		flush = Z_FINISH;
+	else if( lw->sync || lw->flush )
+		flush = Z_SYNC_FLUSH;
+
+	/* Then the rest. */
+	if( err == 0 )
+	{
+		err = writer_put( lw, buf->data + pos, buf->full - pos, flush,
+				&used );
+		pos += used;
+	}
+
+	/* Add the words in what was written to the journal of the word
+	 * index. Like the index, this is best effort. */
+	if( lw->jnlfd > -1 && pos > 0 )
+	{
+		logindex_feed( &lw->tok, buf->data, pos );
+		write_all( lw->jnlfd, lw->tok.out, lw->tok.outlen, &used );
+		lw->tok.outlen = 0;
+	}
+
+	/* Keep what could not be written, and the marks in there. */
+	memmove( buf->data, buf->data + pos, buf->full - pos );
+	buf->full -= pos;
+	memmove( lw->marks, lw->marks + i, ( lw->nmarks - i ) *
+			sizeof( Logmark ) );
+	lw->nmarks -= i;
+	for( i = 0; i < lw->nmarks; i++ )
+		lw->marks[i].pos -= pos;
+
+	return err;
+}
+
+
+
+/* Write len bytes of data to the logfile. If it's compressed, compress
+ * the data first, and flush the compressor as indicated by flush (one of
+ * Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FULL_FLUSH or Z_FINISH). Puts the number of
+ * bytes of data that were taken in used. Returns 0 on success, or an
+ * errno value. */
+static int writer_put( Logwriter *lw, char *data, long len, int flush,
+		long *used )
+{
+	long written;
+	int err, done = 0;
+
+	if( lw->level == 0 )
+		return write_all( lw->fd, data, len, used );
+
+	if( !lw->zactive )
+	{
+		lw->zs.zalloc = Z_NULL;
+		lw->zs.zfree = Z_NULL;
+		lw->zs.opaque = Z_NULL;
+		/* 15 + 16 windowBits: the largest window, gzip format. */
+		if( deflateInit2( &lw->zs, lw->level, Z_DEFLATED, 15 + 16, 8,
+				Z_DEFAULT_STRATEGY ) != Z_OK )
+		{
+			*used = 0;
+			return ENOMEM;
+		}
+		lw->zactive = 1;
+	}
+
+	lw->zs.next_in = (Bytef *) data;
+	lw->zs.avail_in = len;
+
+	/* First write out anything left over, then compress and write until
+	 * all input is taken, and deflate() didn't fill up zbuf (which means
+	 * it has nothing more to give for this flush). */
+	for(;;)
+	{
+		err = write_all( lw->fd, lw->zbuf, lw->zlen, &written );
+		memmove( lw->zbuf, lw->zbuf + written, lw->zlen - written );
+		lw->zlen -= written;
+		if( err != 0 || done )
+			break;
+
+		lw->zs.next_out = (Bytef *) lw->zbuf;
+		lw->zs.avail_out = LOG_ZBUFSIZE;
+		deflate( &lw->zs, flush );
+		lw->zlen = LOG_ZBUFSIZE - lw->zs.avail_out;
+		done = lw->zs.avail_in == 0 && lw->zs.avail_out > 0;
+	}
+
+	*used = len - lw->zs.avail_in;
+	return err;
+}
+
+
+
+/* Add an entry for mark to the index of the logfile: the minute, and the
+ * offset in the logfile where it starts, as "HH:MM oooooooooooo\n" (the
+ * offset in 12 decimal digits). All data so far must have been written.
+ * This is best effort; the logfile itself is what matters. */
+static void writer_index( Logwriter *lw, Logmark *mark )
+{
+	char entry[LOG_INDEX_ENTRYLEN + 1];
+	off_t offset;
+
+	if( lw->idxfd == -1 )
+		return;
+
+	/* The logfile is opened with O_APPEND, so this is where the next
+	 * byte goes. */
+	offset = lseek( lw->fd, 0, SEEK_END );
+	if( offset == -1 )
+		return;
+
+	sprintf( entry, "%s %012lld\n", mark->minute, (long long) offset );
+	while( write( lw->idxfd, entry, LOG_INDEX_ENTRYLEN ) == -1 &&
+			errno == EINTR )
+		continue;
+}
+
+
+
+/* Write len bytes of data to fd, even if it takes a while. Puts the
+ * number of bytes written in done. Returns 0 on success, or an errno
+ * value. */
+static int write_all( int fd, char *data, long len, long *done )
+{
+	int wr;
+
+	for( *done = 0; *done < len; *done += wr )
+	{
+		wr = write( fd, data + *done, len - *done );
+		if( wr == -1 && errno == EINTR )
+			wr = 0;
+		else if( wr < 1 )
+			return ( wr == 0 ) ? EAGAIN : errno;
+	}
+
+	return 0;
+}
+
+
+
+/* Hand log_buffer and its minute marks to the writer thread, and take
+ * its (empty) buffer and marks. The writer thread must be idle. */
+static void writer_take_buffer( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+	Logmark *marks = lw->marks;
+	long alloc = lw->marksalloc;
+
+	buffer_swap( wld->log_buffer, lw->buf );
+
+	lw->marks = lw->bufmarks;
+	lw->nmarks = lw->nbufmarks;
+	lw->marksalloc = lw->bufmarksalloc;
+	lw->bufmarks = marks;
+	lw->nbufmarks = 0;
+	lw->bufmarksalloc = alloc;
+}
+
+
+
+/* Hand the job (lw->buf, and the given parameters) to the writer thread. */
+static void writer_submit( Logwriter *lw, int fd, int sync, int flush,
+		int close, int quit )
+{
+	lw->fd = fd;
+	lw->idxfd = lw->fileidxfd;
+	lw->jnlfd = lw->filejnlfd;
+	lw->textstart = lw->filetextpos;
+	lw->stamps = lw->filestamps;
+	lw->filetextpos = -1;
+	lw->level = lw->filelevel;
+	lw->sync = sync;
+	lw->flush = flush;
+	lw->close = close;
+	lw->quit = quit;
+	lw->submitted = lw->buf->full;
+
+	__atomic_store_n( &lw->state, JOB_QUEUED, __ATOMIC_RELEASE );
+	sem_post( &lw->wakeup );
+}
+
+
+
+/* If the writer thread finished a job, take the job back, and report any
+ * errors. */
+static void writer_collect( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+
+	if( lw == NULL ||
+		__atomic_load_n( &lw->state, __ATOMIC_ACQUIRE ) != JOB_DONE )
+		return;
+
+	lw->state = JOB_IDLE;
+
+	/* Keep track of what's on disk. */
+	if( lw->errnum == 0 )
+		lw->unsynced += lw->submitted;
+	if( lw->errnum == 0 && ( lw->sync || lw->flush ) )
+	{
+		lw->unsynced = 0;
+		lw->lastsync = current_time();
+	}
+	if( lw->errnum == 0 && lw->sync )
+	{
+		wld->log_syncs_done += lw->syncs;
+		lw->syncs = 0;
+	}
+	lw->submitted = 0;
+
+	/* A finished logfile from an earlier day can be recompressed now. */
+	if( lw->close && lw->closing != NULL )
+	{
+		recompress_start( wld, lw->closing );
+		free( lw->closing );
+		lw->closing = NULL;
+	}
+
+	/* Likewise, its journal is closed, so its index can be compacted. */
+	if( lw->close && lw->compact != NULL )
+	{
+		free( lw->compactnext );
+		lw->compactnext = lw->compact;
+		lw->compact = NULL;
+	}
+	compact_start( wld );
+
+	if( lw->errnum == 0 )
+		return;
+
+	lw->retryat = current_time() + 1;
+	if( lw->errnum == EAGAIN )
+		nag_client_error( wld, "Could not write to logfile", NULL,
+				"file descriptor is congested" );
+	else
+		nag_client_error( wld, "Could not write to logfile", NULL,
+				strerror( lw->errnum ) );
+}
+
+
+
+/* Wait until the writer thread is done with its job, if it has one. */
+static void writer_wait( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+	fd_set rset;
+
+	while( __atomic_load_n( &lw->state, __ATOMIC_ACQUIRE ) == JOB_QUEUED )
+	{
+		FD_ZERO( &rset );
+		FD_SET( lw->notify[0], &rset );
+		select( lw->notify[0] + 1, &rset, NULL, NULL, NULL );
+		world_log_handle_writer_fd( wld );
+	}
+}
+
+
+
+/* Return non-zero if the writer thread has a job, or has data left
+ * over from a failed write (compressed or not). */
+static int writer_busy( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+
+	if( lw == NULL )
+		return 0;
+
+	return __atomic_load_n( &lw->state, __ATOMIC_ACQUIRE ) != JOB_IDLE ||
+			lw->buf->full > 0 || lw->zlen > 0;
+}
+
+
+
+/* Pass the lines that were held until the logfile was synced on to the
+ * client, if that has happened. */
+static void release_held( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+
+	/* If logging was turned off, or log_sync no longer does group
+	 * commit, there may never be another sync. Don't wait for it. The
+	 * syncs that were still pending don't count anymore, so they can't
+	 * release lines held after switching back to group commit. */
+	if( !wld->logging || wld->log_sync != LOG_SYNC_GROUP )
+	{
+		wld->log_syncs_done = wld->log_syncs_wanted;
+		if( lw != NULL )
+		{
+			lw->syncs = 0;
+			lw->syncs_inbuf = 0;
+		}
+	}
+
+	if( wld->log_syncwait->count == 0 )
+		return;
+
+	/* If logging fails, the lines may never get synced. We're not going
+	 * to hold the client hostage because of that. */
+	if( wld->log_syncs_done >= wld->log_syncs_wanted ||
+			wld->log_lasterror != NULL )
+		linequeue_merge( wld->client_txqueue, wld->log_syncwait );
+}
+
+
+
+/* Start recompressing file at log_recompress, on a thread at low
+ * priority. Only one file is recompressed at a time. If another one is
+ * still in progress, file is left as it is. */
+static void recompress_start( World *wld, char *file )
+{
+	Logwriter *lw = wld->log_writer;
+
+	if( lw->recompress.file != NULL )
+		return;
+
+	if( task_start( wld, &lw->recompress, file, wld->log_recompress,
+			recompress_main ) )
+		return;
+
+	lw->recompressing = strip_gz( file );
+}
+
+
+
+/* If file is being recompressed, stop that. The task cleans up after
+ * itself. */
+static void recompress_cancel( World *wld, char *file )
+{
+	Logwriter *lw = wld->log_writer;
+	char *base;
+
+	if( lw == NULL || lw->recompress.file == NULL )
+		return;
+
+	base = strip_gz( file );
+	if( strcmp( base, lw->recompressing ) )
+	{
+		free( base );
+		return;
+	}
+
+	task_stop( &lw->recompress );
+	free( base );
+	free( lw->recompressing );
+	lw->recompressing = NULL;
+}
+
+
+
+extern void world_log_reap_tasks( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+
+	if( lw == NULL )
+		return;
+
+	if( task_finished( &lw->compaction ) )
+		compact_start( wld );
+
+	if( lw->recompress.file == NULL )
+		return;
+
+	/* The logfile may have a new name now. */
+	switch( task_finished( &lw->recompress ) )
+	{
+		case 0:
+		return;
+
+		case 1:
+		wld->flags |= WLD_LOGLINKUPDATE;
+		break;
+	}
+
+	free( lw->recompressing );
+	lw->recompressing = NULL;
+}
+
+
+
+/* If there's an index waiting to be compacted and no compaction going on,
+ * start compacting it, on a thread at low priority. */
+static void compact_start( World *wld )
+{
+	Logwriter *lw = wld->log_writer;
+
+	if( lw->compactnext == NULL || lw->compaction.file != NULL )
+		return;
+
+	/* If that fails, the journal stays. It's still searched. */
+	task_start( wld, &lw->compaction, lw->compactnext, 0, compact_main );
+	free( lw->compactnext );
+	lw->compactnext = NULL;
+}
+
+
+
+/* If the index of file is being compacted or waiting for that, stop it.
+ * The journal stays. */
+static void compact_cancel( World *wld, char *file )
+{
+	Logwriter *lw = wld->log_writer;
+	char *base, *other;
+
+	if( lw == NULL )
+		return;
+
+	base = strip_gz( file );
+	if( lw->compaction.file != NULL )
+	{
+		other = strip_gz( lw->compaction.file );
+		if( !strcmp( base, other ) )
+			task_stop( &lw->compaction );
+		free( other );
+	}
+	if( lw->compactnext != NULL )
+	{
+		other = strip_gz( lw->compactnext );
+		if( !strcmp( base, other ) )
+		{
+			free( lw->compactnext );
+			lw->compactnext = NULL;
+		}
+		free( other );
+	}
+	free( base );
+}
+
+
+
+/* The compacting task. */
+static void *compact_main( void *arg )
+{
+	Logtask *task = arg;
+
+	task_nice();
+	task->status = logindex_compact( task->file, &task->stop );
+
+	__atomic_store_n( &task->done, 1, __ATOMIC_RELEASE );
+	return NULL;
+}
+
+
+
+/* Start main on a thread of its own for file, which is copied, with the
+ * given level. Returns 0 on success, nonzero on failure (which has been
+ * reported to the client). */
+static int task_start( World *wld, Logtask *task, char *file, int level,
+		void *(*main)( void * ) )
+{
+	sigset_t all, old;
+	int ret;
+
+	task->file = xstrdup( file );
+	task->level = level;
+	task->stop = 0;
+	task->done = 0;
+	task->status = 1;
+
+	/* Signals are for the main thread. */
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+	ret = pthread_create( &task->thread, NULL, main, task );
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+	if( ret == 0 )
+		return 0;
+
+	world_msg_client( wld, "Could not start a thread for `%s': %s",
+			file, strerror( ret ) );
+	free( task->file );
+	task->file = NULL;
+	return 1;
+}
+
+
+
+/* If the task is done, clean up. Returns 0 if there's no task or it's not
+ * done yet, 1 if it succeeded, and 2 if it failed. */
+static int task_finished( Logtask *task )
+{
+	if( task->file == NULL ||
+			!__atomic_load_n( &task->done, __ATOMIC_ACQUIRE ) )
+		return 0;
+
+	pthread_join( task->thread, NULL );
+	free( task->file );
+	task->file = NULL;
+
+	return ( task->status == 0 ) ? 1 : 2;
+}
+
+
+
+/* Make the task give up, if there is one, and wait for it. */
+static void task_stop( Logtask *task )
+{
+	if( task->file == NULL )
+		return;
+
+	__atomic_store_n( &task->stop, 1, __ATOMIC_RELEASE );
+	pthread_join( task->thread, NULL );
+	free( task->file );
+	task->file = NULL;
+}
+
+
+
+/* Lower the priority of the calling thread, where threads have their own
+ * (as on Linux). */
+static void task_nice( void )
+{
+#if defined( SYS_gettid )
+	setpriority( PRIO_PROCESS, syscall( SYS_gettid ), 19 );
+#endif
+}
+
+
+
+/* The recompressing task. Read the logfile (compressed or not), write it
+ * compressed at the level of the task to a temporary file, and replace
+ * the logfile by that. The index is rebuilt from the timestamps in the
+ * logfile; if there are none, the logfile is left without an index. */
+static void *recompress_main( void *arg )
+{
+	Logtask *task = arg;
+	char *file = task->file, *base, *dest, *tmp, *idx, *idxtmp, *oldidx;
+	char mode[8], data[65536], minute[6] = "", entry[LOG_INDEX_ENTRYLEN + 1];
+	gzFile in = NULL, out = NULL;
+	int fd, len, err, idxfd = -1, made = 0, atstart = 1, stamps = 0;
+
+	/* We have all the time in the world. */
+	task_nice();
+
+	/* A plain logfile becomes a compressed one. Don't clobber another
+	 * logfile for the same day, though. */
+	base = strip_gz( file );
+	xasprintf( &dest, "%s.gz", base );
+	xasprintf( &tmp, "%s.gz.tmp", base );
+	xasprintf( &idx, "%s.idx", dest );
+	xasprintf( &idxtmp, "%s.idx.tmp", dest );
+	xasprintf( &oldidx, "%s.idx", file );
+	if( strcmp( dest, file ) && access( dest, F_OK ) == 0 )
+		goto failed;
+
+	/* Keep the new logfile as private as the old one. */
+	snprintf( mode, sizeof( mode ), "wb%i", task->level );
+	in = gzopen( file, "rb" );
+	made = 1;
+	fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR );
+	if( fd > -1 && ( out = gzdopen( fd, mode ) ) == NULL )
+		close( fd );
+	idxfd = open( idxtmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR );
+	if( in == NULL || out == NULL )
+		goto failed;
+
+	/* Line by line, so we see where each minute starts. A line longer
+	 * than data comes in pieces. Give up if we're told to. */
+	while( gzgets( in, data, sizeof( data ) ) != NULL )
+	{
+		if( __atomic_load_n( &task->stop, __ATOMIC_ACQUIRE ) )
+			goto failed;
+
+		len = strlen( data );
+
+		/* A timestamp with a new minute. Flush, so decompression can
+		 * start here, and add an index entry. */
+		if( atstart && len >= LOG_TIMESTAMP_LENGTH && data[0] == '[' &&
+				data[3] == ':' && data[6] == ':' &&
+				data[9] == ']' && strncmp( data + 1, minute, 5 ) )
+		{
+			stamps = 1;
+			memcpy( minute, data + 1, 5 );
+			minute[5] = '\0';
+			if( gzflush( out, Z_FULL_FLUSH ) != Z_OK )
+				goto failed;
+			sprintf( entry, "%s %012lld\n", minute,
+					(long long) gzoffset( out ) );
+			if( idxfd > -1 && write( idxfd, entry,
+					LOG_INDEX_ENTRYLEN ) != LOG_INDEX_ENTRYLEN )
+			{
+				close( idxfd );
+				idxfd = -1;
+			}
+		}
+
+		if( gzwrite( out, data, len ) != len )
+			goto failed;
+		atstart = data[len - 1] == '\n';
+	}
+
+	/* If mooproxy crashed, the file ends in the middle of a gzip
+	 * member. We keep what there is. Other errors, we don't touch. */
+	gzerror( in, &err );
+	if( !gzeof( in ) && err != Z_BUF_ERROR )
+		goto failed;
+
+	gzclose( in );
+	in = NULL;
+	err = gzclose( out );
+	out = NULL;
+	if( err != Z_OK )
+		goto failed;
+
+	/* Make sure the new file is on disk, before the old one goes. */
+	fd = open( tmp, O_RDONLY );
+	if( fd == -1 || fsync( fd ) == -1 )
+		goto failed;
+	close( fd );
+
+	/* The old index doesn't match the new file, so it goes first. The
+	 * new one comes last; if we don't get there, there's no index. */
+	unlink( oldidx );
+	if( rename( tmp, dest ) == -1 )
+		goto failed;
+	if( strcmp( dest, file ) )
+		unlink( file );
+
+	if( idxfd > -1 && stamps && close( idxfd ) == 0 )
+		rename( idxtmp, idx );
+	else
+		unlink( idxtmp );
+	idxfd = -1;
+
+	task->status = 0;
+
+failed:
+	if( in != NULL )
+		gzclose( in );
+	if( out != NULL )
+		gzclose( out );
+	if( idxfd > -1 )
+		close( idxfd );
+	if( task->status != 0 && made )
+	{
+		unlink( tmp );
+		unlink( idxtmp );
+	}
+	free( base );
+	free( dest );
+	free( tmp );
+	free( idx );
+	free( idxtmp );
+	free( oldidx );
+
+	__atomic_store_n( &task->done, 1, __ATOMIC_RELEASE );
+	return NULL;
+}
+
+
+
+/* Return a copy of file without the .gz suffix, if it has one. */
+static char *strip_gz( char *file )
+{
+	long len = strlen( file );
+
+	if( len > 3 && !strcmp( file + len - 3, ".gz" ) )
+		return xstrndup( file, len - 3 );
+
+	return xstrdup( file );
+}
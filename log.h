@@ -26,15 +26,39 @@
 
 
 /* Submit line for logging.
- * line is not consumed, and can be processed further. */
-extern void world_log_line( World *wld, Line *line );
+ * line is not consumed, and can be processed further.
+ * Returns non-zero if line (and any lines after it) should be held in
+ * log_syncwait until the logfile has been synced (see log_sync). */
+extern int world_log_line( World *wld, Line *line );
 
 /* Attempt to flush all accumulated lines to the logfile(s).
  * Should be called regularly. */
 extern void world_flush_client_logqueue( World *wld );
 
-/* Attempt to ensure all written logdata actually ends up on disk. */
-extern void world_sync_logdata( World *wld );
+/* Return the number of bytes that were rendered (or compressed) for the
+ * logfile, but have not been written yet (by the log writer thread). */
+extern long world_log_unwritten( World *wld );
+
+/* Return the estimated number of bytes of memory the log writer thread
+ * occupies (see malloc_cost()). */
+extern unsigned long world_log_writer_cost( World *wld );
+
+/* Handle the log writer FD becoming readable, which means the log writer
+ * thread finished a job. */
+extern void world_log_handle_writer_fd( World *wld );
+
+/* Wait for the log writer thread to finish, write what's left, close the
+ * logfile, and stop the thread. */
+extern void world_log_stop( World *wld );
+
+/* If a logfile of an earlier day was being recompressed (see
+ * log_recompress) or its word index compacted, and that's done, clean up
+ * and start what's waiting. Should be called regularly. */
+extern void world_log_reap_tasks( World *wld );
+
+/* Shortly before midnight, open the logfile of the next day ahead of
+ * time. t is the current time. Should be called every minute. */
+extern void world_log_prepare_next( World *wld, time_t t );
 
 /* Remove the 'today' and 'yesterday' logfile symlinks. */
 extern void world_log_link_remove( World *wld );
@@ -0,0 +1,1009 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "global.h"
+#include "logindex.h"
+#include "misc.h"
+
+
+
+/* Identifies an index file. */
+#define LOGINDEX_MAGIC "mpwords1"
+
+/* Is c a letter or a digit? Only ASCII, so it's the same everywhere. */
+#define WORDCHAR( c ) ( ( ( c ) >= 'a' && ( c ) <= 'z' ) || \
+		( ( c ) >= 'A' && ( c ) <= 'Z' ) || \
+		( ( c ) >= '0' && ( c ) <= '9' ) )
+
+/* c in lower case, if it's an ASCII letter. */
+#define LOWER( c ) ( ( ( c ) >= 'A' && ( c ) <= 'Z' ) ? ( c ) + 32 : ( c ) )
+
+/* While compacting, the number of postings sorted in memory at a time
+ * (8MB), and the number read from each sorted run at a time. */
+#define COMPACT_CHUNK 262144
+#define COMPACT_READ 512
+
+
+
+/* The header of the index file. It's followed by nwords Wordentry's (sorted
+ * by word), and then by nposts offsets. */
+typedef struct Wordhdr Wordhdr;
+struct Wordhdr
+{
+	char magic[8];
+	long nwords;
+	long nposts;
+};
+
+/* A word in the index file, and where its offsets are. */
+typedef struct Wordentry Wordentry;
+struct Wordentry
+{
+	Logword word;
+	long first;
+	long count;
+};
+
+/* A word and an offset, while compacting. */
+typedef struct Posting Posting;
+struct Posting
+{
+	Logword word;
+	long offset;
+};
+
+/* A sorted run of postings while compacting. It's in the run file from
+ * start to end, and buf holds n of them, of which i have been merged. */
+typedef struct Run Run;
+struct Run
+{
+	off_t start;
+	off_t pos;
+	off_t end;
+	Posting *buf;
+	long n;
+	long i;
+};
+
+/* The state of compacting an index. Postings are collected in chunk. A
+ * full chunk is sorted and appended to the (unlinked) run file, and those
+ * runs are merged into the index. If all postings fit in the chunk, it's
+ * the only run, and there's no run file. */
+typedef struct Compaction Compaction;
+struct Compaction
+{
+	Posting *chunk;
+	long n;
+	Run *runs;
+	int nruns;
+	char *runfile;
+	int fd;
+	off_t end;
+	int *stop;
+};
+
+/* Buffered output to a place in a file, while compacting. */
+typedef struct Outbuf Outbuf;
+struct Outbuf
+{
+	int fd;
+	off_t pos;
+	long len;
+	char data[65536];
+};
+
+/* The index file of a day, mapped into memory. */
+typedef struct Wordfile Wordfile;
+struct Wordfile
+{
+	char *map;
+	long len;
+	Wordhdr *hdr;
+	Wordentry *entries;
+	long *posts;
+};
+
+
+
+static char *index_name( char *logfile, char *suffix );
+static void flush_word( Logtokenizer *tk );
+static char *read_file( char *file, long *len );
+static long parse_journal( char *data, long len, long pos, Posting *p );
+static int map_index( char *file, Wordfile *wf );
+static Wordentry *find_word( Wordfile *wf, Logword word );
+static int compare_postings( const void *a, const void *b );
+static int compare_offsets( const void *a, const void *b );
+static long sort_unique( long *offsets, long n );
+static int compact_add( Compaction *c, Posting *p );
+static int compact_flush( Compaction *c, int last );
+static int compact_input( Compaction *c, char *file, char *jnlfile );
+static Posting *run_peek( Compaction *c, Run *run );
+static int merge_runs( Compaction *c, int fd, long *nwords, long *nposts );
+static int out_write( Outbuf *ob, void *data, long len );
+static int out_flush( Outbuf *ob );
+static void bloom_bits( char *word, long size, unsigned long *bits );
+
+
+
+extern void logindex_reset( Logtokenizer *tk, long pos, int stamps )
+{
+	tk->pos = pos;
+	tk->linestart = pos;
+	tk->stamps = stamps;
+	tk->wordlen = 0;
+	tk->outlen = 0;
+}
+
+
+
+extern void logindex_feed( Logtokenizer *tk, char *text, long len )
+{
+	long i;
+	char c;
+
+	for( i = 0; i < len; i++, tk->pos++ )
+	{
+		c = text[i];
+
+		if( c == '\n' )
+		{
+			flush_word( tk );
+			tk->linestart = tk->pos + 1;
+			continue;
+		}
+
+		/* Skip the timestamp. */
+		if( tk->stamps && tk->pos - tk->linestart <
+				LOG_TIMESTAMP_LENGTH )
+			continue;
+
+		if( !WORDCHAR( c ) )
+			flush_word( tk );
+		else if( tk->wordlen < LOGINDEX_WORDLEN - 1 )
+			tk->word[tk->wordlen++] = LOWER( c );
+	}
+}
+
+
+
+extern int logindex_compact( char *logfile, int *stop )
+{
+	char *file, *jnlfile, *tmp;
+	Compaction c;
+	Wordhdr hdr;
+	int fd = -1, i, ret = 1;
+
+	file = index_name( logfile, ".words" );
+	jnlfile = index_name( logfile, ".words.jnl" );
+	xasprintf( &tmp, "%s.tmp", file );
+	xasprintf( &c.runfile, "%s.runs", file );
+
+	c.chunk = calloc( COMPACT_CHUNK, sizeof( Posting ) );
+	c.n = 0;
+	c.runs = NULL;
+	c.nruns = 0;
+	c.fd = -1;
+	c.end = 0;
+	c.stop = stop;
+	if( c.chunk == NULL || compact_input( &c, file, jnlfile ) )
+		goto out;
+
+	/* Everything is sorted now. If it's all in the chunk, that's the
+	 * only run, otherwise the chunk makes way for the read buffers. */
+	if( c.nruns == 0 )
+	{
+		c.runs = malloc( sizeof( Run ) );
+		if( c.runs == NULL )
+			goto out;
+		c.runs[0].buf = c.chunk;
+		c.runs[0].n = c.n;
+		c.runs[0].start = c.runs[0].end = 0;
+		c.chunk = NULL;
+		c.nruns = 1;
+	}
+	else
+	{
+		free( c.chunk );
+		c.chunk = NULL;
+		for( i = 0; i < c.nruns; i++ )
+			if( ( c.runs[i].buf = malloc( COMPACT_READ *
+					sizeof( Posting ) ) ) == NULL )
+				goto out;
+	}
+
+	/* Once to count the words and offsets, once to write them. */
+	memcpy( hdr.magic, LOGINDEX_MAGIC, 8 );
+	if( merge_runs( &c, -1, &hdr.nwords, &hdr.nposts ) )
+		goto out;
+
+	fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR );
+	if( fd == -1 )
+		goto out;
+	if( pwrite( fd, &hdr, sizeof( hdr ), 0 ) != sizeof( hdr ) ||
+			merge_runs( &c, fd, &hdr.nwords, &hdr.nposts ) )
+		goto out;
+
+	/* On disk before it replaces the journal. */
+	ret = fsync( fd ) != 0;
+	ret |= close( fd ) != 0;
+	fd = -1;
+	if( ret == 0 )
+		ret = rename( tmp, file );
+	if( ret == 0 )
+		ret = unlink( jnlfile );
+
+out:
+	if( fd > -1 )
+		close( fd );
+	if( ret != 0 )
+		unlink( tmp );
+	if( c.fd > -1 )
+		close( c.fd );
+	for( i = 0; i < c.nruns; i++ )
+		free( c.runs[i].buf );
+	free( c.runs );
+	free( c.chunk );
+	free( c.runfile );
+	free( tmp );
+	free( file );
+	free( jnlfile );
+	return ret;
+}
+
+
+
+extern char *logindex_journal( char *logfile )
+{
+	return index_name( logfile, ".words.jnl" );
+}
+
+
+
+extern int logindex_words( char *str, Logword *words, int max )
+{
+	int n = 0, len;
+
+	while( *str != '\0' && n < max )
+	{
+		while( *str != '\0' && !WORDCHAR( *str ) )
+			str++;
+
+		for( len = 0; WORDCHAR( *str ); str++ )
+			if( len < LOGINDEX_WORDLEN - 1 )
+				words[n][len++] = LOWER( *str );
+
+		words[n][len] = '\0';
+		if( len >= LOGINDEX_MINWORD )
+			n++;
+	}
+
+	return n;
+}
+
+
+
+extern int logindex_match( char *str, Logword *words, int n )
+{
+	unsigned long found = 0, all = ( 1UL << n ) - 1;
+	Logword word;
+	int len, i;
+
+	while( *str != '\0' && found != all )
+	{
+		while( *str != '\0' && !WORDCHAR( *str ) )
+			str++;
+
+		for( len = 0; WORDCHAR( *str ); str++ )
+			if( len < LOGINDEX_WORDLEN - 1 )
+				word[len++] = LOWER( *str );
+
+		word[len] = '\0';
+		for( i = 0; i < n; i++ )
+			if( !strcmp( word, words[i] ) )
+				found |= 1UL << i;
+	}
+
+	return found == all;
+}
+
+
+
+extern void logindex_bloom_add( unsigned char *bloom, long size, char *str )
+{
+	unsigned long bits[2];
+	Logword word;
+	int len;
+
+	while( *str != '\0' )
+	{
+		while( *str != '\0' && !WORDCHAR( *str ) )
+			str++;
+
+		for( len = 0; WORDCHAR( *str ); str++ )
+			if( len < LOGINDEX_WORDLEN - 1 )
+				word[len++] = LOWER( *str );
+
+		word[len] = '\0';
+		if( len < LOGINDEX_MINWORD )
+			continue;
+
+		bloom_bits( word, size, bits );
+		bloom[bits[0] / 8] |= 1 << ( bits[0] % 8 );
+		bloom[bits[1] / 8] |= 1 << ( bits[1] % 8 );
+	}
+}
+
+
+
+extern int logindex_bloom_match( unsigned char *bloom, long size,
+		Logword *words, int n )
+{
+	unsigned long bits[2];
+	int i;
+
+	for( i = 0; i < n; i++ )
+	{
+		bloom_bits( words[i], size, bits );
+		if( !( bloom[bits[0] / 8] & ( 1 << ( bits[0] % 8 ) ) ) ||
+				!( bloom[bits[1] / 8] &
+				( 1 << ( bits[1] % 8 ) ) ) )
+			return 0;
+	}
+
+	return 1;
+}
+
+
+
+extern long *logindex_lookup( char *logfile, Logword *words, int n,
+		long *count )
+{
+	long *result = NULL, *offsets[LOGINDEX_MAXWORDS], num[LOGINDEX_MAXWORDS];
+	long len = 0, pos, i, j, k;
+	char *file, *data;
+	Wordentry *e;
+	Wordfile wf;
+	Posting p;
+
+	/* The compacted index, and the journal of what came later. */
+	file = index_name( logfile, ".words" );
+	wf.map = NULL;
+	map_index( file, &wf );
+	free( file );
+	file = index_name( logfile, ".words.jnl" );
+	data = read_file( file, &len );
+	free( file );
+
+	if( wf.map == NULL && data == NULL )
+		return NULL;
+
+	/* Collect the offsets of each word. */
+	for( i = 0; i < n; i++ )
+	{
+		e = ( wf.map != NULL ) ? find_word( &wf, words[i] ) : NULL;
+		num[i] = ( e != NULL ) ? e->count : 0;
+		offsets[i] = xmalloc( ( num[i] + 16 ) * sizeof( long ) );
+		if( e != NULL )
+			memcpy( offsets[i], wf.posts + e->first, num[i] *
+					sizeof( long ) );
+	}
+
+	for( pos = 0; pos < len; )
+	{
+		pos = parse_journal( data, len, pos, &p );
+		for( i = 0; i < n && p.offset != -1; i++ )
+		{
+			if( strcmp( p.word, words[i] ) )
+				continue;
+			if( num[i] % 16 == 0 )
+				offsets[i] = xrealloc( offsets[i], ( num[i] +
+						16 ) * sizeof( long ) );
+			offsets[i][num[i]++] = p.offset;
+		}
+	}
+
+	/* The lines with all the words: intersect the lists. */
+	for( i = 0; i < n; i++ )
+		num[i] = sort_unique( offsets[i], num[i] );
+	for( i = 1; i < n; i++ )
+	{
+		for( j = 0, k = 0, len = 0; j < num[0] && k < num[i]; )
+			if( offsets[0][j] < offsets[i][k] )
+				j++;
+			else if( offsets[0][j] > offsets[i][k] )
+				k++;
+			else
+				offsets[0][len++] = offsets[0][j++];
+		num[0] = len;
+	}
+
+	*count = ( n > 0 ) ? num[0] : 0;
+	result = ( n > 0 ) ? offsets[0] : xmalloc( sizeof( long ) );
+	for( i = 1; i < n; i++ )
+		free( offsets[i] );
+
+	if( wf.map != NULL )
+		munmap( wf.map, wf.len );
+	free( data );
+	return result;
+}
+
+
+
+extern long logindex_textsize( char *logfile )
+{
+	char buf[65536];
+	struct stat st;
+	long size = 0;
+	gzFile gz;
+	int len = strlen( logfile );
+
+	if( len < 3 || strcmp( logfile + len - 3, ".gz" ) )
+		return ( stat( logfile, &st ) == 0 ) ? st.st_size : 0;
+
+	/* A compressed logfile, we have to decompress it to know. */
+	gz = gzopen( logfile, "rb" );
+	if( gz == NULL )
+		return 0;
+	while( ( len = gzread( gz, buf, sizeof( buf ) ) ) > 0 )
+		size += len;
+	gzclose( gz );
+
+	return size;
+}
+
+
+
+/* Return the name of a file belonging to the index of logfile: the name of
+ * the logfile, with the .log or .log.gz suffix replaced by suffix. Must be
+ * freed. */
+static char *index_name( char *logfile, char *suffix )
+{
+	int len = strlen( logfile );
+	char *name;
+
+	if( len > 3 && !strcmp( logfile + len - 3, ".gz" ) )
+		len -= 3;
+	if( len > 4 && !strncmp( logfile + len - 4, ".log", 4 ) )
+		len -= 4;
+
+	xasprintf( &name, "%.*s%s", len, logfile, suffix );
+	return name;
+}
+
+
+
+/* Add the word we're in (if any) to the journal. */
+static void flush_word( Logtokenizer *tk )
+{
+	char *out;
+
+	if( tk->wordlen < LOGINDEX_MINWORD )
+	{
+		tk->wordlen = 0;
+		return;
+	}
+
+	/* We're in the writer thread, if there's no memory, the word is
+	 * not indexed. */
+	if( tk->outlen + LOGINDEX_WORDLEN + 24 > tk->outsize )
+	{
+		out = realloc( tk->out, tk->outsize * 2 + 4096 );
+		if( out == NULL )
+		{
+			tk->wordlen = 0;
+			return;
+		}
+		tk->out = out;
+		tk->outsize = tk->outsize * 2 + 4096;
+	}
+
+	tk->outlen += sprintf( tk->out + tk->outlen, "%.*s %li\n",
+			tk->wordlen, tk->word, tk->linestart );
+	tk->wordlen = 0;
+}
+
+
+
+/* Read the entire file into memory. Puts the length in len. Returns NULL if
+ * the file can't be read. Uses plain malloc(), so it can be used from the
+ * log writer thread. */
+static char *read_file( char *file, long *len )
+{
+	struct stat st;
+	char *data;
+	int fd, r = 1;
+
+	fd = open( file, O_RDONLY );
+	if( fd == -1 )
+		return NULL;
+
+	if( fstat( fd, &st ) == -1 || ( data = malloc( st.st_size + 1 ) ) ==
+			NULL )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	for( *len = 0; *len < st.st_size && r > 0; *len += r )
+		r = read( fd, data + *len, st.st_size - *len );
+	close( fd );
+
+	if( r < 0 )
+	{
+		free( data );
+		return NULL;
+	}
+
+	return data;
+}
+
+
+
+/* Parse the journal line at pos into p. If it's malformed, p->offset is
+ * -1. Returns the position of the next line. */
+static long parse_journal( char *data, long len, long pos, Posting *p )
+{
+	char *s = data + pos, *end = data + len, *e;
+	long n;
+
+	p->offset = -1;
+
+	for( n = 0; s < end && WORDCHAR( *s ) && n < LOGINDEX_WORDLEN - 1; s++ )
+		p->word[n++] = *s;
+	p->word[n] = '\0';
+
+	if( n >= LOGINDEX_MINWORD && s < end && *s == ' ' )
+	{
+		p->offset = strtol( s + 1, &e, 10 );
+		if( e >= end || *e != '\n' || e == s + 1 )
+			p->offset = -1;
+	}
+
+	/* On to the next line. A partial last line (after a crash) is
+	 * ignored. */
+	e = memchr( s, '\n', end - s );
+	return ( e != NULL ) ? e + 1 - data : len;
+}
+
+
+
+/* Map the index file into wf. Returns 0 on success, nonzero if there is no
+ * (valid) index. */
+static int map_index( char *file, Wordfile *wf )
+{
+	struct stat st;
+	int fd;
+
+	wf->map = NULL;
+	fd = open( file, O_RDONLY );
+	if( fd == -1 )
+		return 1;
+
+	if( fstat( fd, &st ) == -1 || st.st_size < sizeof( Wordhdr ) )
+	{
+		close( fd );
+		return 1;
+	}
+
+	wf->len = st.st_size;
+	wf->map = mmap( NULL, wf->len, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( wf->map == MAP_FAILED )
+	{
+		wf->map = NULL;
+		return 1;
+	}
+
+	wf->hdr = (Wordhdr *) wf->map;
+	wf->entries = (Wordentry *) ( wf->hdr + 1 );
+	wf->posts = (long *) ( wf->entries + wf->hdr->nwords );
+
+	if( memcmp( wf->hdr->magic, LOGINDEX_MAGIC, 8 ) ||
+			wf->hdr->nwords < 0 || wf->hdr->nposts < 0 ||
+			sizeof( Wordhdr ) + wf->hdr->nwords *
+			sizeof( Wordentry ) + wf->hdr->nposts *
+			sizeof( long ) != wf->len )
+	{
+		munmap( wf->map, wf->len );
+		wf->map = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/* Binary search for word in the index. Returns its entry, or NULL. */
+static Wordentry *find_word( Wordfile *wf, Logword word )
+{
+	long low = 0, high = wf->hdr->nwords - 1, mid;
+	int cmp;
+
+	while( low <= high )
+	{
+		mid = ( low + high ) / 2;
+		cmp = strncmp( word, wf->entries[mid].word, LOGINDEX_WORDLEN );
+		if( cmp == 0 )
+		{
+			/* Don't trust the file beyond its size. */
+			if( wf->entries[mid].first < 0 ||
+					wf->entries[mid].count < 0 ||
+					wf->entries[mid].first +
+					wf->entries[mid].count >
+					wf->hdr->nposts )
+				return NULL;
+			return &wf->entries[mid];
+		}
+		if( cmp < 0 )
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+
+	return NULL;
+}
+
+
+
+static int compare_postings( const void *a, const void *b )
+{
+	const Posting *pa = a, *pb = b;
+	int cmp;
+
+	cmp = strncmp( pa->word, pb->word, LOGINDEX_WORDLEN );
+	if( cmp != 0 )
+		return cmp;
+
+	return ( pa->offset > pb->offset ) - ( pa->offset < pb->offset );
+}
+
+
+
+static int compare_offsets( const void *a, const void *b )
+{
+	const long *la = a, *lb = b;
+
+	return ( *la > *lb ) - ( *la < *lb );
+}
+
+
+
+/* Sort the offsets and remove the duplicates. Returns the new number. */
+static long sort_unique( long *offsets, long n )
+{
+	long i, j;
+
+	qsort( offsets, n, sizeof( long ), compare_offsets );
+	for( i = 0, j = 0; i < n; i++ )
+		if( j == 0 || offsets[i] != offsets[j - 1] )
+			offsets[j++] = offsets[i];
+
+	return j;
+}
+
+
+
+/* Add p to the chunk, and write the chunk out as a run if it's full.
+ * Returns 0 on success, nonzero on failure. */
+static int compact_add( Compaction *c, Posting *p )
+{
+	if( c->n == COMPACT_CHUNK && compact_flush( c, 0 ) )
+		return 1;
+
+	c->chunk[c->n++] = *p;
+	return 0;
+}
+
+
+
+/* Sort the chunk by word, and by offset within each word, and remove the
+ * duplicates (a word occuring twice in a line). Then append it to the run
+ * file as a run, unless it's the last chunk and the only one, or there's
+ * still plenty of room in it. Returns 0 on success, nonzero on failure. */
+static int compact_flush( Compaction *c, int last )
+{
+	long i, j, len;
+	Run *runs;
+
+	qsort( c->chunk, c->n, sizeof( Posting ), compare_postings );
+	for( i = 0, j = 0; i < c->n; i++ )
+		if( j == 0 || compare_postings( &c->chunk[i],
+				&c->chunk[j - 1] ) )
+			c->chunk[j++] = c->chunk[i];
+	c->n = j;
+
+	if( c->nruns == 0 && ( last || c->n <= COMPACT_CHUNK / 2 ) )
+		return 0;
+	if( c->n == 0 )
+		return 0;
+
+	/* Nobody else needs to see the run file. */
+	if( c->fd == -1 )
+	{
+		c->fd = open( c->runfile, O_RDWR | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR );
+		if( c->fd == -1 )
+			return 1;
+		unlink( c->runfile );
+	}
+
+	runs = realloc( c->runs, ( c->nruns + 1 ) * sizeof( Run ) );
+	if( runs == NULL )
+		return 1;
+	c->runs = runs;
+
+	len = c->n * sizeof( Posting );
+	if( pwrite( c->fd, c->chunk, len, c->end ) != len )
+		return 1;
+
+	runs[c->nruns].start = c->end;
+	runs[c->nruns].end = c->end + len;
+	runs[c->nruns].buf = NULL;
+	c->nruns++;
+	c->end += len;
+	c->n = 0;
+	return 0;
+}
+
+
+
+/* Collect the postings of the index file (if any) and the journal, and
+ * sort them into runs. Returns 0 on success, nonzero on failure or if
+ * we're told to stop. */
+static int compact_input( Compaction *c, char *file, char *jnlfile )
+{
+	char data[65536];
+	long len = 0, pos, i, j;
+	Wordfile wf;
+	Posting p;
+	int fd, r = 1;
+
+	fd = open( jnlfile, O_RDONLY );
+	if( fd == -1 )
+		return 1;
+
+	/* What's in the index already stays. */
+	if( map_index( file, &wf ) == 0 )
+	{
+		for( i = 0; i < wf.hdr->nwords && r == 1; i++ )
+			for( j = 0; j < wf.entries[i].count; j++ )
+			{
+				memcpy( p.word, wf.entries[i].word,
+						LOGINDEX_WORDLEN );
+				p.offset = wf.posts[wf.entries[i].first + j];
+				if( compact_add( c, &p ) )
+				{
+					r = -1;
+					break;
+				}
+			}
+		munmap( wf.map, wf.len );
+	}
+
+	/* The journal, a buffer at a time. Only whole lines are parsed,
+	 * the rest moves to the front. */
+	while( r > 0 )
+	{
+		if( __atomic_load_n( c->stop, __ATOMIC_ACQUIRE ) )
+			break;
+
+		r = read( fd, data + len, sizeof( data ) - len );
+		if( r < 0 )
+			break;
+		len += r;
+
+		/* At the end, parse_journal() skips a partial last line. */
+		pos = 0;
+		while( pos < len && ( r == 0 ||
+				memchr( data + pos, '\n', len - pos ) != NULL ) )
+		{
+			pos = parse_journal( data, len, pos, &p );
+			if( p.offset != -1 && compact_add( c, &p ) )
+			{
+				r = -1;
+				break;
+			}
+		}
+
+		memmove( data, data + pos, len - pos );
+		len -= pos;
+	}
+
+	close( fd );
+	if( r != 0 )
+		return 1;
+
+	return compact_flush( c, 1 );
+}
+
+
+
+/* Return the next posting of run, reading more from the run file when
+ * needed, or NULL if the run is done (or can't be read). */
+static Posting *run_peek( Compaction *c, Run *run )
+{
+	long len;
+
+	if( run->i < run->n )
+		return &run->buf[run->i];
+
+	len = run->end - run->pos;
+	if( len > COMPACT_READ * sizeof( Posting ) )
+		len = COMPACT_READ * sizeof( Posting );
+	if( len <= 0 || pread( c->fd, run->buf, len, run->pos ) != len )
+		return NULL;
+
+	run->pos += len;
+	run->n = len / sizeof( Posting );
+	run->i = 0;
+	return &run->buf[0];
+}
+
+
+
+/* Merge the runs. Postings that occur in more than one run are only
+ * counted once. If fd is -1, just put the number of words and postings in
+ * nwords and nposts. Otherwise, write the words and their offsets to the
+ * index file fd, of which nwords and nposts are known. Returns 0 on
+ * success, nonzero on failure or if we're told to stop. */
+static int merge_runs( Compaction *c, int fd, long *nwords, long *nposts )
+{
+	Outbuf *entries = NULL, *posts = NULL;
+	Posting *min, *cur, last;
+	Wordentry e;
+	long words = 0, n = 0;
+	int i, m = 0, ret = 1;
+
+	for( i = 0; i < c->nruns; i++ )
+	{
+		c->runs[i].pos = c->runs[i].start;
+		if( c->runs[i].start != c->runs[i].end )
+			c->runs[i].n = 0;
+		c->runs[i].i = 0;
+	}
+
+	if( fd > -1 )
+	{
+		entries = malloc( sizeof( Outbuf ) );
+		posts = malloc( sizeof( Outbuf ) );
+		if( entries == NULL || posts == NULL )
+			goto out;
+		entries->fd = posts->fd = fd;
+		entries->len = posts->len = 0;
+		entries->pos = sizeof( Wordhdr );
+		posts->pos = sizeof( Wordhdr ) + *nwords * sizeof( Wordentry );
+	}
+
+	memset( &e, 0, sizeof( e ) );
+	for( ;; )
+	{
+		if( __atomic_load_n( c->stop, __ATOMIC_ACQUIRE ) )
+			goto out;
+
+		/* There aren't many runs, so just look at all of them. */
+		for( i = 0, min = NULL; i < c->nruns; i++ )
+		{
+			cur = run_peek( c, &c->runs[i] );
+			if( cur != NULL && ( min == NULL ||
+					compare_postings( cur, min ) < 0 ) )
+			{
+				min = cur;
+				m = i;
+			}
+		}
+		if( min == NULL )
+			break;
+		c->runs[m].i++;
+
+		if( n > 0 && !compare_postings( min, &last ) )
+			continue;
+
+		/* A new word. Its predecessor is complete. */
+		if( n == 0 || strncmp( min->word, last.word,
+				LOGINDEX_WORDLEN ) )
+		{
+			if( n > 0 && fd > -1 && out_write( entries, &e,
+					sizeof( e ) ) )
+				goto out;
+			memset( &e, 0, sizeof( e ) );
+			strcpy( e.word, min->word );
+			e.first = n;
+			words++;
+		}
+
+		if( fd > -1 && out_write( posts, &min->offset,
+				sizeof( long ) ) )
+			goto out;
+		e.count++;
+		n++;
+		last = *min;
+	}
+
+	if( fd == -1 )
+	{
+		*nwords = words;
+		*nposts = n;
+		ret = 0;
+	}
+	else if( ( n == 0 || out_write( entries, &e, sizeof( e ) ) == 0 ) &&
+			out_flush( entries ) == 0 && out_flush( posts ) == 0 &&
+			words == *nwords && n == *nposts )
+		ret = 0;
+
+out:
+	free( entries );
+	free( posts );
+	return ret;
+}
+
+
+
+/* Append len bytes of data to ob. Returns 0 on success, nonzero on
+ * failure. */
+static int out_write( Outbuf *ob, void *data, long len )
+{
+	if( ob->len + len > sizeof( ob->data ) && out_flush( ob ) )
+		return 1;
+
+	memcpy( ob->data + ob->len, data, len );
+	ob->len += len;
+	return 0;
+}
+
+
+
+/* Write out what's in ob. Returns 0 on success, nonzero on failure. */
+static int out_flush( Outbuf *ob )
+{
+	if( ob->len > 0 && pwrite( ob->fd, ob->data, ob->len, ob->pos ) !=
+			ob->len )
+		return 1;
+
+	ob->pos += ob->len;
+	ob->len = 0;
+	return 0;
+}
+
+
+
+/* Put the two bits that word sets in a bloom filter of size bytes in
+ * bits. */
+static void bloom_bits( char *word, long size, unsigned long *bits )
+{
+	unsigned long h = 2166136261UL, nbits = size * 8;
+
+	/* FNV-1a. */
+	for( ; *word != '\0'; word++ )
+		h = ( ( h ^ (unsigned char) *word ) * 16777619UL ) &
+				0xFFFFFFFFUL;
+
+	bits[0] = h % nbits;
+	bits[1] = h / nbits % nbits;
+}
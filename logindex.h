@@ -0,0 +1,112 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#ifndef MOOPROXY__HEADER__LOGINDEX
+#define MOOPROXY__HEADER__LOGINDEX
+
+
+
+/* The word index of the logfiles. For each day, it maps the words in the
+ * logfile to the offsets of the lines containing them. Offsets are in the
+ * text of the logfile, so they are the same for the plain and the
+ * compressed logfile.
+ *
+ * A word is a run of (ASCII) letters and digits, case-insensitive, of at
+ * least LOGINDEX_MINWORD characters. Only the first LOGINDEX_WORDLEN - 1
+ * characters count. Timestamps are not indexed.
+ *
+ * While a day is being logged, the log writer thread appends "word offset"
+ * lines to a journal (.words.jnl). When the day is over, the journal is
+ * compacted into a sorted index (.words), which is searched with a binary
+ * search. Both are next to the logfile. */
+
+#define LOGINDEX_WORDLEN 24
+#define LOGINDEX_MINWORD 2
+/* The maximum number of words in a search. */
+#define LOGINDEX_MAXWORDS 16
+
+typedef char Logword[LOGINDEX_WORDLEN];
+
+/* The state of the log writer thread indexing the text it writes. */
+typedef struct Logtokenizer Logtokenizer;
+struct Logtokenizer
+{
+	/* The position in the text of the logfile, and the start of the line
+	 * we're in. */
+	long pos;
+	long linestart;
+	/* If the lines start with a timestamp, to skip. */
+	int stamps;
+	/* The word we're in. */
+	Logword word;
+	int wordlen;
+	/* Journal lines that are yet to be written. */
+	char *out;
+	long outlen;
+	long outsize;
+};
+
+
+
+/* Reset tk for a logfile of which pos bytes of text exist already. If
+ * stamps is true, the lines start with a timestamp. */
+extern void logindex_reset( Logtokenizer *tk, long pos, int stamps );
+
+/* Index len bytes of text, which continue the text fed so far. Journal
+ * lines are appended to tk->out. Safe to call from the log writer thread. */
+extern void logindex_feed( Logtokenizer *tk, char *text, long len );
+
+/* Merge the journal of the day of logfile into its index, and remove the
+ * journal. Sorts a bounded chunk at a time and merges the sorted runs, so
+ * it takes little memory, however long the day was. Gives up (leaving the
+ * journal) as soon as *stop becomes nonzero. Safe to call from another
+ * thread. Returns 0 on success, nonzero on failure. */
+extern int logindex_compact( char *logfile, int *stop );
+
+/* Return the name of the journal of logfile. Must be freed. */
+extern char *logindex_journal( char *logfile );
+
+/* Split str into the words that would be indexed. Puts at most max words
+ * in words, and returns the number of words. */
+extern int logindex_words( char *str, Logword *words, int max );
+
+/* Return true if the (ANSI-free) string str contains all n words. */
+extern int logindex_match( char *str, Logword *words, int n );
+
+/* Add the words of the (ANSI-free) string str to the bloom filter bloom
+ * of size bytes. */
+extern void logindex_bloom_add( unsigned char *bloom, long size, char *str );
+
+/* Return true if the bloom filter bloom of size bytes may have all n
+ * words. */
+extern int logindex_bloom_match( unsigned char *bloom, long size,
+		Logword *words, int n );
+
+/* Look up the lines in the logfile that contain all n words. Returns the
+ * sorted offsets of those lines, and puts their number in count. Returns
+ * NULL if the logfile has no index. The offsets must be freed. */
+extern long *logindex_lookup( char *logfile, Logword *words, int n,
+		long *count );
+
+/* Return the number of bytes of text in the logfile, plain or
+ * compressed. */
+extern long logindex_textsize( char *logfile );
+
+
+
+#endif  /* ifndef MOOPROXY__HEADER__LOGINDEX */
@@ -0,0 +1,510 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "global.h"
+#include "logread.h"
+#include "misc.h"
+
+
+
+/* A compressed logfile is decompressed in steps of this many bytes. */
+#define LOGREAD_CHUNK ( 256 * 1024 )
+/* At most this much of the index of a logfile is read. A day has at most
+ * 1440 entries, that fits. */
+#define LOGREAD_INDEXSIZE ( 32 * 1024 )
+
+/* Is c a decimal digit? */
+#define DIGIT( c ) ( ( c ) >= '0' && ( c ) <= '9' )
+
+
+
+static time_t day_start( time_t t, int delta );
+static time_t month_start( time_t t, int delta );
+static time_t oldest_month( char *dir );
+static int month_exists( char *dir, time_t t );
+static Logday *open_day( World *wld, char *dir, time_t start );
+static int load_compressed( Logday *ld, int fd );
+static long index_offset( Logday *ld, time_t t );
+static int has_timestamp( Logday *ld, long offset );
+
+
+
+extern Logday *world_logday_find( World *wld, time_t t, int dir,
+		time_t limit )
+{
+	Logday *ld = NULL;
+	time_t oldest;
+	char *logdir;
+
+	xasprintf( &logdir, "%s/%s/%s/%s", get_homedir(), CONFIGDIR, LOGSDIR,
+			wld->name );
+
+	/* No logs at all? */
+	oldest = oldest_month( logdir );
+	if( oldest == -1 )
+	{
+		free( logdir );
+		return NULL;
+	}
+
+	t = day_start( t, 0 );
+	limit = day_start( limit, 0 );
+	if( dir > 0 && t < oldest )
+		t = oldest;
+
+	while( dir > 0 ? t <= limit : t >= limit && t >= oldest )
+	{
+		/* Skip months without logs in one go. */
+		if( !month_exists( logdir, t ) )
+		{
+			t = ( dir > 0 ) ? month_start( t, 1 ) :
+					day_start( month_start( t, 0 ), -1 );
+			continue;
+		}
+
+		ld = open_day( wld, logdir, t );
+		if( ld != NULL )
+			break;
+
+		t = day_start( t, dir );
+	}
+
+	free( logdir );
+	return ld;
+}
+
+
+
+extern int logday_load( Logday *ld )
+{
+	struct stat st;
+	int fd = ld->fd;
+
+	ld->fd = -1;
+	if( fstat( fd, &st ) == -1 )
+	{
+		close( fd );
+		return 1;
+	}
+
+	/* A plain logfile is mapped, so only the parts we look at are read
+	 * from disk. A compressed one has to be decompressed in full. */
+	if( !ld->mapped )
+		return load_compressed( ld, fd );
+
+	if( st.st_size > 0 )
+	{
+		ld->data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+				0 );
+		if( ld->data == MAP_FAILED )
+		{
+			ld->data = NULL;
+			close( fd );
+			return 1;
+		}
+		ld->len = st.st_size;
+		madvise( ld->data, ld->len, MADV_SEQUENTIAL );
+	}
+
+	close( fd );
+	return 0;
+}
+
+
+
+extern void logday_close( Logday *ld )
+{
+	if( ld == NULL )
+		return;
+
+	if( ld->fd != -1 )
+		close( ld->fd );
+
+	if( ld->mapped && ld->len > 0 )
+		munmap( ld->data, ld->len );
+	else if( !ld->mapped )
+		free( ld->data );
+
+	free( ld->file );
+	free( ld->line );
+	free( ld );
+}
+
+
+
+extern long logday_first( Logday *ld )
+{
+	return ( ld->len > 0 ) ? 0 : -1;
+}
+
+
+
+extern long logday_last( Logday *ld )
+{
+	long offset = ld->len;
+
+	if( ld->len == 0 )
+		return -1;
+
+	/* The last line usually ends in a newline, which we skip. */
+	if( ld->data[offset - 1] == '\n' )
+		offset--;
+	while( offset > 0 && ld->data[offset - 1] != '\n' )
+		offset--;
+
+	return offset;
+}
+
+
+
+extern long logday_next( Logday *ld, long offset )
+{
+	char *nl;
+
+	nl = memchr( ld->data + offset, '\n', ld->len - offset );
+	if( nl == NULL || nl + 1 == ld->data + ld->len )
+		return -1;
+
+	return nl + 1 - ld->data;
+}
+
+
+
+extern long logday_prev( Logday *ld, long offset )
+{
+	if( offset == 0 )
+		return -1;
+
+	/* Skip the newline of the previous line, and find its start. */
+	offset--;
+	while( offset > 0 && ld->data[offset - 1] != '\n' )
+		offset--;
+
+	return offset;
+}
+
+
+
+extern long logday_seek( Logday *ld, time_t t )
+{
+	long offset;
+
+	if( ld->len == 0 )
+		return -1;
+
+	offset = index_offset( ld, t );
+	while( offset != -1 && logday_time( ld, offset ) < t )
+		offset = logday_next( ld, offset );
+
+	return offset;
+}
+
+
+
+extern time_t logday_time( Logday *ld, long offset )
+{
+	char *s = ld->data + offset;
+
+	if( !has_timestamp( ld, offset ) )
+		return ld->start;
+
+	return ld->hour[( ( s[1] - '0' ) * 10 + s[2] - '0' ) % 24] +
+			( ( s[4] - '0' ) * 10 + s[5] - '0' ) * 60 +
+			( s[7] - '0' ) * 10 + s[8] - '0';
+}
+
+
+
+extern void logday_get( Logday *ld, long offset, Line *line )
+{
+	char *nl;
+	long len;
+
+	line->time = logday_time( ld, offset );
+	if( has_timestamp( ld, offset ) )
+		offset += LOG_TIMESTAMP_LENGTH;
+
+	nl = memchr( ld->data + offset, '\n', ld->len - offset );
+	len = ( nl != NULL ) ? nl - ld->data - offset : ld->len - offset;
+
+	if( len + 1 > ld->linesize )
+	{
+		ld->linesize = len + 1;
+		ld->line = xrealloc( ld->line, ld->linesize );
+	}
+	memcpy( ld->line, ld->data + offset, len );
+	ld->line[len] = '\0';
+
+	line->str = ld->line;
+	line->next = NULL;
+	line->prev = NULL;
+	line->len = len;
+	line->day = 0;
+	line->flags = 0;
+	line->shared = NULL;
+}
+
+
+
+/* Return the start of the day delta days after the day t falls in. */
+static time_t day_start( time_t t, int delta )
+{
+	struct tm tm = *localtime( &t );
+
+	tm.tm_mday += delta;
+	tm.tm_sec = 0;
+	tm.tm_min = 0;
+	tm.tm_hour = 0;
+	tm.tm_isdst = -1;
+
+	return mktime( &tm );
+}
+
+
+
+/* Return the start of the month delta months after the month t falls in. */
+static time_t month_start( time_t t, int delta )
+{
+	struct tm tm = *localtime( &t );
+
+	tm.tm_mon += delta;
+	tm.tm_mday = 1;
+	tm.tm_sec = 0;
+	tm.tm_min = 0;
+	tm.tm_hour = 0;
+	tm.tm_isdst = -1;
+
+	return mktime( &tm );
+}
+
+
+
+/* Return the start of the oldest month that dir has a YYYY-MM directory
+ * for, or -1 if there is none. */
+static time_t oldest_month( char *dir )
+{
+	struct dirent *de;
+	struct tm tm;
+	time_t t, oldest = -1;
+	int year, mon, len = 0;
+	DIR *d;
+
+	d = opendir( dir );
+	if( d == NULL )
+		return -1;
+
+	while( ( de = readdir( d ) ) != NULL )
+	{
+		if( sscanf( de->d_name, "%4d-%2d%n", &year, &mon, &len ) != 2 ||
+				de->d_name[len] != '\0' )
+			continue;
+
+		memset( &tm, 0, sizeof( tm ) );
+		tm.tm_year = year - 1900;
+		tm.tm_mon = mon - 1;
+		tm.tm_mday = 1;
+		tm.tm_isdst = -1;
+		t = mktime( &tm );
+		if( t != -1 && ( oldest == -1 || t < oldest ) )
+			oldest = t;
+	}
+
+	closedir( d );
+	return oldest;
+}
+
+
+
+/* Return true if dir has a directory for the month t falls in. */
+static int month_exists( char *dir, time_t t )
+{
+	struct stat st;
+	char *path;
+	int ret;
+
+	xasprintf( &path, "%s/%s", dir, time_string( t, "%Y-%m" ) );
+	ret = stat( path, &st ) == 0 && S_ISDIR( st.st_mode );
+	free( path );
+
+	return ret;
+}
+
+
+
+/* Open the logfile in dir for the day starting at start, plain or
+ * compressed. Returns NULL if there is none. */
+static Logday *open_day( World *wld, char *dir, time_t start )
+{
+	static char *suffixes[] = { ".log", ".log.gz" };
+	Logday *ld;
+	struct tm tm;
+	int i;
+
+	ld = xmalloc( sizeof( Logday ) );
+	ld->file = NULL;
+	ld->fd = -1;
+	ld->data = NULL;
+	ld->len = 0;
+	ld->line = NULL;
+	ld->linesize = 0;
+
+	for( i = 0; i < 2 && ld->fd == -1; i++ )
+	{
+		free( ld->file );
+		xasprintf( &ld->file, "%s/%s/%s - %s%s", dir,
+				time_string( start, "%Y-%m" ), wld->name,
+				time_string( start, "%F" ), suffixes[i] );
+		ld->fd = open( ld->file, O_RDONLY );
+	}
+
+	if( ld->fd == -1 )
+	{
+		logday_close( ld );
+		return NULL;
+	}
+	ld->mapped = !strcmp( suffixes[i - 1], ".log" );
+
+	/* The start of each hour, for the timestamps. On days with a
+	 * daylight saving time switch, not all hours are 3600 seconds. */
+	ld->start = start;
+	ld->end = day_start( start, 1 );
+	for( i = 0; i < 24; i++ )
+	{
+		tm = *localtime( &start );
+		tm.tm_hour = i;
+		tm.tm_isdst = -1;
+		ld->hour[i] = mktime( &tm );
+	}
+
+	return ld;
+}
+
+
+
+/* Decompress the logfile open at fd into ld->data. fd is consumed.
+ * Returns 0 on success, nonzero on failure. */
+static int load_compressed( Logday *ld, int fd )
+{
+	long size = LOGREAD_CHUNK;
+	gzFile gz;
+	int len, err;
+
+	gz = gzdopen( fd, "rb" );
+	if( gz == NULL )
+	{
+		close( fd );
+		return 1;
+	}
+
+	ld->data = xmalloc( size );
+	ld->len = 0;
+	while( ( len = gzread( gz, ld->data + ld->len, size - ld->len ) ) > 0 )
+	{
+		ld->len += len;
+		if( ld->len == size )
+		{
+			size *= 2;
+			ld->data = xrealloc( ld->data, size );
+		}
+	}
+
+	/* If mooproxy crashed, the file ends in the middle of a gzip member.
+	 * We use what there is. */
+	gzerror( gz, &err );
+	gzclose( gz );
+	if( len < 0 && err != Z_BUF_ERROR )
+	{
+		free( ld->data );
+		ld->data = NULL;
+		ld->len = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/* Return the offset of a line before any line with a time of at least t,
+ * preferably the last such one, using the index of the logfile. Only the
+ * index of a plain logfile has offsets we can use. */
+static long index_offset( Logday *ld, time_t t )
+{
+	char *file, buf[LOGREAD_INDEXSIZE], *e;
+	long offset = 0, o, len = 0;
+	int fd, r;
+
+	if( !ld->mapped )
+		return 0;
+
+	xasprintf( &file, "%s.idx", ld->file );
+	fd = open( file, O_RDONLY );
+	free( file );
+	if( fd == -1 )
+		return 0;
+
+	while( len < sizeof( buf ) && ( r = read( fd, buf + len,
+			sizeof( buf ) - len ) ) > 0 )
+		len += r;
+	close( fd );
+
+	/* Everything before the start of a minute is older than that minute.
+	 * Skip malformed entries, and those that don't point at the start of
+	 * a line. */
+	for( e = buf; e + LOG_INDEX_ENTRYLEN <= buf + len;
+			e += LOG_INDEX_ENTRYLEN )
+	{
+		if( !DIGIT( e[0] ) || !DIGIT( e[1] ) || e[2] != ':' ||
+				!DIGIT( e[3] ) || !DIGIT( e[4] ) ||
+				e[5] != ' ' || e[LOG_INDEX_ENTRYLEN - 1] != '\n' )
+			break;
+
+		o = strtol( e + 6, NULL, 10 );
+		if( o > offset && o < ld->len && ld->data[o - 1] == '\n' &&
+				ld->hour[( ( e[0] - '0' ) * 10 + e[1] - '0' )
+				% 24] + ( ( e[3] - '0' ) * 10 + e[4] - '0' ) *
+				60 <= t )
+			offset = o;
+	}
+
+	return offset;
+}
+
+
+
+/* Return true if the line at offset starts with a timestamp. */
+static int has_timestamp( Logday *ld, long offset )
+{
+	char *s = ld->data + offset;
+
+	return offset + LOG_TIMESTAMP_LENGTH <= ld->len && s[0] == '[' &&
+			DIGIT( s[1] ) && DIGIT( s[2] ) && s[3] == ':' &&
+			DIGIT( s[4] ) && DIGIT( s[5] ) && s[6] == ':' &&
+			DIGIT( s[7] ) && DIGIT( s[8] ) && s[9] == ']';
+}
@@ -0,0 +1,97 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#ifndef MOOPROXY__HEADER__LOGREAD
+#define MOOPROXY__HEADER__LOGREAD
+
+
+
+#include <time.h>
+
+#include "world.h"
+#include "line.h"
+
+
+
+/* Reading back the logfiles of a world, one day at a time. A plain logfile
+ * is mapped into memory; a compressed one is decompressed into memory.
+ * Lines are identified by their offset in the logfile. An offset of -1
+ * means "no such line".
+ *
+ * The time of a line is taken from its timestamp. Lines without one (when
+ * log_timestamps was off) are dated at the start of their day. */
+typedef struct Logday Logday;
+struct Logday
+{
+	/* The logfile, open until it's loaded, and its contents. */
+	char *file;
+	int fd;
+	char *data;
+	long len;
+	int mapped;
+
+	/* The start of the day, of the next day, and of each hour. */
+	time_t start;
+	time_t end;
+	time_t hour[24];
+
+	/* Holds the string of the line last handed out. */
+	char *line;
+	long linesize;
+};
+
+
+
+/* Open the logfile of the day that t falls in. If there is none, try the
+ * next day (dir = 1) or the previous day (dir = -1), and so on, but not
+ * beyond the day of limit, or beyond the oldest logs. Returns NULL if no
+ * logfile was found. The logfile must be loaded before its lines can be
+ * accessed. */
+extern Logday *world_logday_find( World *wld, time_t t, int dir,
+		time_t limit );
+
+/* Map or decompress the logfile. Returns 0 on success, nonzero on failure,
+ * in which case ld should be closed. */
+extern int logday_load( Logday *ld );
+
+/* Unmap/free the logfile, and free ld itself. */
+extern void logday_close( Logday *ld );
+
+/* Return the offset of the first/last line in the logfile. */
+extern long logday_first( Logday *ld );
+extern long logday_last( Logday *ld );
+
+/* Return the offset of the line after/before offset. */
+extern long logday_next( Logday *ld, long offset );
+extern long logday_prev( Logday *ld, long offset );
+
+/* Return the offset of the first line with a time of at least t. Uses the
+ * index of the logfile (if there is one) to skip most of the day. */
+extern long logday_seek( Logday *ld, time_t t );
+
+/* Return the time of the line at offset. */
+extern time_t logday_time( Logday *ld, long offset );
+
+/* Fill in line with the line at offset, without the timestamp. line->str
+ * points into ld and must not be freed or modified, and it is only valid
+ * until the next call to logday_get(). */
+extern void logday_get( Logday *ld, long offset, Line *line );
+
+
+
+#endif  /* ifndef MOOPROXY__HEADER__LOGREAD */
@@ -0,0 +1,356 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "global.h"
+#include "logspool.h"
+#include "misc.h"
+
+
+
+/* Identifies a log spool file, and the version of its format. */
+#define SPOOL_MAGIC "mpspool1"
+
+
+
+/* The header at the start of the spool file. */
+typedef struct Spoolhdr Spoolhdr;
+struct Spoolhdr
+{
+	char magic[8];
+	/* Offset of the oldest record that has not been taken back yet. */
+	long start;
+};
+
+/* The header of a record in the spool file. The string follows it. */
+typedef struct Spoolrec Spoolrec;
+struct Spoolrec
+{
+	time_t time;
+	long day;
+	long len;
+	long flags;
+};
+
+
+
+static int open_spool_file( World *wld, int create );
+static int write_header( World *wld );
+static int read_record( World *wld, long offset, Spoolrec *rec );
+static void spool_error( World *wld, char *what, int err, int lost );
+
+
+
+extern int world_logspool_append( World *wld, Line *line )
+{
+	struct iovec iov[2];
+	Spoolrec rec;
+	long size = sizeof( Spoolrec ) + line->len;
+	long limit = wld->log_spool_size * 1024;
+	ssize_t wr;
+
+	/* Spooling is disabled, or we gave up on it. */
+	if( limit <= 0 || wld->logspool_broken )
+		return 1;
+
+	if( wld->logspool_fd == -1 && open_spool_file( wld, 1 ) )
+		return 1;
+
+	/* The spool is full. The file is only emptied once all lines have
+	 * been taken back, so count all of it. */
+	if( wld->logspool_end - (long) sizeof( Spoolhdr ) + size > limit )
+		return 1;
+
+	rec.time = line->time;
+	rec.day = line->day;
+	rec.len = line->len;
+	rec.flags = line->flags;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof( Spoolrec );
+	iov[1].iov_base = line->str;
+	iov[1].iov_len = line->len;
+
+	if( lseek( wld->logspool_fd, wld->logspool_end, SEEK_SET ) == -1 )
+		wr = -1;
+	else
+		wr = writev( wld->logspool_fd, iov, 2 );
+
+	if( wr != size )
+	{
+		/* A short write means the disk is full. The partial
+		 * record lies beyond logspool_end, so it doesn't count. */
+		if( wr >= 0 )
+			errno = ENOSPC;
+		spool_error( wld, "writing to", errno, 0 );
+		return 1;
+	}
+
+	wld->logspool_end += size;
+	wld->logspool_count++;
+	return 0;
+}
+
+
+
+extern void world_logspool_drain( World *wld, unsigned long max )
+{
+	unsigned long taken = 0;
+	Spoolrec rec;
+	Line *line;
+	char *str;
+
+	while( wld->logspool_count > 0 && ( taken == 0 || taken < max ) )
+	{
+		if( read_record( wld, wld->logspool_start, &rec ) )
+		{
+			spool_error( wld, "reading from", errno, 1 );
+			return;
+		}
+
+		str = xmalloc( rec.len + 1 );
+		if( pread( wld->logspool_fd, str, rec.len, wld->logspool_start +
+				sizeof( Spoolrec ) ) != rec.len )
+		{
+			free( str );
+			spool_error( wld, "reading from", errno, 1 );
+			return;
+		}
+		str[rec.len] = '\0';
+
+		line = line_create( str, rec.len );
+		line->time = rec.time;
+		line->day = rec.day;
+		line->flags = rec.flags;
+		linequeue_append( wld->log_queue, line );
+
+		taken += line_cost( line );
+		wld->logspool_start += sizeof( Spoolrec ) + rec.len;
+		wld->logspool_count--;
+	}
+
+	/* All lines are back, start over with an empty file. */
+	if( wld->logspool_count == 0 )
+	{
+		wld->logspool_start = sizeof( Spoolhdr );
+		wld->logspool_end = sizeof( Spoolhdr );
+		if( ftruncate( wld->logspool_fd, wld->logspool_end ) == -1 )
+		{
+			spool_error( wld, "truncating", errno, 0 );
+			return;
+		}
+	}
+
+	/* Remember how far we got, so the lines taken back aren't logged
+	 * twice if mooproxy is restarted. */
+	if( write_header( wld ) )
+	{
+		spool_error( wld, "writing to", errno, 0 );
+		return;
+	}
+
+	/* If spooling was disabled in the meantime, we're done with it. */
+	if( wld->logspool_count == 0 && wld->log_spool_size <= 0 )
+		world_logspool_close( wld );
+}
+
+
+
+extern void world_logspool_recover( World *wld )
+{
+	Spoolhdr hdr;
+	Spoolrec rec;
+	struct stat fileinfo;
+	long offset;
+
+	if( open_spool_file( wld, 0 ) )
+		return;
+
+	/* No (valid) header, so nothing to recover. */
+	if( fstat( wld->logspool_fd, &fileinfo ) == -1 ||
+			pread( wld->logspool_fd, &hdr, sizeof( Spoolhdr ), 0 )
+			!= sizeof( Spoolhdr ) ||
+			memcmp( hdr.magic, SPOOL_MAGIC, sizeof( hdr.magic ) ) ||
+			hdr.start < (long) sizeof( Spoolhdr ) ||
+			hdr.start > fileinfo.st_size )
+	{
+		world_logspool_close( wld );
+		return;
+	}
+
+	/* Count the records. If mooproxy died while appending, the last
+	 * record may be incomplete. It's dropped. */
+	wld->logspool_start = hdr.start;
+	wld->logspool_end = fileinfo.st_size;
+	for( offset = hdr.start; offset < wld->logspool_end;
+			offset += sizeof( Spoolrec ) + rec.len )
+	{
+		if( read_record( wld, offset, &rec ) )
+			break;
+		wld->logspool_count++;
+	}
+	wld->logspool_end = offset;
+
+	if( wld->logspool_count == 0 )
+	{
+		world_logspool_close( wld );
+		return;
+	}
+
+	if( ftruncate( wld->logspool_fd, wld->logspool_end ) == -1 )
+		spool_error( wld, "truncating", errno, 0 );
+
+	world_msg_client( wld, "The log spool %s holds %lu lines that were "
+			"not logged before mooproxy stopped. They will be "
+			"logged now.", wld->logspool_file,
+			wld->logspool_count );
+}
+
+
+
+extern void world_logspool_close( World *wld )
+{
+	if( wld->logspool_fd > -1 )
+		close( wld->logspool_fd );
+	if( wld->logspool_file != NULL && wld->logspool_count == 0 )
+		unlink( wld->logspool_file );
+	free( wld->logspool_file );
+
+	wld->logspool_fd = -1;
+	wld->logspool_file = NULL;
+	wld->logspool_start = 0;
+	wld->logspool_end = 0;
+	wld->logspool_count = 0;
+}
+
+
+
+/* Open the spool file. If create is true, the file is created (or
+ * truncated), and given an empty header. Otherwise, an existing file is
+ * opened, and its contents are left alone. Returns nonzero on failure. */
+static int open_spool_file( World *wld, int create )
+{
+	if( wld->logspool_file == NULL && wld->log_spool_dir[0] == '\0' )
+		xasprintf( &wld->logspool_file, "%s/%s/%s/%s", get_homedir(),
+				CONFIGDIR, SPOOLDIR, wld->name );
+	else if( wld->logspool_file == NULL )
+		xasprintf( &wld->logspool_file, "%s/%s", wld->log_spool_dir,
+				wld->name );
+
+	if( !create )
+	{
+		wld->logspool_fd = open( wld->logspool_file, O_RDWR );
+		if( wld->logspool_fd < 0 && errno != ENOENT )
+			spool_error( wld, "opening", errno, 0 );
+		return wld->logspool_fd < 0;
+	}
+
+	wld->logspool_fd = open( wld->logspool_file, O_RDWR | O_CREAT |
+			O_TRUNC, S_IRUSR | S_IWUSR );
+	if( wld->logspool_fd < 0 )
+	{
+		spool_error( wld, "opening", errno, 0 );
+		return 1;
+	}
+
+	wld->logspool_start = sizeof( Spoolhdr );
+	wld->logspool_end = sizeof( Spoolhdr );
+	if( write_header( wld ) )
+	{
+		spool_error( wld, "writing to", errno, 0 );
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/* Write the header of the spool file. Returns nonzero on failure. */
+static int write_header( World *wld )
+{
+	Spoolhdr hdr;
+	ssize_t wr;
+
+	memcpy( hdr.magic, SPOOL_MAGIC, sizeof( hdr.magic ) );
+	hdr.start = wld->logspool_start;
+
+	wr = pwrite( wld->logspool_fd, &hdr, sizeof( Spoolhdr ), 0 );
+	if( wr >= 0 && wr != sizeof( Spoolhdr ) )
+		errno = ENOSPC;
+
+	return wr != sizeof( Spoolhdr );
+}
+
+
+
+/* Read the header of the record at offset into rec, and check that the
+ * whole record lies within the spool. Returns nonzero on failure. */
+static int read_record( World *wld, long offset, Spoolrec *rec )
+{
+	ssize_t rd;
+
+	rd = pread( wld->logspool_fd, rec, sizeof( Spoolrec ), offset );
+	if( rd == sizeof( Spoolrec ) && rec->len >= 0 && offset +
+			(long) sizeof( Spoolrec ) + rec->len <=
+			wld->logspool_end )
+		return 0;
+
+	if( rd >= 0 )
+		errno = EIO;
+	return 1;
+}
+
+
+
+/* Something went wrong with the log spool. Tell the user, and stop
+ * spooling until log_spool_size is changed. If lost is true, the lines
+ * in the spool can't be read back, so they are counted as dropped. Lines
+ * that are still in the spool otherwise will be taken back as usual. */
+static void spool_error( World *wld, char *what, int err, int lost )
+{
+	world_msg_client( wld, "Error %s log spool %s: %s. Unlogged lines "
+			"that don't fit in logbuffer_size will be dropped.",
+			what, wld->logspool_file, strerror( err ) );
+
+	if( lost )
+	{
+		world_msg_client( wld, "%lu unlogged lines in the log spool "
+				"are lost.", wld->logspool_count );
+		wld->dropped_loggable_lines += wld->logspool_count;
+		wld->logspool_count = 0;
+
+		/* Some of them may have been waited for. Don't wait
+		 * forever. */
+		wld->log_syncs_done = wld->log_syncs_wanted;
+	}
+
+	if( wld->logspool_count == 0 )
+		world_logspool_close( wld );
+
+	wld->logspool_broken = 1;
+}
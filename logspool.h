@@ -0,0 +1,60 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+
+#ifndef MOOPROXY__HEADER__LOGSPOOL
+#define MOOPROXY__HEADER__LOGSPOOL
+
+
+
+#include "world.h"
+
+
+
+/* The log spool holds loggable lines that did not fit in logbuffer_size,
+ * because the logfile could not keep up. The records in the spool are in
+ * chronological order, and are all newer than the loggable lines in memory.
+ * While the spool holds lines, new loggable lines are appended to it too.
+ * Once there is room in memory again, the lines are taken back in order.
+ *
+ * The spool file survives restarts: lines left in it are logged the next
+ * time mooproxy starts. */
+
+
+
+/* Append line to the log spool. line is not consumed. Returns 0 if the
+ * line was spooled, nonzero if it was not (spooling is disabled, failed,
+ * or the spool is full), in which case the line should stay in memory. */
+extern int world_logspool_append( World *wld, Line *line );
+
+/* Take lines from the log spool, oldest first, and append them to
+ * log_queue, until the spool is empty or about max bytes were taken.
+ * At least one line is taken, if there is any. */
+extern void world_logspool_drain( World *wld, unsigned long max );
+
+/* Open a log spool left behind by a previous run, if any, so its lines
+ * will be logged. */
+extern void world_logspool_recover( World *wld );
+
+/* Close the log spool, and free all associated resources. If the spool
+ * is empty, the file is removed. */
+extern void world_logspool_close( World *wld );
+
+
+
+#endif  /* ifndef MOOPROXY__HEADER__LOGSPOOL */
@@ -0,0 +1,443 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "global.h"
+#include "logtail.h"
+#include "misc.h"
+#include "buffer.h"
+
+
+
+/* A subscriber to the log tail. */
+typedef struct Tailsub Tailsub;
+struct Tailsub
+{
+	int fd;
+	/* Rendered lines waiting to be sent. */
+	Buffer *buf;
+	/* The number of lines dropped since we last told the subscriber. */
+	unsigned long dropped;
+	/* If not NULL, only lines containing this (in lowercase) are sent. */
+	char *filter;
+	/* The line the subscriber is sending us. */
+	char input[LOGTAIL_MAXFILTER];
+	int inlen;
+};
+
+struct Logtail
+{
+	int listen_fd;
+	char *file;
+	Tailsub subs[LOGTAIL_MAXSUBS];
+	int count;
+	/* The line being sent, rendered like in the logfile. */
+	char *line;
+	long linesize;
+};
+
+
+
+static void accept_subscriber( World *wld );
+static void read_subscriber( Logtail *lt, Tailsub *sub );
+static void write_subscriber( Logtail *lt, Tailsub *sub );
+static void remove_subscriber( Logtail *lt, Tailsub *sub );
+static void append_data( World *wld, Tailsub *sub, char *data, long len );
+static int filter_match( char *str, char *filter );
+
+
+
+extern void world_logtail_update( World *wld )
+{
+	struct sockaddr_un addr;
+	Logtail *lt;
+	int fd;
+
+	if( !wld->log_tail )
+	{
+		world_logtail_close( wld );
+		return;
+	}
+
+	/* Already open. */
+	if( wld->logtail != NULL )
+		return;
+
+	lt = xmalloc( sizeof( Logtail ) );
+	lt->listen_fd = -1;
+	lt->count = 0;
+	lt->line = NULL;
+	lt->linesize = 0;
+	xasprintf( &lt->file, "%s/%s/%s/%s", get_homedir(), CONFIGDIR,
+			TAILDIR, wld->name );
+	wld->logtail = lt;
+
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	if( strlen( lt->file ) >= sizeof( addr.sun_path ) )
+	{
+		world_msg_client( wld, "Could not open log tail socket %s: "
+				"path too long.", lt->file );
+		world_logtail_close( wld );
+		return;
+	}
+	strcpy( addr.sun_path, lt->file );
+
+	/* A socket left behind by an earlier run (we have the lock of the
+	 * world, so nobody else is using it). */
+	unlink( lt->file );
+
+	fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( fd == -1 || bind( fd, (struct sockaddr *) &addr,
+			sizeof( addr ) ) == -1 ||
+			chmod( lt->file, S_IRUSR | S_IWUSR ) == -1 ||
+			listen( fd, LOGTAIL_MAXSUBS ) == -1 )
+	{
+		world_msg_client( wld, "Could not open log tail socket %s: "
+				"%s.", lt->file, strerror( errno ) );
+		if( fd > -1 )
+			close( fd );
+		world_logtail_close( wld );
+		return;
+	}
+
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+	lt->listen_fd = fd;
+}
+
+
+
+extern void world_logtail_close( World *wld )
+{
+	Logtail *lt = wld->logtail;
+
+	if( lt == NULL )
+		return;
+
+	while( lt->count > 0 )
+		remove_subscriber( lt, &lt->subs[0] );
+
+	if( lt->listen_fd > -1 )
+	{
+		close( lt->listen_fd );
+		unlink( lt->file );
+	}
+
+	free( lt->file );
+	free( lt->line );
+	free( lt );
+	wld->logtail = NULL;
+}
+
+
+
+extern void world_logtail_line( World *wld, Line *line )
+{
+	Logtail *lt = wld->logtail;
+	long len = 0, textstart = 0;
+	int i;
+
+	if( lt == NULL || lt->count == 0 )
+		return;
+
+	/* Render the line, like log_render() does. */
+	if( lt->linesize < line->len + LOG_TIMESTAMP_LENGTH + 2 )
+	{
+		lt->linesize = line->len + LOG_TIMESTAMP_LENGTH + 2;
+		lt->line = xrealloc( lt->line, lt->linesize );
+	}
+	if( wld->log_timestamps )
+	{
+		strcpy( lt->line, time_string( line->time,
+				LOG_TIMESTAMP_FORMAT ) );
+		textstart = LOG_TIMESTAMP_LENGTH;
+	}
+	len = textstart + strcpy_noansi( lt->line + textstart, line->str );
+	lt->line[len++] = '\n';
+	lt->line[len] = '\0';
+
+	for( i = 0; i < lt->count; i++ )
+		if( lt->subs[i].filter == NULL || filter_match(
+				lt->line + textstart, lt->subs[i].filter ) )
+			append_data( wld, &lt->subs[i], lt->line, len );
+}
+
+
+
+extern int world_logtail_fdset( World *wld, fd_set *rset, fd_set *wset,
+		int high )
+{
+	Logtail *lt = wld->logtail;
+	int i;
+
+	if( lt == NULL || lt->listen_fd == -1 )
+		return high;
+
+	FD_SET( lt->listen_fd, rset );
+	if( lt->listen_fd > high )
+		high = lt->listen_fd;
+
+	/* Subscribers are always watched for reading, for filters and for
+	 * disconnects. For writing only if there's something to send. */
+	for( i = 0; i < lt->count; i++ )
+	{
+		FD_SET( lt->subs[i].fd, rset );
+		if( lt->subs[i].buf->full > 0 )
+			FD_SET( lt->subs[i].fd, wset );
+		if( lt->subs[i].fd > high )
+			high = lt->subs[i].fd;
+	}
+
+	return high;
+}
+
+
+
+extern void world_logtail_handle_fds( World *wld, fd_set *rset,
+		fd_set *wset )
+{
+	Logtail *lt = wld->logtail;
+	int i;
+
+	if( lt == NULL || lt->listen_fd == -1 )
+		return;
+
+	/* Backwards, because subscribers may be removed. */
+	for( i = lt->count - 1; i >= 0; i-- )
+	{
+		if( FD_ISSET( lt->subs[i].fd, wset ) )
+			write_subscriber( lt, &lt->subs[i] );
+		else if( FD_ISSET( lt->subs[i].fd, rset ) )
+			read_subscriber( lt, &lt->subs[i] );
+	}
+
+	if( FD_ISSET( lt->listen_fd, rset ) )
+		accept_subscriber( wld );
+}
+
+
+
+extern void world_logtail_shrink( World *wld )
+{
+	Logtail *lt = wld->logtail;
+	int i;
+
+	if( lt == NULL )
+		return;
+
+	for( i = 0; i < lt->count; i++ )
+		buffer_shrink( lt->subs[i].buf, NET_BUFFER_IDLE );
+}
+
+
+
+extern unsigned long world_logtail_cost( World *wld, unsigned long *used )
+{
+	Logtail *lt = wld->logtail;
+	unsigned long cost;
+	int i;
+
+	*used = 0;
+	if( lt == NULL )
+		return 0;
+
+	cost = malloc_cost( sizeof( Logtail ) ) + malloc_cost( lt->linesize );
+	for( i = 0; i < lt->count; i++ )
+	{
+		*used += lt->subs[i].buf->full;
+		cost += buffer_cost( lt->subs[i].buf );
+		if( lt->subs[i].filter != NULL )
+			cost += malloc_cost( strlen( lt->subs[i].filter ) + 1 );
+	}
+
+	return cost;
+}
+
+
+
+/* Accept a new subscriber, if there's room for one. */
+static void accept_subscriber( World *wld )
+{
+	Logtail *lt = wld->logtail;
+	Tailsub *sub;
+	int fd;
+
+	fd = accept( lt->listen_fd, NULL, NULL );
+	if( fd == -1 )
+		return;
+
+	if( lt->count >= LOGTAIL_MAXSUBS )
+	{
+		close( fd );
+		return;
+	}
+
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+
+	sub = &lt->subs[lt->count++];
+	sub->fd = fd;
+	sub->buf = buffer_create();
+	sub->dropped = 0;
+	sub->filter = NULL;
+	sub->inlen = 0;
+}
+
+
+
+/* Read from the subscriber. Each complete line replaces the filter. */
+static void read_subscriber( Logtail *lt, Tailsub *sub )
+{
+	char *nl, *f;
+	int r, len;
+
+	r = read( sub->fd, sub->input + sub->inlen,
+			LOGTAIL_MAXFILTER - 1 - sub->inlen );
+	if( r == 0 || ( r == -1 && errno != EAGAIN && errno != EINTR ) )
+	{
+		remove_subscriber( lt, sub );
+		return;
+	}
+	if( r == -1 )
+		return;
+
+	sub->inlen += r;
+	sub->input[sub->inlen] = '\0';
+
+	/* A line that doesn't fit is cut short. */
+	if( sub->inlen == LOGTAIL_MAXFILTER - 1 &&
+			strchr( sub->input, '\n' ) == NULL )
+		sub->input[sub->inlen - 1] = '\n';
+
+	while( ( nl = strchr( sub->input, '\n' ) ) != NULL )
+	{
+		len = nl - sub->input + 1;
+		*nl = '\0';
+		if( nl > sub->input && nl[-1] == '\r' )
+			nl[-1] = '\0';
+
+		free( sub->filter );
+		sub->filter = NULL;
+		if( sub->input[0] != '\0' )
+		{
+			sub->filter = xstrdup( sub->input );
+			for( f = sub->filter; *f != '\0'; f++ )
+				*f = tolower( (unsigned char) *f );
+		}
+
+		sub->inlen -= len;
+		memmove( sub->input, sub->input + len, sub->inlen + 1 );
+	}
+}
+
+
+
+/* Send as much of the queue of the subscriber as the socket takes. */
+static void write_subscriber( Logtail *lt, Tailsub *sub )
+{
+	ssize_t w;
+
+	w = send( sub->fd, sub->buf->data, sub->buf->full, MSG_NOSIGNAL );
+	if( w == -1 )
+	{
+		if( errno != EAGAIN && errno != EINTR )
+			remove_subscriber( lt, sub );
+		return;
+	}
+
+	sub->buf->full -= w;
+	memmove( sub->buf->data, sub->buf->data + w, sub->buf->full );
+}
+
+
+
+/* Disconnect the subscriber, and free its resources. The last subscriber
+ * takes its place. */
+static void remove_subscriber( Logtail *lt, Tailsub *sub )
+{
+	close( sub->fd );
+	buffer_destroy( sub->buf );
+	free( sub->filter );
+
+	*sub = lt->subs[--lt->count];
+}
+
+
+
+/* Append len bytes of data to the queue of sub, or count it as dropped if
+ * it doesn't fit. */
+static void append_data( World *wld, Tailsub *sub, char *data, long len )
+{
+	long max = wld->log_tail_queue * 1024;
+	char note[64];
+	int nlen;
+
+	/* If lines were dropped, say so first, once there's room again. */
+	if( sub->dropped > 0 )
+	{
+		nlen = snprintf( note, sizeof( note ), "%% Log tail dropped "
+				"%lu lines.\n", sub->dropped );
+		if( buffer_reserve( sub->buf, nlen + len, max ) < nlen + len )
+		{
+			sub->dropped++;
+			return;
+		}
+		memcpy( sub->buf->data + sub->buf->full, note, nlen );
+		sub->buf->full += nlen;
+		sub->dropped = 0;
+	}
+
+	if( buffer_reserve( sub->buf, len, max ) < len )
+	{
+		sub->dropped++;
+		return;
+	}
+
+	memcpy( sub->buf->data + sub->buf->full, data, len );
+	sub->buf->full += len;
+}
+
+
+
+/* Return true if str contains filter, ignoring case. filter should be in
+ * lowercase. */
+static int filter_match( char *str, char *filter )
+{
+	char *s, *f;
+
+	for( ; *str != '\0'; str++ )
+	{
+		for( s = str, f = filter; *f != '\0' &&
+				tolower( (unsigned char) *s ) == *f; s++, f++ )
+			continue;
+		if( *f == '\0' )
+			return 1;
+	}
+
+	return *filter == '\0';
+}
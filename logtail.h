@@ -0,0 +1,75 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#ifndef MOOPROXY__HEADER__LOGTAIL
+#define MOOPROXY__HEADER__LOGTAIL
+
+
+
+#include <sys/select.h>
+
+#include "world.h"
+#include "line.h"
+
+
+
+/* The log tail. If log_tail is enabled, mooproxy listens on a unix domain
+ * socket, ~/.mooproxy/tail/<world>. Local programs that connect to it
+ * receive each loggable line as it is logged, rendered like in the
+ * logfile.
+ *
+ * A subscriber can send a line of text, after which it only receives the
+ * lines containing that text (case-insensitive). An empty line removes the
+ * filter again.
+ *
+ * Each subscriber has a queue of at most log_tail_queue KiB. If a
+ * subscriber can't keep up, the lines that don't fit are dropped, and the
+ * subscriber is told how many once there is room again. */
+
+
+
+/* Open or close the log tail socket, according to log_tail. */
+extern void world_logtail_update( World *wld );
+
+/* Close the log tail socket and all subscribers, and free all associated
+ * resources. */
+extern void world_logtail_close( World *wld );
+
+/* Send line to the subscribers. line is not consumed. */
+extern void world_logtail_line( World *wld, Line *line );
+
+/* Add the FDs of the log tail to rset and wset. Returns the highest FD,
+ * or high if that is higher. */
+extern int world_logtail_fdset( World *wld, fd_set *rset, fd_set *wset,
+		int high );
+
+/* Handle the FDs of the log tail that select() flagged. */
+extern void world_logtail_handle_fds( World *wld, fd_set *rset,
+		fd_set *wset );
+
+/* Shrink the queues of the subscribers that have been idle for at least
+ * NET_BUFFER_IDLE seconds. */
+extern void world_logtail_shrink( World *wld );
+
+/* Return the estimated number of bytes of memory the log tail occupies
+ * (see malloc_cost()), and put the number of queued bytes in used. */
+extern unsigned long world_logtail_cost( World *wld, unsigned long *used );
+
+
+
+#endif  /* ifndef MOOPROXY__HEADER__LOGTAIL */
@@ -35,10 +35,21 @@
 
 
 
+/* Parameters of the malloc_cost() estimate: per-chunk bookkeeping overhead,
+ * chunk alignment, and minimum chunk size (all in bytes). */
+#define MALLOC_CHUNK_OVERHEAD ( sizeof( size_t ) )
+#define MALLOC_CHUNK_ALIGN ( 2 * sizeof( size_t ) )
+#define MALLOC_CHUNK_MIN ( 4 * sizeof( size_t ) )
+
+
+
 static time_t current_second = 0;
 static long current_daynum = 0;
 static char *empty_homedir = "";
 
+static void queue_line( Linequeue *q, Linequeue *partial, Interntable *tab,
+		char *str, long len );
+
 /* Lookup table for the translation of codes like %W to ANSI sequences. */
 static const char *ansi_sequences[] = {
 	"", "\x1B[1;34m", "\x1B[1;36m", "", "", "", "\x1B[1;32m", "", "", "",
@@ -196,6 +207,22 @@ extern int xvasprintf( char **strp, const char *fmt, va_list argp )
 
 
 
+extern size_t malloc_cost( size_t size )
+{
+	size_t chunk;
+
+	/* Add the bookkeeping, and round up to the alignment. */
+	chunk = size + MALLOC_CHUNK_OVERHEAD + MALLOC_CHUNK_ALIGN - 1;
+	chunk -= chunk % MALLOC_CHUNK_ALIGN;
+
+	if( chunk < MALLOC_CHUNK_MIN )
+		chunk = MALLOC_CHUNK_MIN;
+
+	return chunk;
+}
+
+
+
 extern void set_current_time( time_t t )
 {
 	current_second = t;
@@ -442,14 +469,15 @@ extern char *time_fullstr( time_t t )
 
 
 
-extern int buffer_to_lines( char *buffer, int offset, int read, Linequeue *q )
+extern void buffer_to_lines( Buffer *buf, long read, long max,
+		Linequeue *partial, long limit, Interntable *tab, Linequeue *q )
 {
-	char *eob = buffer + offset + read, *new;
-	char *start = buffer, *end = buffer + offset;
-	size_t len;
+	char *buffer = buf->data, *eob = buffer + buf->full + read;
+	char *start = buffer, *end = buffer + buf->full;
+	long partlen, len;
+	Line *line;
 
 	/* eob:    end of buffer. Points _beyond_ the last char of the buffer
-	 * new:    Used temporarily to hold the copy of the current line
 	 * start:  start of the current line
 	 * end:    end of the current line */
 
@@ -463,9 +491,9 @@ extern int buffer_to_lines( char *buffer, int offset, int read, Linequeue *q )
 			end++;
 
 		/* We reached the end of buffer without hitting a newline,
-		 * and there is more room in the buffer. Abort, and let
-		 * more data accumulate in the buffer. */
-		if( end == eob && end < buffer + NET_BBUFFER_LEN )
+		 * and the buffer may still fill up (or grow) further. Abort,
+		 * and let more data accumulate in the buffer. */
+		if( end == eob && end < buffer + max )
 			break;
 
 		/* Reached end of buffer, and there's no space left in the
@@ -475,107 +503,170 @@ extern int buffer_to_lines( char *buffer, int offset, int read, Linequeue *q )
 		if( end == eob && start != buffer )
 			break;
 
-		/* If we got here, either we hit a \n, or the buffer is
-		 * filled entirely with one big line. Either way: process it */
-
-		/* Chop leading \r */
-		if( *start == '\r' )
-			start++;
-
 		len = end - start;
-		/* If the last character before \n is a \r (and it's not
-		 * before the start of string), chop it. */
-		if( end > start && *( end - 1 ) == '\r' )
-			len--;
+		for( partlen = 0, line = partial->head; line;
+				line = line->next )
+			partlen += line->len;
+
+		/* The limit was lowered since the partial line was set
+		 * aside, and it is too long now. Process it as a line of its
+		 * own. */
+		if( partlen > 0 && partlen >= limit )
+		{
+			queue_line( q, partial, tab, start, 0 );
+			partlen = 0;
+		}
 
-		/* Copy the line out of the buffer, NUL-terminate it,
-		 * create a line, and queue it. */
-		new = xmalloc( len + 1 );
-		memcpy( new, start, len );
-		new[len] = '\0';
-		linequeue_append( q, line_create( new, len ) );
+		/* The buffer is filled entirely with one big line. Set it
+		 * aside, and let the rest of the line accumulate in the
+		 * buffer. */
+		if( end == eob && partlen + len < limit )
+		{
+			line = line_create( xmalloc( len + 1 ), len );
+			memcpy( line->str, start, len );
+			line->str[len] = '\0';
+			linequeue_append( partial, line );
+			start = end;
+			break;
+		}
 
-		/* If the end-of-line is before end-of-buffer, advance end
-		 * so it points beyond the \n. */
-		if( end < eob )
-			end++;
+		/* The line has grown too long. Chop off what fits, and
+		 * process that as a line of its own. */
+		if( partlen + len > limit )
+			len = limit - partlen;
 
-		start = end;
+		/* If we got here, either we hit a \n, or the line is too
+		 * long. Either way: process it. */
+		queue_line( q, partial, tab, start, len );
+		start += len;
+
+		/* If we processed up to a \n before end-of-buffer, advance
+		 * start so it points beyond the \n. */
+		if( start == end && end < eob )
+			start++;
+		end = start;
 	}
 
 	/* If the start of the first line left in the buffer is not at the
 	 * start of the buffer, move it. */
 	if( start != buffer )
-		memmove( buffer, start, offset + read - ( start - buffer ) );
+		memmove( buffer, start, eob - start );
+
+	buf->full = eob - start;
+}
+
+
+
+extern void fill_buffer( Buffer *buf, long max, Linequeue *queue,
+		Linequeue *tohist, int network_nl, char *prestr, char *poststr )
+{
+	/* Add as many queued lines into the buffer as will fit. */
+	while( fill_buffer_line( buf, max, queue, tohist, network_nl, prestr,
+			poststr ) > 0 )
+		continue;
+}
+
+
+
+extern long fill_buffer_line( Buffer *buf, long max, Linequeue *queue,
+		Linequeue *tohist, int network_nl, char *prestr, char *poststr )
+{
+	char *buffer;
+	Line *line;
+	long len;
+
+	if( buf->line == NULL && queue->count == 0 )
+		return 0;
+
+	/* Continue with the line that is being written piece by piece, if
+	 * any. Otherwise, take the next line. */
+	line = buf->line ? buf->line : queue->head;
+	len = line->len - buf->lineoffset;
+
+	/* If it doesn't even fit in the empty buffer, try to grow the
+	 * buffer. */
+	if( buf->full == 0 && len > buf->size )
+		buffer_reserve( buf, len, max );
+
+	/* If the line doesn't fit, bail out. */
+	if( buf->full + len > buf->size && buf->full > 0 )
+		return 0;
+
+	/* First, write the prepend-string, if present. */
+	buffer = buf->data;
+	if( prestr && buf->line == NULL )
+	{
+		strcpy( buffer + buf->full, prestr );
+		buf->full += strlen( prestr );
+	}
+
+	/* Too large for the buffer, even though it's empty. Write the
+	 * buffer's worth of the line, and keep the line aside until the rest
+	 * has been written. */
+	if( len > buf->size )
+	{
+		if( buf->line == NULL )
+			buf->line = linequeue_pop( queue );
+		memcpy( buffer + buf->full, line->str + buf->lineoffset,
+				buf->size );
+		buf->full += buf->size;
+		buf->lineoffset += buf->size;
+		return buf->size;
+	}
+
+	/* Now, get (the rest of) the line itself, and write to the buffer. */
+	if( buf->line == NULL )
+		linequeue_pop( queue );
+	memcpy( buffer + buf->full, line->str + buf->lineoffset, len );
+	buf->full += len;
+	buf->line = NULL;
+	buf->lineoffset = 0;
+
+	/* Next up, the newline. */
+	if( network_nl )
+		buffer[buf->full++] = '\r';
+	buffer[buf->full++] = '\n';
+
+	/* And finally the append-string, if present. */
+	if( poststr )
+	{
+		strcpy( buffer + buf->full, poststr );
+		buf->full += strlen( poststr );
+	}
+
+	/* Move the line to a history queue, or destroy it. */
+	if( tohist == NULL || line->flags & LINE_NOHIST )
+		line_destroy( line );
+	else
+		linequeue_append( tohist, line );
 
-	return offset + read - ( start - buffer );
+	return len;
 }
 
 
 
-extern int flush_buffer( int fd, char *buffer, long *bffl, Linequeue *queue,
+extern int flush_buffer( int fd, Buffer *buf, long max, Linequeue *queue,
 		Linequeue *tohist, int network_nl, char *prestr, char *poststr,
 		int *errnum )
 {
-	long bfull = *bffl, len;
-	Line *line;
+	char *buffer;
 	int wr;
 
-	while( bfull > 0 || queue->count > 0 )
+	while( buf->full > 0 || buf->line != NULL || queue->count > 0 )
 	{
 		/* Add any queued lines into the buffer. */
-		while( queue->count > 0 )
-		{
-			/* Get the length of the next line. */
-			len = queue->head->len;
-			/* If it's too large, truncate (or it'll never fit) */
-			if( len > NET_BBUFFER_LEN )
-				len = NET_BBUFFER_LEN;
-
-			/* If the line doesn't fit, bail out. */
-			if( bfull + len > NET_BBUFFER_LEN )
-				break;
-
-			/* First, write the prepend-string, if present. */
-			if( prestr )
-			{
-				strcpy( buffer + bfull, prestr );
-				bfull += strlen( prestr );
-			}
-
-			/* Now, get the line itself, and write to the buffer. */
-			line = linequeue_pop( queue );
-			memcpy( buffer + bfull, line->str, len );
-			bfull += len;
-
-			/* Next up, the newline. */
-			if( network_nl )
-				buffer[bfull++] = '\r';
-			buffer[bfull++] = '\n';
-
-			/* And finally the append-string, if present. */
-			if( poststr )
-			{
-				strcpy( buffer + bfull, poststr );
-				bfull += strlen( poststr );
-			}
-
-			/* Move the line to a history queue, or destroy it. */
-			if( tohist == NULL || line->flags & LINE_NOHIST )
-				line_destroy( line );
-			else
-				linequeue_append( tohist, line );
-		}
+		fill_buffer( buf, max, queue, tohist, network_nl, prestr,
+				poststr );
 
 		/* Now we try to write as much of the buffer as possible */
-		wr = write( fd, buffer, bfull );
+		buffer = buf->data;
+		wr = write( fd, buffer, buf->full );
 
 		/* If there was an error, or if the socket can't take any
 		 * more data, abort. The higher layers will handle
 		 * errors or congestion. */
 		if( wr == -1 || wr == 0 )
 		{
-			*bffl = bfull;
 			if( errnum != NULL )
 				*errnum = errno;
 			if( wr == -1 && errno != EAGAIN )
@@ -586,13 +677,18 @@ extern int flush_buffer( int fd, char *buffer, long *bffl, Linequeue *queue,
 
 		/* If only part of the buffer was written, move the unwritten
 		 * part of the data to the start of the buffer. */
-		if( wr < bfull )
-			memmove( buffer, buffer + wr, bfull - wr );
+		if( wr < buf->full )
+			memmove( buffer, buffer + wr, buf->full - wr );
 
-		bfull -= wr;
+		buf->full -= wr;
+
+		/* The FD took all of a well-filled buffer, and there is more
+		 * to come. Grow, so we can write more at once. */
+		if( buf->full == 0 && wr > buf->size / 2 &&
+				( buf->line != NULL || queue->count > 0 ) )
+			buffer_reserve( buf, buf->size * 2, max );
 	}
 
-	*bffl = bfull;
 	return 0;
 }
 
@@ -748,6 +844,27 @@ extern long strcpy_nobell( char *dest, char *src )
 
 
 
+extern void bloom_add_trigrams( unsigned char *bloom, char *str, long len )
+{
+	unsigned char *s = (unsigned char *) str;
+	unsigned long tri = 0, h;
+	long i;
+
+	for( i = 0; i < len; i++ )
+	{
+		tri = ( ( tri << 8 ) | tolower( s[i] ) ) & 0xFFFFFF;
+		if( i < 2 )
+			continue;
+
+		/* Multiplicative hashing; the high bits are the good ones. */
+		h = ( tri * 2654435761UL ) & 0xFFFFFFFF;
+		h = ( h ^ ( h >> 16 ) ) % ( HISTORY_BLOOM_SIZE * 8 );
+		bloom[h / 8] |= 1 << ( h % 8 );
+	}
+}
+
+
+
 extern int strcmp_under( char *s, char *t )
 {
 	for(;;)
@@ -768,3 +885,67 @@ extern int strcmp_under( char *s, char *t )
 			return *s - *t;
 	}
 }
+
+
+
+/* Create a line from the len bytes at str, preceded by the parts of the
+ * line in partial (if any), and append it to q. Leading and trailing \r
+ * are chopped. partial is emptied. If tab is not NULL, the line is
+ * interned in it (see line_intern()). */
+static void queue_line( Linequeue *q, Linequeue *partial, Interntable *tab,
+		char *str, long len )
+{
+	char *new, *start;
+	long total = len;
+	Line *part;
+
+	/* The common case: the entire line is in the buffer. */
+	if( partial->head == NULL )
+	{
+		/* Chop leading \r */
+		if( *str == '\r' )
+		{
+			str++;
+			len--;
+		}
+
+		/* If the last character is a \r, chop it. */
+		if( len > 0 && str[len - 1] == '\r' )
+			len--;
+
+		/* Copy the line out of the buffer into a shared string (the
+		 * log shares it), create a line, and queue it. If we can,
+		 * share the string with an identical recent line. */
+		linequeue_append( q, line_intern( tab, str, len ) );
+		return;
+	}
+
+	for( part = partial->head; part; part = part->next )
+		total += part->len;
+
+	/* Copy the parts and the rest of the line out of the buffer, and
+	 * NUL-terminate it. */
+	new = xmalloc( total + 1 );
+	for( start = new; ( part = linequeue_pop( partial ) ); )
+	{
+		memcpy( start, part->str, part->len );
+		start += part->len;
+		line_destroy( part );
+	}
+	memcpy( start, str, len );
+	new[total] = '\0';
+
+	/* Chop leading \r */
+	start = new;
+	if( *start == '\r' )
+	{
+		memmove( start, start + 1, total );
+		total--;
+	}
+
+	/* If the last character is a \r, chop it. */
+	if( total > 0 && new[total - 1] == '\r' )
+		new[--total] = '\0';
+
+	linequeue_append( q, line_create( new, total ) );
+}
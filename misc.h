@@ -26,6 +26,7 @@
 #include <time.h>
 
 #include "line.h"
+#include "buffer.h"
 
 
 
@@ -47,6 +48,11 @@ extern char *xstrndup( const char *s, size_t n );
 extern int xasprintf( char **strp, const char *fmt, ... );
 extern int xvasprintf( char **strp, const char *fmt, va_list argp );
 
+/* Estimate the number of bytes of memory an allocation of size bytes
+ * actually occupies, including the allocator's bookkeeping and alignment
+ * overhead. The estimate is modelled after glibc's malloc. */
+extern size_t malloc_cost( size_t size );
+
 /* Set the current time which can later be queried by current_time().
  * The time is used e.g. to timestamp newly created lines. */
 extern void set_current_time( time_t t );
@@ -113,15 +119,34 @@ extern char *time_string( time_t t, const char *fmt );
  * Shares its buffer with time_string(). */
 extern char *time_fullstr( time_t t );
 
-/* Process buffer into lines. Start scanning at offset, scan only read bytes.
- * The salvaged lines are appended to q. Return the new offset. */
-extern int buffer_to_lines( char *buffer, int offset, int read, Linequeue *q );
+/* Process buffer into lines. The read bytes after buf->full are scanned,
+ * and the salvaged lines are appended to q. Incomplete lines are left in
+ * the buffer. If the buffer can't hold more than max bytes, its contents
+ * are moved to partial, and joined with the rest of the line once that
+ * arrives. Lines longer than limit bytes are split. If tab is not NULL,
+ * lines are interned in it (see line_intern()).
+ * buf->full is updated. */
+extern void buffer_to_lines( Buffer *buf, long read, long max,
+		Linequeue *partial, long limit, Interntable *tab, Linequeue *q );
+
+/* Move as many lines from queue into buf as will fit, without writing
+ * anything. The arguments are as for flush_buffer(), below. */
+extern void fill_buffer( Buffer *buf, long max, Linequeue *queue,
+		Linequeue *tohist, int network_nl, char *prestr, char *poststr );
+
+/* Move the next line from queue into buf (or the next piece of the line
+ * being written piece by piece, see buf->line), if it fits. Returns the
+ * number of bytes of the line that were moved, or 0 if nothing was. The
+ * arguments are as for flush_buffer(), below. */
+extern long fill_buffer_line( Buffer *buf, long max, Linequeue *queue,
+		Linequeue *tohist, int network_nl, char *prestr, char *poststr );
 
 /* Process the given buffer/queue, and write it to the given fd.
  * Arguments:
  *   fd:         FD to write to.
- *   buffer:     Buffer to use for writing to the FD.
- *   bffl:       Indicates how full the buffer is. Will be updated.
+ *   buf:        Buffer to use for writing to the FD.
+ *   max:        The size in bytes the buffer may grow to. Lines that
+ *               don't fit are written piece by piece (see buf->line).
  *   queue:      Queue of lines to be written.
  *   tohist:     Queue to append written lines to.
  *               If queue is NULL, written lines are discarded.
@@ -134,7 +159,7 @@ extern int buffer_to_lines( char *buffer, int offset, int read, Linequeue *q );
  *   0 on success (everything in buffer and queue was written without error)
  *   1 on congestion (the FD could take no more, not everything was written)
  *   2 on error (errnum is set) */
-extern int flush_buffer( int fd, char *buffer, long *bffl, Linequeue *queue,
+extern int flush_buffer( int fd, Buffer *buf, long max, Linequeue *queue,
 		Linequeue *tohist, int network_nl, char *prestr, char *poststr,
 		int *errnum );
 
@@ -162,6 +187,12 @@ extern long strcpy_noansi( char *dest, char *src );
  * Returns the length of the new string (excluding terminating \0). */
 extern long strcpy_nobell( char *dest, char *src );
 
+/* Set the bit in bloom (of HISTORY_BLOOM_SIZE bytes) for each trigram
+ * (three consecutive characters, ignoring case) in str, of len bytes. So
+ * if a string has bits that bloom doesn't, str can't contain that string.
+ * Strings shorter than 3 characters don't set any bits. */
+extern void bloom_add_trigrams( unsigned char *bloom, char *str, long len );
+
 /* Like strcmp(), but ignores underscores. Strings which can be transformed
  * to eachother solely by the insertion and/or deletion of underscores are
  * considered to be equal. */
@@ -29,6 +29,9 @@
 #include "network.h"
 #include "timer.h"
 #include "log.h"
+#include "logspool.h"
+#include "logtail.h"
+#include "recall.h"
 #include "mcp.h"
 #include "misc.h"
 #include "command.h"
@@ -177,9 +180,14 @@ int main( int argc, char **argv )
 	/* Initialization done, enter the main loop. */
 	mainloop( world );
 
-	/* Clean up a bit. */
+	/* Clean up a bit. Finishing the log syncs it, so any lines held
+	 * until then can go to the client, along with what it has to say
+	 * about lines it couldn't write. */
 	world_remove_lockfile( world );
-	world_sync_logdata( world );
+	world_log_stop( world );
+	linequeue_merge( world->client_txqueue, world->log_syncwait );
+	linequeue_merge( world->client_txqueue, world->client_toqueue );
+	world_flush_client_txbuf( world );
 	world_log_link_remove( world );
 	world_destroy( world );
 
@@ -210,11 +218,15 @@ static void mainloop( World *wld )
 {
 	time_t last_checked = time( NULL ), ltime;
 	Line *line;
+	int hold;
 
 	/* Initialize the time administration. */
 	world_timer_init( wld, last_checked );
 	set_current_time( last_checked );
 
+	/* Lines a previous run couldn't log go first. */
+	world_logspool_recover( wld );
+
 	/* Log the fact that we started. */
 	line = world_msg_client( wld, "Started mooproxy v" VERSIONSTR "." );
 	line->flags = LINE_LOGONLY;
@@ -268,15 +280,29 @@ static void mainloop( World *wld )
 		}
 	}
 
+	/* If the client has taken what a recall produced so far, or the
+	 * spilled new lines passed so far, produce some more. */
+	world_recall_feed( wld );
+	world_replay_feed( wld );
+
 	/* Process server toqueue to txqueue */
 	linequeue_merge( wld->server_txqueue, wld->server_toqueue );
 
 	/* Process client toqueue to txqueue */
 	while( ( line = linequeue_pop( wld->client_toqueue ) ) )
 	{
+		/* Bulk lines (replays and recalls) aren't logged, and take
+		 * turns with the other lines. */
+		if( line->flags & LINE_BULK )
+		{
+			linequeue_append( wld->client_bulkqueue, line );
+			continue;
+		}
+
 		/* Log if logging is enabled, and the line is loggable */
+		hold = 0;
 		if( wld->logging && !( line->flags & LINE_DONTLOG ) )
-			world_log_line( wld, line );
+			hold = world_log_line( wld, line );
 
 		/* If the same line makes it back here again, it should not
 		 * be logged again */
@@ -285,6 +311,10 @@ static void mainloop( World *wld )
 		/* Only process the line further if it's not LOGONLY. */
 		if( line->flags & LINE_LOGONLY )
 			line_destroy( line );
+		/* If the line must be synced to disk first, hold it (and
+		 * the lines after it) until it has been. */
+		else if( hold || wld->log_syncwait->count > 0 )
+			linequeue_append( wld->log_syncwait, line );
 		else
 			linequeue_append( wld->client_txqueue, line );
 	}
@@ -293,7 +323,8 @@ static void mainloop( World *wld )
 	 * buffer. */
 	if( wld->client_status != ST_CONNECTED )
 	{
-		while( ( line = linequeue_pop( wld->client_txqueue ) ) )
+		linequeue_merge( wld->client_bulkqueue, wld->client_txqueue );
+		while( ( line = linequeue_pop( wld->client_bulkqueue ) ) )
 			if( line->flags & LINE_DONTBUF )
 				line_destroy( line );
 			else
@@ -308,6 +339,9 @@ static void mainloop( World *wld )
 	/* Trim the dynamic buffers if they're too long */
 	world_trim_dynamic_queues( wld );
 
+	/* Index a few more history lines, for searching. */
+	world_history_index( wld );
+
 	handle_flags( wld );
 
 	if( wld->flags & WLD_SHUTDOWN )
@@ -379,6 +413,12 @@ static void handle_flags( World *wld )
 		world_log_link_update( wld );
 	}
 
+	if( wld->flags & WLD_LOGTAILUPDATE )
+	{
+		wld->flags &= ~WLD_LOGTAILUPDATE;
+		world_logtail_update( wld );
+	}
+
 	if( wld->flags & WLD_REBINDPORT )
 	{
 		wld->flags &= ~WLD_REBINDPORT;
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 #include <errno.h>
 #include <string.h>
 #include <netdb.h>
@@ -37,6 +38,8 @@
 #include "misc.h"
 #include "mcp.h"
 #include "log.h"
+#include "recall.h"
+#include "logtail.h"
 #include "timer.h"
 #include "resolve.h"
 #include "crypt.h"
@@ -66,6 +69,8 @@ static void handle_server_fd( World * );
 static void privileged_add( World *, char * );
 static void privileged_del( World *, char * );
 static int is_privileged( World *, char * );
+static void fill_client_txbuf( World * );
+static long client_unsent( World * );
 
 
 
@@ -106,6 +111,24 @@ extern void wait_for_network( World *wld )
 	high = create_fdset( wld, &rset, &wset );
 	tv.tv_sec = 1;
 	tv.tv_usec = 0;
+	/* Check back soon on bulk lines that are held back. If the client
+	 * doesn't read them, less and less soon. */
+	if( wld->client_bulk_held )
+	{
+		tv.tv_sec = 0;
+		tv.tv_usec = wld->client_bulk_poll;
+		wld->client_bulk_poll *= 2;
+		if( wld->client_bulk_poll > NET_BULK_POLL_MAX )
+			wld->client_bulk_poll = NET_BULK_POLL_MAX;
+	}
+	/* Don't keep a recall, the replay of spilled lines, or the index of
+	 * the history, waiting. */
+	if( world_recall_pending( wld ) || world_replay_pending( wld ) ||
+			world_history_index_pending( wld ) )
+	{
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+	}
 
 	r = select( high + 1, &rset, &wset, NULL, &tv );
 	if( r < 0 )
@@ -123,6 +146,13 @@ extern void wait_for_network( World *wld )
 			FD_ISSET( wld->server_resolver_fd, &rset ) )
 		world_handle_resolver_fd( wld );
 
+	if( wld->log_writer_fd != -1 &&
+			FD_ISSET( wld->log_writer_fd, &rset ) )
+		world_log_handle_writer_fd( wld );
+
+	if( wld->recall_fd != -1 && FD_ISSET( wld->recall_fd, &rset ) )
+		world_recall_handle_fd( wld );
+
 	if( wld->server_fd != -1 && FD_ISSET( wld->server_fd, &rset ) )
 		handle_server_fd( wld );
 
@@ -140,6 +170,8 @@ extern void wait_for_network( World *wld )
 	if( wld->server_connecting_fd != -1 )
 		if( FD_ISSET( wld->server_connecting_fd, &wset ) )
 			handle_connecting_fd( wld );
+
+	world_logtail_handle_fds( wld, &rset, &wset );
 }
 
 
@@ -160,6 +192,18 @@ static int create_fdset( World *wld, fd_set *rset, fd_set *wset )
 	if( wld->server_resolver_fd > high )
 		high = wld->server_resolver_fd;
 
+	/* Add log writer FD */
+	if( wld->log_writer_fd != -1 )
+		FD_SET( wld->log_writer_fd, rset );
+	if( wld->log_writer_fd > high )
+		high = wld->log_writer_fd;
+
+	/* Add background recall FD */
+	if( wld->recall_fd != -1 )
+		FD_SET( wld->recall_fd, rset );
+	if( wld->recall_fd > high )
+		high = wld->recall_fd;
+
 	/* Add server FD */
 	if( wld->server_fd != -1 )
 		FD_SET( wld->server_fd, rset );
@@ -199,7 +243,7 @@ static int create_fdset( World *wld, fd_set *rset, fd_set *wset )
 
 	/* If there is data to be written to the server, we want to
 	 * know if the FD is writable. */
-	if( wld->server_txqueue->count > 0 || wld->server_txfull > 0 )
+	if( wld->server_txqueue->count > 0 || wld->server_txbuffer->full > 0 )
 	{
 		if( wld->server_fd != -1 )
 			FD_SET( wld->server_fd, wset );
@@ -208,8 +252,11 @@ static int create_fdset( World *wld, fd_set *rset, fd_set *wset )
 	}
 
 	/* If there is data to be written to the client, we want to
-	 * know if the FD is writable. */
-	if( wld->client_txqueue->count > 0 || wld->client_txfull > 0 )
+	 * know if the FD is writable. Bulk lines that are held back don't
+	 * count; the FD may well be writable, but we won't write them. */
+	if( wld->client_txqueue->count > 0 || wld->client_txbuffer->full > 0 ||
+			( wld->client_bulkqueue->count > 0 &&
+			!wld->client_bulk_held ) )
 	{
 		if( wld->client_fd != -1 )
 			FD_SET( wld->client_fd, wset );
@@ -217,6 +264,11 @@ static int create_fdset( World *wld, fd_set *rset, fd_set *wset )
 			high = wld->client_fd;
 	}
 
+	/* -------- Both -------- */
+
+	/* Add the log tail FDs */
+	high = world_logtail_fdset( wld, rset, wset, high );
+
 	return high;
 }
 
@@ -557,8 +609,9 @@ extern void world_disconnect_server( World *wld )
 		close( wld->server_fd );
 
 	wld->server_fd = -1;
-	wld->server_txfull = 0;
-	wld->server_rxfull = 0;
+	buffer_clear( wld->server_txbuffer );
+	buffer_clear( wld->server_rxbuffer );
+	linequeue_clear( wld->server_rxpartial );
 
 	free( wld->server_address );
 	wld->server_address = NULL;
@@ -585,8 +638,11 @@ extern void world_disconnect_client( World *wld )
 	wld->client_last_connected = current_time();
 
 	wld->client_fd = -1;
-	wld->client_txfull = 0;
-	wld->client_rxfull = 0;
+	buffer_clear( wld->client_txbuffer );
+	world_recall_stop( wld );
+	world_replay_stop( wld );
+	buffer_clear( wld->client_rxbuffer );
+	linequeue_clear( wld->client_rxpartial );
 
 	wld->client_status = ST_DISCONNECTED;
 }
@@ -908,14 +964,17 @@ static void promote_auth_connection( World *wld, int wa )
 
 	/* In order to copy anything left in the authbuffer to the rxbuffer,
 	 * the rxbuffer must be large enough. */
-	#if (NET_BBUFFER_LEN < NET_MAXAUTHLEN)
-	  #error NET_BBUFFER_LEN is smaller than NET_MAXAUTHLEN
+	#if (NET_BUFFER_MINSIZE < NET_MAXAUTHLEN)
+	  #error NET_BUFFER_MINSIZE is smaller than NET_MAXAUTHLEN
 	#endif
 
 	/* Copy anything left in the authbuf to client buffer, and process */
-	memcpy( wld->client_rxbuffer, wld->auth_buf[wa], wld->auth_read[wa] );
-	wld->client_rxfull = buffer_to_lines( wld->client_rxbuffer, 0,
-			wld->auth_read[wa], wld->client_rxqueue );
+	memcpy( wld->client_rxbuffer->data, wld->auth_buf[wa],
+			wld->auth_read[wa] );
+	wld->client_rxbuffer->full = 0;
+	buffer_to_lines( wld->client_rxbuffer, wld->auth_read[wa],
+			wld->netbuffer_size * 1024, wld->client_rxpartial,
+			wld->line_limit * 1024, NULL, wld->client_rxqueue );
 
 	/* Clean up stuff left of the auth connection */
 	remove_auth_connection( wld, wa, 0 );
@@ -968,12 +1027,17 @@ static void promote_auth_connection( World *wld, int wa )
  * append to RX queue. If the connection died, close FD. */
 static void handle_client_fd( World *wld )
 {
-	int n, offset = wld->client_rxfull;
-	char *buffer = wld->client_rxbuffer;
+	Buffer *buf = wld->client_rxbuffer;
+	long max = wld->netbuffer_size * 1024;
 	Line *line;
+	int n;
 
-	/* Read into the buffer */
-	n = read( wld->client_fd, buffer + offset, NET_BBUFFER_LEN - offset );
+	/* Read into the buffer. Any data left in the buffer is an incomplete
+	 * line. Make at least as much room as it already takes, so long lines
+	 * make the buffer grow geometrically. */
+	buffer_reserve( buf, buf->full, max );
+	n = read( wld->client_fd, buf->data + buf->full,
+			buf->size - buf->full );
 
 	/* Failure with EINTR or EAGAIN is acceptable. Just let it go. */
 	if( n == -1 && ( errno == EINTR || errno == EAGAIN ) )
@@ -996,8 +1060,8 @@ static void handle_client_fd( World *wld )
 	}
 
 	/* Parse to lines, and place in queue */
-	wld->client_rxfull =
-		buffer_to_lines( buffer, offset, n, wld->client_rxqueue );
+	buffer_to_lines( buf, n, max, wld->client_rxpartial,
+			wld->line_limit * 1024, NULL, wld->client_rxqueue );
 }
 
 
@@ -1006,12 +1070,17 @@ static void handle_client_fd( World *wld )
  * append to RX queue. If the connection died, close FD. */
 static void handle_server_fd( World *wld )
 {
-	int n, offset = wld->server_rxfull;
-	char *buffer = wld->server_rxbuffer;
+	Buffer *buf = wld->server_rxbuffer;
+	long max = wld->netbuffer_size * 1024;
 	Line *line;
+	int n;
 
-	/* Read into buffer */
-	n = read( wld->server_fd, buffer + offset, NET_BBUFFER_LEN - offset );
+	/* Read into the buffer. Any data left in the buffer is an incomplete
+	 * line. Make at least as much room as it already takes, so long lines
+	 * make the buffer grow geometrically. */
+	buffer_reserve( buf, buf->full, max );
+	n = read( wld->server_fd, buf->data + buf->full,
+			buf->size - buf->full );
 
 	/* Failure with EINTR or EAGAIN is acceptable. Just let it go. */
 	if( n == -1 && ( errno == EINTR || errno == EAGAIN ) )
@@ -1035,22 +1104,57 @@ static void handle_server_fd( World *wld )
 	}
 
 	/* Parse to lines, and place in queue */
-	wld->server_rxfull =
-		buffer_to_lines( buffer, offset, n, wld->server_rxqueue );
+	buffer_to_lines( buf, n, max, wld->server_rxpartial,
+			wld->line_limit * 1024,
+			wld->intern_lines ? wld->intern_table : NULL,
+			wld->server_rxqueue );
 }
 
 
 
 extern void world_flush_client_txbuf( World *wld )
 {
+	static Linequeue empty = { NULL, NULL, 0, 0 };
+	Buffer *buf = wld->client_txbuffer;
+	long max = wld->netbuffer_size * 1024, filled;
+
+	wld->client_bulk_held = 0;
+
 	/* If we're not connected, do nothing */
 	if( wld->client_fd == -1 )
 		return;
 
-	flush_buffer( wld->client_fd, wld->client_txbuffer,
-			&wld->client_txfull, wld->client_txqueue, 
-			wld->inactive_lines, 1, wld->ace_prestr,
-			wld->ace_poststr, NULL );
+	/* Without bulk lines, there's nothing to take turns with. */
+	if( wld->client_bulkqueue->count == 0 )
+	{
+		wld->client_bulk_deficit = 0;
+		flush_buffer( wld->client_fd, buf, max, wld->client_txqueue,
+				wld->inactive_lines, 1, wld->ace_prestr,
+				wld->ace_poststr, NULL );
+		return;
+	}
+
+	/* Fill the buffer with the lines whose turn it is, and write it. If
+	 * the FD took all of it, and there is more to come, go again. */
+	do
+	{
+		fill_client_txbuf( wld );
+		/* Only bulk lines left, and they're held back. */
+		if( buf->full == 0 )
+			return;
+		filled = buf->full;
+		if( flush_buffer( wld->client_fd, buf, max, &empty,
+				wld->inactive_lines, 1, wld->ace_prestr,
+				wld->ace_poststr, NULL ) != 0 )
+			return;
+
+		/* The FD took all of a well-filled buffer. Grow, so we can
+		 * write more at once. */
+		if( filled > buf->size / 2 )
+			buffer_reserve( buf, buf->size * 2, max );
+	}
+	while( wld->client_txqueue->count > 0 ||
+			wld->client_bulkqueue->count > 0 );
 }
 
 
@@ -1058,7 +1162,7 @@ extern void world_flush_client_txbuf( World *wld )
 extern void world_flush_server_txbuf( World *wld )
 {
 	/* If there is nothing to send, do nothing */
-	if( wld->server_txqueue->count == 0 && wld->server_txfull == 0 )
+	if( wld->server_txqueue->count == 0 && wld->server_txbuffer->full == 0 )
 		return;
 
 	/* If we're not connected, discard and notify client */
@@ -1070,7 +1174,7 @@ extern void world_flush_server_txbuf( World *wld )
 	}
 
 	flush_buffer( wld->server_fd, wld->server_txbuffer,
-			&wld->server_txfull, wld->server_txqueue, NULL,
+			wld->netbuffer_size * 1024, wld->server_txqueue, NULL,
 			1, NULL, NULL, NULL );
 }
 
@@ -1132,3 +1236,90 @@ static int is_privileged( World *wld, char *addr )
 
 	return 0;
 }
+
+
+
+/* Fill the client transmit buffer from client_txqueue (the live lines) and
+ * client_bulkqueue (the bulk lines), by deficit round robin. Each round, a
+ * queue with lines waiting gets its quantum added to its deficit, and
+ * sends lines for as long as they fit in its deficit. An empty queue loses
+ * its deficit. Stops when the buffer is full, or there's nothing to send.
+ * Bulk lines also wait while the buffer and the socket together hold
+ * NET_BULK_BUFFERED bytes. */
+static void fill_client_txbuf( World *wld )
+{
+	Buffer *buf = wld->client_txbuffer;
+	Linequeue *queue[2] = { wld->client_txqueue, wld->client_bulkqueue };
+	long *deficit[2] = { &wld->client_live_deficit,
+			&wld->client_bulk_deficit };
+	long quantum[2] = { NET_LIVE_QUANTUM, NET_BULK_QUANTUM };
+	long max = wld->netbuffer_size * 1024, len;
+	long limit = NET_BULK_BUFFERED - client_unsent( wld );
+	int i, ready[2];
+
+	/* Finish the line that's being written piece by piece first. */
+	if( buf->line != NULL && fill_buffer_line( buf, max, queue[0],
+			wld->inactive_lines, 1, wld->ace_prestr,
+			wld->ace_poststr ) == 0 )
+		return;
+
+	for(;;)
+	{
+		ready[0] = queue[0]->count > 0;
+		ready[1] = queue[1]->count > 0 && buf->full < limit;
+		wld->client_bulk_held = queue[1]->count > 0 && buf->full == 0 &&
+				!ready[1];
+		if( !ready[0] && !ready[1] )
+			return;
+
+		for( i = 0; i < 2; i++ )
+		{
+			if( queue[i]->count == 0 )
+				*deficit[i] = 0;
+			if( !ready[i] )
+				continue;
+
+			*deficit[i] += quantum[i];
+			while( queue[i]->count > 0 &&
+					queue[i]->head->len <= *deficit[i] )
+			{
+				if( i == 1 && buf->full >= limit )
+					break;
+
+				len = fill_buffer_line( buf, max, queue[i],
+						wld->inactive_lines, 1,
+						wld->ace_prestr,
+						wld->ace_poststr );
+				/* The buffer is full (or the line is
+				 * being written piece by piece). */
+				if( len == 0 || buf->line != NULL )
+					return;
+				*deficit[i] -= len;
+
+				/* The client is reading again. */
+				if( i == 1 )
+					wld->client_bulk_poll = NET_BULK_POLL;
+			}
+		}
+	}
+}
+
+
+
+/* Return the number of bytes written to the client FD that the client has
+ * not received yet, as far as the system tells. If it can't tell, return
+ * 0, and the socket buffer holds as much as it likes. */
+static long client_unsent( World *wld )
+{
+	int unsent = 0;
+
+#if defined( TIOCOUTQ )
+	if( ioctl( wld->client_fd, TIOCOUTQ, &unsent ) == -1 )
+		return 0;
+#elif defined( FIONWRITE )
+	if( ioctl( wld->client_fd, FIONWRITE, &unsent ) == -1 )
+		return 0;
+#endif
+
+	return unsent;
+}
@@ -0,0 +1,186 @@
+#! /bin/bash
+
+# Times /recall searches through the logfiles.
+#
+# Usage: ./recall-bench.sh [<mooproxy binary> [<query> ...]]
+#
+# Generates a corpus of logfiles in a temporary home directory: the 5 days
+# before today, about 10 MB of says/whispers/channel traffic each, plain
+# and without word index. Then starts the given mooproxy (./mooproxy by
+# default) on it, with a stand-in server that sends a single line (/recall
+# wants some history), and for each query (by default the ones below)
+# times "/recall from today -5 days to today <query>" until the recall
+# footer reaches the client. Prints the best of 5 runs, and the footer.
+# Needs perl for the server.
+#
+# The corpus comes from awk's random number generator with a fixed seed,
+# so it's the same on every run with the same awk. To compare two builds,
+# run the script with each of them.
+
+set -e
+
+BINARY="${1:-./mooproxy}"
+shift || true
+PORT="${PORT:-17950}"
+RUNS=5
+
+if [ $# -eq 0 ]
+then
+	set -- 'search rivendell' 'search gandalf says' \
+		'search Galadriel whispers, "The' 'case search Galadriel' \
+		'search xyzzy' 'search (rivendell|mordor)' \
+		'search ^\[OOC\] Sam:'
+fi
+
+BENCHHOME="$(mktemp -d)"
+trap 'kill ${PID} ${SERVER} 2> /dev/null || true; rm -rf "${BENCHHOME}"' EXIT
+
+mkdir -p "${BENCHHOME}/.mooproxy/worlds"
+chmod -R go-rwx "${BENCHHOME}/.mooproxy"
+# The hash of "connect bench bench".
+cat > "${BENCHHOME}/.mooproxy/worlds/bench" << EOF
+listenport = ${PORT}
+host = "127.0.0.1"
+port = $(( PORT + 1 ))
+auth_hash = "\$1\$benchmrk\$9sHOzlF3uZEgOb5EXe..50"
+logging = false
+EOF
+
+echo -n "Generating logfiles... "
+for DAY in 5 4 3 2 1
+do
+	DATE="$(date -d "-${DAY} days" +%Y-%m-%d)"
+	DIR="${BENCHHOME}/.mooproxy/logs/bench/${DATE%-*}"
+	mkdir -p "${DIR}"
+	awk -v seed="${DAY}" '
+	BEGIN {
+		srand( seed );
+		n = split( "Gandalf Frodo Sam Pippin Merry Aragorn Legolas " \
+			"Gimli Boromir Elrond Galadriel Bilbo", names );
+		v = split( "says asks exclaims whispers nods smiles waves " \
+			"laughs", verbs );
+		c = split( "Public OOC Newbie", channels );
+		w = split( "the a an of to in and is it you that was for on " \
+			"are with as his they be at one have this from or " \
+			"had by hot word but what some we can out other " \
+			"were all there when up use your how said each she " \
+			"which do their time if will way about many then " \
+			"them write would like so these her long make thing " \
+			"see him two has look more day could go come did " \
+			"number sound no most people my over know water " \
+			"than call first who may down side been now find " \
+			"any new work part take get place made live where " \
+			"after back little only round man year came show " \
+			"every good me give our under name very through just " \
+			"form sentence great think say help low line differ " \
+			"turn cause much mean before move right boy old too " \
+			"same tell does set three want air well also play " \
+			"small end put home read hand port large spell add " \
+			"even land here must big high such follow act why " \
+			"ask men change went light kind off need house " \
+			"picture try us again animal point mother world near " \
+			"build self earth father head stand own page should " \
+			"country found answer school grow study still learn " \
+			"plant cover food sun four between state keep eye " \
+			"never last let thought city tree cross farm hard " \
+			"start might story saw far sea draw left late run " \
+			"while press close night real life few north open " \
+			"seem together next white children begin got walk " \
+			"example ease paper group always music those both " \
+			"mark often letter until mile river car feet care " \
+			"second book carry took science eat room friend " \
+			"began idea fish mountain stop once base hear horse " \
+			"cut sure watch color face wood main", words );
+
+		while( size < 10 * 1024 * 1024 )
+		{
+			t += rand() * 0.8;
+			s = int( t );
+			if( s > 86399 )
+				s = 86399;
+			r = rand();
+			if( r < 0.6 )
+				txt = pick( names, n ) " " pick( verbs, v ) \
+					", \"" toupper( substr( pick( words,
+					w ), 1, 1 ) ) sentence( 2, 17 ) ".\"";
+			else if( r < 0.8 )
+				txt = pick( names, n ) sentence( 2, 10 );
+			else
+				txt = "[" pick( channels, c ) "] " \
+					pick( names, n ) ":" sentence( 3, 14 );
+			if( rand() < 0.0005 )
+				txt = txt " rivendell";
+			line = sprintf( "[%02d:%02d:%02d] %s", s / 3600,
+					s / 60 % 60, s % 60, txt );
+			print line;
+			size += length( line ) + 1;
+		}
+	}
+
+	function pick( list, count )
+	{
+		return list[int( rand() * count ) + 1];
+	}
+
+	function sentence( min, max,    i, len, str )
+	{
+		len = min + int( rand() * ( max - min + 1 ) );
+		for( i = 0; i < len; i++ )
+			str = str " " pick( words, w );
+		return str;
+	}' > "${DIR}/bench - ${DATE}.log"
+done
+du -sh "${BENCHHOME}/.mooproxy/logs" | cut -f 1
+
+# Waits until file $1 contains $2.
+wait_for()
+{
+	for TRY in $(seq 50)
+	do
+		grep -q "$2" "$1" && return
+		sleep 0.1
+	done
+	echo "Timed out waiting for $2." >&2
+	return 1
+}
+
+perl -MIO::Socket::INET -e '
+	$s = IO::Socket::INET->new( LocalAddr => "127.0.0.1:" . $ARGV[0],
+			Listen => 1, ReuseAddr => 1 ) or die "$!\n";
+	print "Listening.\n";
+	close( STDOUT );
+	$c = $s->accept();
+	print $c "Welcome to the bench MOO.\r\n";
+	1 while( <$c> );' $(( PORT + 1 )) > "${BENCHHOME}/server" &
+SERVER=$!
+wait_for "${BENCHHOME}/server" 'Listening'
+
+HOME="${BENCHHOME}" "${BINARY}" -w bench -d > "${BENCHHOME}/output" 2>&1 &
+PID=$!
+wait_for "${BENCHHOME}/output" 'successfully started'
+exec 3<> "/dev/tcp/127.0.0.1/${PORT}"
+printf 'connect bench bench\r\n/connect\r\n' >&3
+grep -a -m 1 'Welcome to the bench MOO' <&3 > /dev/null
+
+for QUERY in "$@"
+do
+	BEST=""
+	for RUN in $(seq ${RUNS})
+	do
+		START=$(date +%s%N)
+		printf '/recall from today -5 days to today %s\r\n' "${QUERY}" >&3
+		FOOTER="$(grep -a -m 1 'Recall end' <&3 | tr -d '\r' |
+				sed 's/\x1b\[[0-9;]*m//g')"
+		TIME=$(( $(date +%s%N) - START ))
+		if [ -z "${BEST}" ] || [ ${TIME} -lt ${BEST} ]
+		then
+			BEST=${TIME}
+		fi
+	done
+	printf '%-36s %6.3f s  %s\n' "${QUERY}" \
+		"$(awk -v t=${BEST} 'BEGIN { print t / 1e9 }')" \
+		"${FOOTER##*Recall end }"
+done
+
+printf '/shutdown -f\r\n' >&3
+wait ${PID} || true
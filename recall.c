@@ -48,10 +48,51 @@ MODIFIER  -> 'lines'
 #include <time.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <regex.h>
 
 #include "recall.h"
 #include "world.h"
 #include "misc.h"
+#include "spill.h"
+#include "logread.h"
+#include "logindex.h"
+
+
+
+/* Search strings without any of these are plain text. */
+#define RECALL_REGEX_SPECIAL "\\^$.[]|()*+?{}"
+/* The maximum number of terms after the any/all keywords. */
+#define RECALL_MAXTERMS 32
+/* The maximum number of threads searching the logfiles. */
+#define RECALL_MAXTHREADS 4
+/* At most this many days of logfiles are queued for (or being searched
+ * by) the threads, or waiting to be sent to the client. */
+#define RECALL_WINDOW 16
+/* A recall produces at most this many lines at a time, and inspects at
+ * most RECALL_SCAN lines at a time when most of them don't match. */
+#define RECALL_BATCH 256
+#define RECALL_SCAN 16384
+
+
+
+/* The terms of the any/all keywords, as an Aho-Corasick automaton. State 0
+ * is the start state. For each state, next gives the state to go to for
+ * each (case folded) character, and out has a bit set for each term that
+ * ends there. So one pass over a line finds all terms in it. */
+typedef struct Termset Termset;
+struct Termset
+{
+	long    nstates;
+	int   (*next)[256];
+	unsigned long *out;
+};
 
 
 
@@ -81,12 +122,149 @@ struct Params
 	time_t  to;
 	long    lines;
 	char   *search_str;
+	int     search_case;
+	/* The search string, compiled. Only valid if search_str is set.
+	 * If the search string has no special characters, it's searched for
+	 * as a literal string instead, with a Boyer-Moore-Horspool table. */
+	regex_t search_re;
+	int     search_literal;
+	long    search_len;
+	long    search_skip[256];
+	unsigned char search_fold[256];
+	Logword find[LOGINDEX_MAXWORDS];
+	int     nfind;
+	/* The terms of the any/all keywords, and whether all of them must be
+	 * present. The automaton is built from them once the case keyword is
+	 * known. */
+	char   *terms[RECALL_MAXTERMS];
+	int     nterms;
+	int     terms_all;
+	Termset *termset;
+	/* What the bloom filter of a block of history lines must have for
+	 * the block to hold a match: all bits of bloom_all, and all bits of
+	 * one of bloom_any (if there are any). bloom_use is false if the
+	 * bloom filters can't tell. */
+	int     bloom_use;
+	unsigned char bloom_all[HISTORY_BLOOM_SIZE];
+	unsigned char (*bloom_any)[HISTORY_BLOOM_SIZE];
+	int     nbloom_any;
+
+	/* Holds the line being matched, stripped of ANSI stuff. Reused for
+	 * all lines, so only the lines that are recalled are allocated. */
+	char   *strip;
+	long    stripsize;
 
 	/* Statistics about the recalled lines. */
 	long    lines_inperiod;
 	long    lines_matched;
 };
 
+/* A position in the history. The history consists of the history region of
+ * the spill file, followed by the history lines in memory. Before that come
+ * the logfiles on disk, for the lines older than the history. */
+typedef struct Cursor Cursor;
+struct Cursor
+{
+	/* Offset of the spilled line, or -1 if the line is in memory. */
+	long    offset;
+	/* The line in memory. NULL when we ran off the history. */
+	Line   *line;
+	/* Holds the spilled line, or the line from the logfile. */
+	Line    spilled;
+	/* The logfile of the day the line is in, and the offset of the line
+	 * in it. NULL if the line is not from the logfiles. */
+	Logday *log;
+	long    logoff;
+	/* Only lines older than this (the oldest line in history) are taken
+	 * from the logfiles. */
+	time_t  histstart;
+	/* The index of the first mark of the time index of the spill file or
+	 * of the history in memory at or after the line, or -1 if we don't
+	 * know. */
+	long    mark;
+	/* The words we're looking for, and the offsets of the lines in the
+	 * logfile that have them, according to the word index. cands is
+	 * NULL if we don't know, and we have to look at every line. */
+	Logword *find;
+	int     nfind;
+	long   *cands;
+	long    ncands;
+	long    cand;
+};
+
+/* One day of logfiles to search, and what was found. */
+typedef struct Recallchunk Recallchunk;
+struct Recallchunk
+{
+	Logday *ld;
+	Linequeue *lines;
+	long    inperiod;
+	long    matched;
+	/* Set (atomically) by the thread, when it's done, or when it found
+	 * RECALL_BATCH lines. In the latter case, it waits on resume until
+	 * the main thread sent them. */
+	int     done;
+	int     full;
+	sem_t   resume;
+};
+
+/* A recall in progress. The lines are produced a batch at a time, and only
+ * once the client has taken the previous ones, so a big recall neither
+ * piles up in memory, nor holds up the lines from the server. After
+ * recall_page lines, the recall pauses until /recall more.
+ *
+ * A period that reaches into the logfiles is searched there by a pool of
+ * threads first, a day at a time. The main thread queues the days in
+ * chunks, and the threads take them in order. The lines found are sent to
+ * the client in order, after which the history is searched, like for any
+ * other recall.
+ *
+ * The threads only touch the params (read only), the chunks they took, and
+ * the atomic fields. They wake the main thread by writing a byte to a
+ * pipe, the read end of which is recall_fd. */
+struct Recalljob
+{
+	Params *params;
+	/* The lines sent so far, the lines left in this page, and whether
+	 * we're waiting for /recall more. */
+	long    sent;
+	long    page_left;
+	int     paused;
+
+	/* The oldest line in the history, when the recall started. */
+	time_t  histstart;
+	/* Whether the threads are searching the logfiles. */
+	int     threaded;
+	/* Where to look for the next logfile, and whether there are none. */
+	time_t  next;
+	int     queued_all;
+
+	/* Chunk n is in chunks[n % RECALL_WINDOW]. Chunks before nchunks
+	 * have been queued, those before taken have been taken by a thread,
+	 * and those before delivered have been sent to the client. */
+	Recallchunk chunks[RECALL_WINDOW];
+	long    nchunks;
+	long    taken;
+	long    delivered;
+	int     cancel;
+
+	pthread_t threads[RECALL_MAXTHREADS];
+	int     nthreads;
+	sem_t   work;
+	int     notify[2];
+
+	/* The next line to inspect is the one after the first skip lines with
+	 * a time of at least at. remaining is the number of lines left to
+	 * inspect, or -1 if only the period limits them. The cursor is only
+	 * kept between batches while it's in the logfiles; the history may
+	 * change in the meantime. */
+	time_t  at;
+	long    skip;
+	long    remaining;
+	Cursor  cur;
+	int     cur_kept;
+};
+
 
 
 static int parse_arguments( World *wld, Params *params );
@@ -96,6 +274,11 @@ static void parse_nextword( Params *params );
 static int parse_keyword_from( World *wld, Params *params );
 static int parse_keyword_to( World *wld, Params *params );
 static int parse_keyword_search( World *wld, Params *params );
+static int parse_keyword_case( World *wld, Params *params );
+static int parse_keyword_find( World *wld, Params *params );
+static int parse_keyword_any( World *wld, Params *params );
+static int parse_keyword_all( World *wld, Params *params );
+static int parse_terms( World *wld, Params *params, int all );
 
 static int parse_when( World *wld, Params *params, int lma );
 static int parse_when_relative( World *wld, Params *params, int lma );
@@ -104,9 +287,54 @@ static int parse_when_absdate( World *wld, Params *params );
 static int parse_when_abstime( World *wld, Params *params );
 static int parse_when_rchk( Params *params, int v, int l, int u, char *name );
 
-static void recall_search_and_recall( World *wld, Params *params );
-static void recall_match_one_line( World *wld, Params *params, Line *line );
-static int recall_match( char *line, char *re );
+static void recall_footer( World *wld, Params *params );
+static void params_free( Params *params );
+static int recall_compile( World *wld, Params *params );
+static int recall_regcomp( Params *params );
+static void recall_compile_literal( Params *params );
+static int recall_match_literal( Params *params, char *str, long len );
+static void recall_compile_terms( Params *params );
+static int recall_match_terms( Params *params, char *str );
+static void recall_compile_bloom( Params *params );
+static int recall_match_bloom( Params *params, unsigned char *bloom );
+static void recall_match_one_line( Params *params, Line *line,
+		Linequeue *queue );
+static int has_control( char *str );
+
+static void cursor_init( World *wld, Cursor *cur );
+static void cursor_done( Cursor *cur );
+static Line *cursor_first( World *wld, Cursor *cur );
+static Line *cursor_last( World *wld, Cursor *cur );
+static Line *cursor_seek( World *wld, Cursor *cur, time_t t );
+static Line *cursor_next( World *wld, Cursor *cur );
+static Line *cursor_prev( World *wld, Cursor *cur );
+static Line *cursor_line( World *wld, Cursor *cur );
+static Histmark *cursor_block( World *wld, Cursor *cur );
+static Spillmark *cursor_spill_block( World *wld, Cursor *cur );
+static Line *cursor_skip_block( World *wld, Cursor *cur );
+static Line *cursor_log_seek( World *wld, Cursor *cur, time_t t );
+static Line *cursor_log_last( World *wld, Cursor *cur );
+static Line *cursor_log_next( World *wld, Cursor *cur );
+static Line *cursor_log_prev( World *wld, Cursor *cur );
+static Logday *cursor_log_open( World *wld, Cursor *cur, time_t t, int dir );
+static long cursor_log_step( Cursor *cur, Logday *ld, long offset );
+
+static void job_start( World *wld, Params *params );
+static void job_start_before( World *wld );
+static void job_start_threads( World *wld );
+static void job_queue_chunks( World *wld );
+static int job_can_feed( World *wld );
+static long job_feed_chunks( World *wld, long budget );
+static int job_feed_history( World *wld, long budget );
+static Line *job_seek( World *wld );
+static Line *job_pass_block( World *wld );
+static void job_drop_chunks( Recalljob *job );
+static void job_free( World *wld );
+static void *job_main( void *arg );
+static void job_search_day( Recalljob *job, Params *params,
+		Recallchunk *chunk );
+static int job_wait_sent( Recalljob *job, Recallchunk *chunk );
+static void job_notify( Recalljob *job );
 
 
 static const char *weekday[] =
@@ -129,6 +357,10 @@ static const struct
 	{ "from", 	parse_keyword_from },
 	{ "to",		parse_keyword_to },
 	{ "search",	parse_keyword_search },
+	{ "case",	parse_keyword_case },
+	{ "find",	parse_keyword_find },
+	{ "any",	parse_keyword_any },
+	{ "all",	parse_keyword_all },
 
 	{ NULL,		NULL }
 };
@@ -138,20 +370,55 @@ static const struct
 extern void world_recall_command( World *wld, char *argstr )
 {
 	Params params;
+	Cursor cur;
+	Line *line;
+
+	/* One at a time. */
+	if( wld->recall_job != NULL )
+	{
+		world_msg_client( wld, "Another recall is still running. Use "
+				"/recall cancel to stop it." );
+		return;
+	}
 
 	params.argstr = argstr;
 
-	/* Default recall: from oldest line to now. */
+	/* Default recall: from oldest line in history to now. */
+	cursor_init( wld, &cur );
 	params.from = current_time();
-	if( wld->history_lines->tail )
-		params.from = wld->history_lines->head->time;
+	if( ( line = cursor_first( wld, &cur ) ) != NULL )
+		params.from = line->time;
+	cursor_done( &cur );
 	params.to = current_time();
 	params.lines = 0;
 	params.search_str = NULL;
+	params.search_case = 0;
+	params.search_literal = 0;
+	params.nfind = 0;
+	params.nterms = 0;
+	params.terms_all = 0;
+	params.termset = NULL;
+	params.bloom_use = 0;
+	params.bloom_any = NULL;
+	params.nbloom_any = 0;
+	params.strip = NULL;
+	params.stripsize = 0;
+	params.lines_inperiod = 0;
+	params.lines_matched = 0;
 
 	/* Parse the command arguments. */
 	if( parse_arguments( wld, &params ) )
-		goto out;
+	{
+		params_free( &params );
+		return;
+	}
+
+	/* Compile the search string, once. */
+	if( recall_compile( wld, &params ) )
+	{
+		params_free( &params );
+		return;
+	}
 
 	/* Make sure from < to. */
 	if( params.from > params.to )
@@ -177,18 +444,124 @@ extern void world_recall_command( World *wld, char *argstr )
 				time_string( params.from, "%a %Y/%m/%d %T" ) );
 	}
 
-	/* Recall matching lines. */
-	recall_search_and_recall( wld, &params );
+	/* The job takes over the params. The main loop does the rest. */
+	job_start( wld, &params );
+}
+
+
+
+extern void world_recall_more( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+
+	if( job == NULL )
+	{
+		world_msg_client( wld, "There is no recall to continue." );
+		return;
+	}
+
+	if( !job->paused )
+	{
+		world_msg_client( wld, "The recall is still running." );
+		return;
+	}
+
+	job->paused = 0;
+	job->page_left = wld->recall_page;
+}
+
+
+
+extern void world_recall_cancel( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	Line *line;
+
+	if( job == NULL )
+	{
+		world_msg_client( wld, "There is no recall to cancel." );
+		return;
+	}
+
+	line = world_msg_client( wld, "Recall cancelled after %li lines.",
+			job->sent );
+	line->flags |= LINE_BULK;
+	job_free( wld );
+}
+
+
+
+extern void world_recall_feed( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	long budget = RECALL_BATCH;
+	Line *line;
+
+	if( !job_can_feed( wld ) )
+		return;
+
+	if( wld->recall_page > 0 && budget > job->page_left )
+		budget = job->page_left;
+
+	if( job->threaded )
+		budget -= job_feed_chunks( wld, budget );
+
+	if( !job->threaded && budget > 0 && job_feed_history( wld, budget ) )
+	{
+		recall_footer( wld, job->params );
+		job_free( wld );
+		return;
+	}
+
+	if( wld->recall_page > 0 && job->page_left <= 0 )
+	{
+		job->paused = 1;
+		line = world_msg_client( wld, "Recalled %li lines so far. Use "
+				"/recall more for more, or /recall cancel to "
+				"stop.", job->sent );
+		line->flags |= LINE_BULK;
+	}
+}
+
+
+
+extern int world_recall_pending( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	Recallchunk *chunk;
+
+	if( !job_can_feed( wld ) )
+		return 0;
+
+	/* Searching the logfiles, we can only go on once the threads found
+	 * something. */
+	if( job->threaded && job->delivered < job->nchunks )
+	{
+		chunk = &job->chunks[job->delivered % RECALL_WINDOW];
+		return __atomic_load_n( &chunk->done, __ATOMIC_ACQUIRE ) ||
+				__atomic_load_n( &chunk->full, __ATOMIC_ACQUIRE );
+	}
+
+	return 1;
+}
+
+
+
+extern void world_recall_handle_fd( World *wld )
+{
+	char junk[64];
+
+	/* Just wake up, world_recall_feed() takes it from here. */
+	while( read( wld->recall_fd, junk, sizeof( junk ) ) > 0 )
+		continue;
+}
+
 
-	/* Print the recall footer. */
-	world_msg_client( wld, "Recall end (%i / %i / %i).",
-			wld->history_lines->count, params.lines_inperiod,\
-			params.lines_matched );
 
-out:
-	free( params.word );
-	free( params.error );
-	free( params.search_str );
+extern void world_recall_stop( World *wld )
+{
+	if( wld->recall_job != NULL )
+		job_free( wld );
 }
 
 
@@ -424,6 +797,99 @@ static int parse_keyword_search( World *wld, Params *params )
 
 
 
+/* Parse the 'case' keyword, which makes the search case sensitive. */
+static int parse_keyword_case( World *wld, Params *params )
+{
+	parse_nextword( params );
+	params->search_case = 1;
+	return 0;
+}
+
+
+
+/* Parse the options to the 'find' keyword. */
+static int parse_keyword_find( World *wld, Params *params )
+{
+	Logword words[LOGINDEX_MAXWORDS + 1];
+
+	parse_nextword( params );
+	if( params->word[0] == '\0' )
+	{
+		xasprintf( &params->error, "Missing words after `find' "
+				"keyword." );
+		return 1;
+	}
+
+	/* The entire rest of the argument string are the words. */
+	params->nfind = logindex_words( params->argstr + params->word_start,
+			words, LOGINDEX_MAXWORDS + 1 );
+	if( params->nfind == 0 || params->nfind > LOGINDEX_MAXWORDS )
+	{
+		xasprintf( &params->error, "Give 1 to %i words to find (letters "
+				"and digits, at least %i).", LOGINDEX_MAXWORDS,
+				LOGINDEX_MINWORD );
+		return 1;
+	}
+	memcpy( params->find, words, params->nfind * sizeof( Logword ) );
+
+	/* Eat any remaining words. */
+	while( params->word[0] != '\0' )
+		parse_nextword( params );
+	return 0;
+}
+
+
+
+/* Parse the options to the 'any' keyword. */
+static int parse_keyword_any( World *wld, Params *params )
+{
+	return parse_terms( wld, params, 0 );
+}
+
+
+
+/* Parse the options to the 'all' keyword. */
+static int parse_keyword_all( World *wld, Params *params )
+{
+	return parse_terms( wld, params, 1 );
+}
+
+
+
+/* The entire rest of the argument string are the terms of the any/all
+ * keywords, separated by spaces. all says if all of them must be present,
+ * or just one. */
+static int parse_terms( World *wld, Params *params, int all )
+{
+	char *keyword = all ? "all" : "any";
+
+	parse_nextword( params );
+	if( params->word[0] == '\0' )
+	{
+		xasprintf( &params->error, "Missing terms after `%s' keyword.",
+				keyword );
+		return 1;
+	}
+
+	params->terms_all = all;
+	while( params->word[0] != '\0' )
+	{
+		if( params->nterms == RECALL_MAXTERMS )
+		{
+			xasprintf( &params->error, "Give at most %i terms after "
+					"`%s' keyword.", RECALL_MAXTERMS,
+					keyword );
+			return 1;
+		}
+		params->terms[params->nterms++] = xstrdup( params->word );
+		parse_nextword( params );
+	}
+
+	return 0;
+}
+
+
+
 /* Parse a timespec. Returns true on error, false on success.
  * On error, params->error may or may not be set.
  * On success, params->when or params->lines will be modified. */
@@ -751,163 +1217,1392 @@ static int parse_when_rchk( Params *params, int v, int l, int u, char *name )
 
 
 
-/* Search the history for any lines that match our search criteria,
- * and recall those lines. */
-static void recall_search_and_recall( World *wld, Params *params )
+/* Print the recall footer. */
+static void recall_footer( World *wld, Params *params )
 {
 	Line *line;
-	char *str;
-	int count = 0, lines = 0;
 
-	/* Initialize statistics. */
-	params->lines_inperiod = 0;
-	params->lines_matched = 0;
+	line = world_msg_client( wld, "Recall end (%lu / %li / %li).",
+			wld->history_lines->count +
+			wld->spill_count[SPILL_HISTORY],
+			params->lines_inperiod, params->lines_matched );
+	line->flags |= LINE_BULK;
+}
 
-	/* Transform the search-string, in-place, into a \0 separated list
-	 * of individually searchable strings so our "RE engine" can use it.
-	 * Yes, this is utterly horrible. */
-	if( params->search_str != NULL )
-	{
-		params->search_str = xrealloc( params->search_str,
-				strlen( params->search_str ) + 2 );
-		str = params->search_str;
-		while( *str != '\0' )
-			*str = tolower( *str ), str++;
-		str = params->search_str;
-		while( *str != '\0' )
-		{
-			if( *str++ != '.' )
-				continue;
-			if( *str != '*' )
-				continue;
-			*(str - 1) = '\0';
-			memmove( str, str + 1, strlen( str ) );
-		}
-		str++;
-		*str = '\0';
+
+
+/* Free the resources held by params (but not params itself). */
+static void params_free( Params *params )
+{
+	int i;
+
+	if( params->search_str != NULL && !params->search_literal )
+		regfree( &params->search_re );
+
+	free( params->word );
+	free( params->error );
+	free( params->search_str );
+	free( params->strip );
+	for( i = 0; i < params->nterms; i++ )
+		free( params->terms[i] );
+	if( params->termset != NULL )
+	{
+		free( params->termset->next );
+		free( params->termset->out );
+		free( params->termset );
 	}
+	free( params->bloom_any );
+}
+
+
+
+/* Compile the search string (if any) into a POSIX extended regular
+ * expression, case insensitive unless the case keyword was given. On
+ * failure, tell the client, and return nonzero. */
+static int recall_compile( World *wld, Params *params )
+{
+	char err[256];
+	int ret, i;
 
-	/* Search all lines that satisfy from <= time <= to. */
-	if( params->lines == 0 )
+	for( i = 0; i < 256; i++ )
+		params->search_fold[i] = params->search_case ? i : tolower( i );
+
+	if( params->nterms > 0 )
+		recall_compile_terms( params );
+
+	if( params->search_str == NULL )
 	{
-		/* Just loop from oldest line to newest, and only do further
-		 * matching on those that satisfy the time requirements. */
-		for( line = wld->history_lines->head; line; line = line->next )
-		{
-			if( line->time < params->from )
-				continue;
-			if( line->time > params->to )
-				continue;
+		recall_compile_bloom( params );
+		return 0;
+	}
 
-			recall_match_one_line( wld, params, line );
-		}
+	/* Most searches are just text, which doesn't need the regex
+	 * engine. */
+	if( strpbrk( params->search_str, RECALL_REGEX_SPECIAL ) == NULL )
+	{
+		recall_compile_literal( params );
+		recall_compile_bloom( params );
+		return 0;
+	}
+
+	ret = recall_regcomp( params );
+	if( ret == 0 )
+		return 0;
+
+	regerror( ret, &params->search_re, err, sizeof( err ) );
+	world_msg_client( wld, "Invalid search string: %s.", err );
+
+	/* So it won't be regfree()d. */
+	free( params->search_str );
+	params->search_str = NULL;
+	return 1;
+}
+
+
+
+/* Compile search_str into search_re. Returns what regcomp() does. */
+static int recall_regcomp( Params *params )
+{
+	return regcomp( &params->search_re, params->search_str, REG_EXTENDED |
+			REG_NOSUB | ( params->search_case ? 0 : REG_ICASE ) );
+}
+
+
+
+/* Prepare the search for the literal string search_str: the
+ * Boyer-Moore-Horspool table that says how far the search may skip ahead,
+ * given the last character of the window. search_str is case folded in
+ * place. */
+static void recall_compile_literal( Params *params )
+{
+	unsigned char *lit = (unsigned char *) params->search_str;
+	long i;
+
+	params->search_literal = 1;
+	params->search_len = strlen( params->search_str );
+
+	for( i = 0; i < params->search_len; i++ )
+		lit[i] = params->search_fold[lit[i]];
+
+	for( i = 0; i < 256; i++ )
+		params->search_skip[i] = params->search_len;
+	for( i = 0; i < params->search_len - 1; i++ )
+		params->search_skip[lit[i]] = params->search_len - 1 - i;
+}
+
+
+
+/* Return true if str (of len bytes) contains the literal search string. */
+static int recall_match_literal( Params *params, char *str, long len )
+{
+	unsigned char *s = (unsigned char *) str;
+	unsigned char *lit = (unsigned char *) params->search_str;
+	unsigned char *fold = params->search_fold;
+	long n = params->search_len, i, j;
+
+	for( i = 0; i + n <= len; i += params->search_skip[fold[s[i + n - 1]]] )
+	{
+		for( j = n - 1; j >= 0 && fold[s[i + j]] == lit[j]; j-- )
+			continue;
+		if( j < 0 )
+			return 1;
 	}
 
-	/* Search params->lines after from. */
-	if( params->lines > 0 )
+	return 0;
+}
+
+
+
+/* Build the Aho-Corasick automaton for the terms of the any/all keywords.
+ * First the terms are put in a trie, and then, breadth first, the missing
+ * transitions of each state are filled in from the state for the longest
+ * proper suffix of the text leading to it (its failure state). */
+static void recall_compile_terms( Params *params )
+{
+	Termset *ts;
+	unsigned char *t;
+	long max = 1, *fail, *queue, head = 0, tail = 0, st, child;
+	int i, c;
+
+	for( i = 0; i < params->nterms; i++ )
+		max += strlen( params->terms[i] );
+
+	ts = xmalloc( sizeof( Termset ) );
+	ts->next = xmalloc( max * sizeof( *ts->next ) );
+	ts->out = xmalloc( max * sizeof( unsigned long ) );
+	fail = xmalloc( max * sizeof( long ) );
+	queue = xmalloc( max * sizeof( long ) );
+	params->termset = ts;
+
+	/* The trie. */
+	ts->nstates = 1;
+	memset( ts->next[0], -1, sizeof( ts->next[0] ) );
+	ts->out[0] = 0;
+	for( i = 0; i < params->nterms; i++ )
 	{
-		/* Just loop from oldest line to newest, and only do further
-		 * matching on the first X lines that are new enough. */
-		for( line = wld->history_lines->head; line; line = line->next )
+		st = 0;
+		for( t = (unsigned char *) params->terms[i]; *t != '\0'; t++ )
 		{
-			if( line->time < params->from )
-				continue;
-			if( ++count > params->lines )
-				break;
-
-			recall_match_one_line( wld, params, line );
+			c = params->search_fold[*t];
+			if( ts->next[st][c] == -1 )
+			{
+				memset( ts->next[ts->nstates], -1,
+						sizeof( ts->next[0] ) );
+				ts->out[ts->nstates] = 0;
+				ts->next[st][c] = ts->nstates++;
+			}
+			st = ts->next[st][c];
 		}
+		ts->out[st] |= 1UL << i;
 	}
 
-	/* Search -params->lines before from. */
-	if( params->lines < 0 )
+	/* The transitions of the start state. */
+	for( c = 0; c < 256; c++ )
 	{
-		/* First, loop from newest line to oldest, stopping when we've
-		 * encountered X lines that are old enough. */
-		for( line = wld->history_lines->tail; line; line = line->prev )
+		child = ts->next[0][c];
+		if( child == -1 )
+			ts->next[0][c] = 0;
+		else
 		{
-			 if( line->time > params->from )
-				 continue;
-			 if( ++lines >= -params->lines )
-				 break;
+			fail[child] = 0;
+			queue[tail++] = child;
 		}
+	}
 
-		/* Don't run off the head of the queue. */
-		if( !line )
-			line = wld->history_lines->head;
-
-		/* Now, loop from the last line found back forward in time,
-		 * inspecting X lines. */
-		for( ; line; line = line->next )
+	/* And of the other states, in order of depth. A state also finds the
+	 * terms its failure state finds. */
+	while( head < tail )
+	{
+		st = queue[head++];
+		ts->out[st] |= ts->out[fail[st]];
+		for( c = 0; c < 256; c++ )
 		{
-			if( line->time > params->from )
-				continue;
-			if( ++count > lines )
-				break;
-
-			recall_match_one_line( wld, params, line );
+			child = ts->next[st][c];
+			if( child == -1 )
+				ts->next[st][c] = ts->next[fail[st]][c];
+			else
+			{
+				fail[child] = ts->next[fail[st]][c];
+				queue[tail++] = child;
+			}
 		}
 	}
+
+	free( fail );
+	free( queue );
 }
 
 
 
-/* Inspect a line that already matches the time criteria further.
- * If it matches the string criteria as well, recall it. */
-static void recall_match_one_line( World *wld, Params *params, Line *line )
+/* Return true if str contains any (or all, if terms_all is set) of the
+ * terms of the any/all keywords. */
+static int recall_match_terms( Params *params, char *str )
 {
-	Line *recalled;
-	char *str;
-
-	/* It got here, so it matched the time criteria. */
-	params->lines_inperiod++;
+	Termset *ts = params->termset;
+	unsigned char *s = (unsigned char *) str;
+	unsigned long found = 0, all = 0;
+	int st = 0;
 
-	/* Get the string without ANSI stuff. */
-	str = xmalloc( line->len + 1 );
-	strcpy_noansi( str, line->str );
+	if( params->terms_all )
+		all = ( 2UL << ( params->nterms - 1 ) ) - 1;
 
-	/* If we have a search string, and it doesn't match, dump the line. */
-	if( params->search_str != NULL &&
-			!recall_match( str, params->search_str ) )
+	for( ; *s != '\0'; s++ )
 	{
-		free( str );
-		return;
+		st = ts->next[st][params->search_fold[*s]];
+		found |= ts->out[st];
+		if( found != 0 && ( found & all ) == all )
+			return 1;
 	}
 
-	/* We're good, recall it! */
-	recalled = line_create( str, -1 );
-	recalled->flags = LINE_MESSAGE;
-	recalled->time = line->time;
-	linequeue_append( wld->client_toqueue, recalled );
-	params->lines_matched++;
+	return 0;
 }
 
 
 
-/* Match the (prepared) re against the string.
- * Return true on successful match, false otherwise. */
-static int recall_match( char *line, char *re )
+/* Work out what the bloom filter of a block of history lines must have,
+ * for the block to hold a line with the literal search string, the words
+ * of the find keyword, and the terms of the any/all keywords. A regular
+ * expression doesn't narrow it down. */
+static void recall_compile_bloom( Params *params )
 {
-	char *l, *r;
+	unsigned char *all = params->bloom_all;
+	int i;
 
-	/* A continuation of the horrible re stuff.
-	 * Please just pretend it doesn't exist. */
-	while( *re != '\0' && *line != '\0' )
-	{
-		l = line;
-		r = re;
+	memset( all, 0, HISTORY_BLOOM_SIZE );
 
-		while( ( *r == '.' || tolower( *l ) == *r ) && *l != '\0' )
-			l++, r++;
+	if( params->search_str != NULL && params->search_literal )
+		bloom_add_trigrams( all, params->search_str,
+				params->search_len );
 
-		if( *r != '\0' )
-			line++;
-		else
-		{
-			re = r + 1;
-			line = l;
-		}
-	}
+	for( i = 0; i < params->nfind; i++ )
+		bloom_add_trigrams( all, params->find[i],
+				strlen( params->find[i] ) );
+
+	if( params->terms_all )
+		for( i = 0; i < params->nterms; i++ )
+			bloom_add_trigrams( all, params->terms[i],
+					strlen( params->terms[i] ) );
+
+	for( i = 0; i < HISTORY_BLOOM_SIZE; i++ )
+		if( all[i] != 0 )
+			params->bloom_use = 1;
+
+	/* With any of the terms, a term without trigrams might be there
+	 * without the bloom filter knowing. */
+	if( params->terms_all || params->nterms == 0 )
+		return;
+	for( i = 0; i < params->nterms; i++ )
+		if( strlen( params->terms[i] ) < 3 )
+			return;
+
+	params->bloom_any = xmalloc( params->nterms *
+			sizeof( *params->bloom_any ) );
+	memset( params->bloom_any, 0, params->nterms *
+			sizeof( *params->bloom_any ) );
+	for( i = 0; i < params->nterms; i++ )
+		bloom_add_trigrams( params->bloom_any[i], params->terms[i],
+				strlen( params->terms[i] ) );
+	params->nbloom_any = params->nterms;
+	params->bloom_use = 1;
+}
+
+
+
+/* Return true if a block of history lines with bloom filter bloom may hold
+ * a match. */
+static int recall_match_bloom( Params *params, unsigned char *bloom )
+{
+	unsigned char *any;
+	int i, j;
+
+	for( j = 0; j < HISTORY_BLOOM_SIZE; j++ )
+		if( ( bloom[j] & params->bloom_all[j] ) !=
+				params->bloom_all[j] )
+			return 0;
+
+	if( params->nbloom_any == 0 )
+		return 1;
 
-	return *re == '\0';
+	for( i = 0; i < params->nbloom_any; i++ )
+	{
+		any = params->bloom_any[i];
+		for( j = 0; j < HISTORY_BLOOM_SIZE; j++ )
+			if( ( bloom[j] & any[j] ) != any[j] )
+				break;
+		if( j == HISTORY_BLOOM_SIZE )
+			return 1;
+	}
+
+	return 0;
+}
+
+
+
+/* Inspect a line that already matches the time criteria further.
+ * If it matches the string criteria as well, recall it, by appending a
+ * copy of it to queue. */
+static void recall_match_one_line( Params *params, Line *line,
+		Linequeue *queue )
+{
+	Line *recalled;
+	char *str;
+	long len;
+
+	/* It got here, so it matched the time criteria. */
+	params->lines_inperiod++;
+
+	/* Get the string without ANSI stuff. Lines without any control
+	 * characters (such as those from the logfiles) are used as is. */
+	str = line->str;
+	len = line->len;
+	if( has_control( str ) )
+	{
+		if( params->stripsize < line->len + 1 )
+		{
+			params->stripsize = line->len + 1;
+			params->strip = xrealloc( params->strip,
+					params->stripsize );
+		}
+		len = strcpy_noansi( params->strip, str );
+		str = params->strip;
+	}
+
+	/* If we have a search string, and it doesn't match, dump the line. */
+	if( params->search_str != NULL && ( params->search_literal ?
+			!recall_match_literal( params, str, len ) :
+			regexec( &params->search_re, str, 0, NULL, 0 ) != 0 ) )
+		return;
+
+	/* The same if we're looking for terms, and they're not there. */
+	if( params->nterms > 0 && !recall_match_terms( params, str ) )
+		return;
+
+	/* The same if we're looking for words, and they're not all there. */
+	if( params->nfind > 0 && !logindex_match( str, params->find,
+			params->nfind ) )
+		return;
+
+	/* We're good, recall it! */
+	recalled = line_create( xstrdup( str ), -1 );
+	recalled->flags = LINE_MESSAGE | LINE_BULK;
+	recalled->time = line->time;
+	linequeue_append( queue, recalled );
+	params->lines_matched++;
+}
+
+
+
+/* Return true if str contains any characters strcpy_noansi() would
+ * remove. */
+static int has_control( char *str )
+{
+	for( ; *str != '\0'; str++ )
+		if( (unsigned char) *str < ' ' && *str != '\t' )
+			return 1;
+
+	return 0;
+}
+
+
+
+/* Prepare cur for use. */
+static void cursor_init( World *wld, Cursor *cur )
+{
+	cur->offset = -1;
+	cur->line = NULL;
+	cur->mark = -1;
+	cur->log = NULL;
+	cur->logoff = -1;
+	cur->find = NULL;
+	cur->nfind = 0;
+	cur->cands = NULL;
+	cur->ncands = 0;
+
+	/* Find the oldest line in history. Without history, everything in
+	 * the logfiles counts. */
+	cur->histstart = current_time() + 1;
+	if( cursor_first( wld, cur ) != NULL )
+		cur->histstart = cursor_line( wld, cur )->time;
+}
+
+
+
+/* Release the resources held by cur. */
+static void cursor_done( Cursor *cur )
+{
+	logday_close( cur->log );
+	cur->log = NULL;
+	free( cur->cands );
+	cur->cands = NULL;
+}
+
+
+
+/* Position cur at the oldest line in history. Return that line. */
+static Line *cursor_first( World *wld, Cursor *cur )
+{
+	cursor_done( cur );
+	cur->offset = world_spill_first( wld, SPILL_HISTORY );
+	cur->line = wld->history_lines->head;
+	cur->mark = ( cur->offset != -1 ) ? wld->spill_index_first :
+			wld->history_index_first;
+
+	return cursor_line( wld, cur );
+}
+
+
+
+/* Position cur at the newest line in history. Return that line. */
+static Line *cursor_last( World *wld, Cursor *cur )
+{
+	cursor_done( cur );
+	cur->offset = -1;
+	cur->mark = -1;
+	cur->line = wld->history_lines->tail;
+	if( cur->line == NULL )
+		cur->offset = world_spill_last( wld, SPILL_HISTORY );
+
+	/* No history at all, the logfiles may still have something. */
+	if( cur->line == NULL && cur->offset == -1 )
+		return cursor_log_last( wld, cur );
+
+	return cursor_line( wld, cur );
+}
+
+
+
+/* Position cur at the oldest line in history with a time of at least t.
+ * Return that line. */
+static Line *cursor_seek( World *wld, Cursor *cur, time_t t )
+{
+	cursor_done( cur );
+	cur->mark = -1;
+
+	/* Older than the history, look in the logfiles first. */
+	if( t < cur->histstart && cursor_log_seek( wld, cur, t ) != NULL )
+		return cursor_line( wld, cur );
+
+	/* The spill file has a time index, use that. */
+	cur->offset = world_spill_seek( wld, t, &cur->mark );
+	if( cur->offset != -1 )
+		return cursor_line( wld, cur );
+
+	/* Not in the spill file, so search the lines in memory. */
+	cur->line = world_history_seek( wld, t, &cur->mark );
+
+	return cur->line;
+}
+
+
+
+/* Advance cur to the next newer line. Return that line. */
+static Line *cursor_next( World *wld, Cursor *cur )
+{
+	/* At the end of the logfiles, continue with the history. */
+	if( cur->log != NULL )
+	{
+		if( cursor_log_next( wld, cur ) == NULL )
+			return cursor_first( wld, cur );
+	}
+	else if( cur->offset != -1 )
+	{
+		if( cur->mark >= 0 && cur->mark < wld->spill_index_count &&
+				wld->spill_index[cur->mark].offset ==
+				cur->offset )
+			cur->mark++;
+		cur->offset = world_spill_next( wld, cur->offset,
+				SPILL_HISTORY );
+		/* At the end of the spill file, continue in memory. */
+		if( cur->offset == -1 )
+		{
+			cur->line = wld->history_lines->head;
+			cur->mark = wld->history_index_first;
+		}
+	}
+	else if( cur->line != NULL )
+	{
+		/* Leaving a marked line, the next mark is the one after. */
+		if( cur->mark >= 0 && cur->mark < wld->history_index_count &&
+				wld->history_index[cur->mark].line == cur->line )
+			cur->mark++;
+		cur->line = cur->line->next;
+	}
+
+	return cursor_line( wld, cur );
+}
+
+
+
+/* Move cur back to the next older line. Return that line. */
+static Line *cursor_prev( World *wld, Cursor *cur )
+{
+	Line *line;
+
+	if( cur->log != NULL )
+		return cursor_log_prev( wld, cur );
+
+	cur->mark = -1;
+	if( cur->offset != -1 )
+	{
+		cur->offset = world_spill_prev( wld, cur->offset,
+				SPILL_HISTORY );
+		cur->line = NULL;
+	}
+	else if( cur->line != NULL )
+	{
+		/* At the start of memory, continue in the spill file. */
+		if( cur->line->prev == NULL )
+			cur->offset = world_spill_last( wld, SPILL_HISTORY );
+		cur->line = cur->line->prev;
+	}
+
+	/* At the start of the history, continue in the logfiles. */
+	line = cursor_line( wld, cur );
+	if( line == NULL )
+		line = cursor_log_last( wld, cur );
+
+	return line;
+}
+
+
+
+/* Return the line cur is positioned at, or NULL if there is none. */
+static Line *cursor_line( World *wld, Cursor *cur )
+{
+	if( cur->log != NULL )
+	{
+		logday_get( cur->log, cur->logoff, &cur->spilled );
+		return &cur->spilled;
+	}
+
+	if( cur->offset == -1 )
+		return cur->line;
+
+	world_spill_get( wld, cur->offset, &cur->spilled );
+	return &cur->spilled;
+}
+
+
+
+/* If cur is at the first line of a block of history lines in memory, and
+ * the block has been indexed, return its mark in the time index.
+ * Otherwise, return NULL. */
+static Histmark *cursor_block( World *wld, Cursor *cur )
+{
+	Histmark *mark;
+
+	if( cur->log != NULL || cur->offset != -1 || cur->line == NULL ||
+			cur->mark < wld->history_index_first ||
+			cur->mark >= wld->history_index_built )
+		return NULL;
+
+	mark = &wld->history_index[cur->mark];
+	return ( mark->line == cur->line ) ? mark : NULL;
+}
+
+
+
+/* If cur is at the first record of a block of the history region of the
+ * spill file, return its mark in the time index. Otherwise, return NULL. */
+static Spillmark *cursor_spill_block( World *wld, Cursor *cur )
+{
+	Spillmark *mark;
+
+	if( cur->log != NULL || cur->offset == -1 ||
+			cur->mark < wld->spill_index_first ||
+			cur->mark + 1 >= wld->spill_index_count )
+		return NULL;
+
+	/* The block must lie in the history region entirely. */
+	mark = &wld->spill_index[cur->mark];
+	if( mark->offset != cur->offset ||
+			mark[1].offset > wld->spill_histend )
+		return NULL;
+
+	return mark;
+}
+
+
+
+/* Advance cur, which cursor_block() or cursor_spill_block() says is at the
+ * first line of a block, to the first line of the next block. Return that
+ * line. */
+static Line *cursor_skip_block( World *wld, Cursor *cur )
+{
+	if( cur->offset == -1 )
+		return cur->line = wld->history_index[++cur->mark].line;
+
+	cur->offset = wld->spill_index[++cur->mark].offset;
+	/* At the end of the spill file, continue in memory. */
+	if( cur->offset >= wld->spill_histend )
+	{
+		cur->offset = -1;
+		cur->line = wld->history_lines->head;
+		cur->mark = wld->history_index_first;
+	}
+
+	return cursor_line( wld, cur );
+}
+
+
+
+/* Position cur at the oldest line in the logfiles with a time of at least
+ * t, and older than the history. Return that line, or NULL if there is
+ * none (cur is not in the logfiles then). */
+static Line *cursor_log_seek( World *wld, Cursor *cur, time_t t )
+{
+	Logday *ld;
+	long off;
+
+	while( ( ld = cursor_log_open( wld, cur, t, 1 ) ) != NULL )
+	{
+		off = logday_seek( ld, t );
+		if( off != -1 )
+			off = cursor_log_step( cur, ld, off - 1 );
+		if( off != -1 && logday_time( ld, off ) < cur->histstart )
+		{
+			cur->log = ld;
+			cur->logoff = off;
+			return cursor_line( wld, cur );
+		}
+
+		/* If there is a line, it's in the history already. */
+		t = ld->end;
+		logday_close( ld );
+		if( off != -1 )
+			break;
+	}
+
+	return NULL;
+}
+
+
+
+/* Position cur at the newest line in the logfiles that is older than the
+ * history. Return that line, or NULL if there is none. */
+static Line *cursor_log_last( World *wld, Cursor *cur )
+{
+	time_t t = cur->histstart;
+	Logday *ld;
+	long off;
+
+	cursor_done( cur );
+
+	while( ( ld = cursor_log_open( wld, cur, t, -1 ) ) != NULL )
+	{
+		for( off = logday_last( ld ); off != -1; off = logday_prev( ld,
+				off ) )
+			if( logday_time( ld, off ) < cur->histstart )
+			{
+				cur->log = ld;
+				cur->logoff = off;
+				return cursor_line( wld, cur );
+			}
+
+		t = ld->start - 1;
+		logday_close( ld );
+	}
+
+	return NULL;
+}
+
+
+
+/* Advance cur (in the logfiles) to the next newer line that is older than
+ * the history. Return that line, or NULL if there is none. */
+static Line *cursor_log_next( World *wld, Cursor *cur )
+{
+	Logday *ld = cur->log;
+	time_t t;
+	long off;
+
+	off = cursor_log_step( cur, ld, cur->logoff );
+	while( off == -1 )
+	{
+		t = ld->end;
+		logday_close( ld );
+		ld = cursor_log_open( wld, cur, t, 1 );
+		cur->log = ld;
+		if( ld == NULL )
+			return NULL;
+		off = cursor_log_step( cur, ld, -1 );
+	}
+
+	if( logday_time( ld, off ) >= cur->histstart )
+	{
+		cursor_done( cur );
+		return NULL;
+	}
+
+	cur->logoff = off;
+	return cursor_line( wld, cur );
+}
+
+
+
+/* Move cur (in the logfiles) back to the next older line. Return that
+ * line, or NULL if there is none. */
+static Line *cursor_log_prev( World *wld, Cursor *cur )
+{
+	Logday *ld = cur->log;
+	time_t t;
+	long off;
+
+	off = logday_prev( ld, cur->logoff );
+	while( off == -1 )
+	{
+		t = ld->start - 1;
+		logday_close( ld );
+		ld = cursor_log_open( wld, cur, t, -1 );
+		cur->log = ld;
+		if( ld == NULL )
+			return NULL;
+		off = logday_last( ld );
+	}
+
+	cur->logoff = off;
+	return cursor_line( wld, cur );
+}
+
+
+
+/* Open and load the logfile of the day t falls in, or the nearest one in
+ * direction dir (1 or -1) that's older than the history. When looking for
+ * words going forward, the word index tells which lines may contain them,
+ * and days without such lines are skipped without loading them. Returns
+ * NULL if there is no such logfile. */
+static Logday *cursor_log_open( World *wld, Cursor *cur, time_t t, int dir )
+{
+	time_t limit = ( dir > 0 ) ? cur->histstart : 0;
+	Logday *ld;
+
+	while( ( ld = world_logday_find( wld, t, dir, limit ) ) != NULL )
+	{
+		free( cur->cands );
+		cur->cands = NULL;
+		cur->cand = 0;
+		if( cur->nfind > 0 && dir > 0 )
+			cur->cands = logindex_lookup( ld->file, cur->find,
+					cur->nfind, &cur->ncands );
+
+		if( ( cur->cands == NULL || cur->ncands > 0 ) &&
+				logday_load( ld ) == 0 )
+			return ld;
+
+		t = ( dir > 0 ) ? ld->end : ld->start - 1;
+		logday_close( ld );
+	}
+
+	return NULL;
+}
+
+
+
+/* Return the offset of the line after offset in ld (or the first line, if
+ * offset is -1). If the word index gave us candidates, that's the next
+ * candidate. */
+static long cursor_log_step( Cursor *cur, Logday *ld, long offset )
+{
+	long c;
+
+	if( cur->cands == NULL )
+		return ( offset == -1 ) ? logday_first( ld ) :
+				logday_next( ld, offset );
+
+	/* Skip candidates that don't point at the start of a line (the
+	 * index may be ahead of the logfile after a crash). */
+	for( ; cur->cand < cur->ncands; cur->cand++ )
+	{
+		c = cur->cands[cur->cand];
+		if( c > offset && c < ld->len && ( c == 0 ||
+				ld->data[c - 1] == '\n' ) )
+			return c;
+	}
+
+	return -1;
+}
+
+
+
+/* Start a recall of params, which the job takes over. Lines before from
+ * are found right away. A period in the logfiles is searched by threads,
+ * if we can get them going. */
+static void job_start( World *wld, Params *params )
+{
+	Recalljob *job;
+	int i;
+
+	job = xmalloc( sizeof( Recalljob ) );
+	job->params = xmalloc( sizeof( Params ) );
+	*job->params = *params;
+	job->sent = 0;
+	job->page_left = wld->recall_page;
+	job->paused = 0;
+	job->threaded = 0;
+	job->next = params->from;
+	job->queued_all = 0;
+	job->nchunks = 0;
+	job->taken = 0;
+	job->delivered = 0;
+	job->cancel = 0;
+	job->nthreads = 0;
+	job->notify[0] = -1;
+	job->notify[1] = -1;
+	sem_init( &job->work, 0, 0 );
+	for( i = 0; i < RECALL_WINDOW; i++ )
+		sem_init( &job->chunks[i].resume, 0, 0 );
+	wld->recall_job = job;
+
+	cursor_init( wld, &job->cur );
+	cursor_done( &job->cur );
+	job->histstart = job->cur.histstart;
+	job->cur_kept = 0;
+	job->at = params->from;
+	job->skip = 0;
+	job->remaining = ( params->lines > 0 ) ? params->lines : -1;
+
+	if( params->lines < 0 )
+		job_start_before( wld );
+	else if( params->lines == 0 && params->from < job->histstart )
+		job_start_threads( wld );
+}
+
+
+
+/* Find where a recall of -lines lines before from starts: walk back from
+ * the newest line that is old enough until we've encountered that many
+ * lines. */
+static void job_start_before( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	Cursor *cur = &job->cur;
+	Line *line;
+	long lines = 0;
+
+	line = cursor_seek( wld, cur, job->params->from + 1 );
+	if( line != NULL )
+		line = cursor_prev( wld, cur );
+	else
+		line = cursor_last( wld, cur );
+
+	for( ; line; line = cursor_prev( wld, cur ) )
+		if( ++lines >= -job->params->lines )
+			break;
+
+	/* Don't run off the head of the queue. The oldest line may be in the
+	 * logfiles. */
+	if( !line )
+		line = cursor_seek( wld, cur, 0 );
+
+	/* Inspect as many lines from there, counting the lines before it
+	 * with the same time, to find it again. */
+	job->remaining = lines;
+	if( line != NULL )
+	{
+		job->at = line->time;
+		while( ( line = cursor_prev( wld, cur ) ) != NULL &&
+				line->time == job->at )
+			job->skip++;
+	}
+
+	cursor_done( cur );
+}
+
+
+
+/* Set the threads to searching the logfiles in the period. If there are no
+ * logfiles, or we can't get threads going, the logfiles are read like the
+ * history instead. */
+static void job_start_threads( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	sigset_t all, old;
+	long cpus;
+	int i;
+
+	if( pipe( job->notify ) == -1 )
+		return;
+	fcntl( job->notify[0], F_SETFL, O_NONBLOCK );
+	fcntl( job->notify[1], F_SETFL, O_NONBLOCK );
+
+	job_queue_chunks( wld );
+	if( job->nchunks == 0 )
+		return;
+
+	/* One thread per processor, but not too many. Signals are for the
+	 * main thread, the threads won't have any of them. */
+	cpus = sysconf( _SC_NPROCESSORS_ONLN );
+	if( cpus > RECALL_MAXTHREADS )
+		cpus = RECALL_MAXTHREADS;
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+	for( i = 0; i < cpus || i == 0; i++ )
+	{
+		if( pthread_create( &job->threads[i], NULL, job_main, job ) )
+			break;
+		job->nthreads++;
+	}
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+	if( job->nthreads == 0 )
+	{
+		job_drop_chunks( job );
+		return;
+	}
+
+	job->threaded = 1;
+	wld->recall_fd = job->notify[0];
+}
+
+
+
+/* Queue the next logfiles in the period for the threads, as far as the
+ * window allows. */
+static void job_queue_chunks( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	Recallchunk *chunk;
+	time_t limit = job->histstart;
+	Logday *ld;
+	int i;
+
+	if( job->params->to < limit )
+		limit = job->params->to;
+
+	while( !job->queued_all &&
+			job->nchunks - job->delivered < RECALL_WINDOW )
+	{
+		ld = world_logday_find( wld, job->next, 1, limit );
+		if( ld == NULL )
+		{
+			/* Wake up all threads, so they see there's no more
+			 * work. */
+			job->queued_all = 1;
+			for( i = 0; i < RECALL_MAXTHREADS; i++ )
+				sem_post( &job->work );
+			break;
+		}
+
+		chunk = &job->chunks[job->nchunks % RECALL_WINDOW];
+		chunk->ld = ld;
+		chunk->lines = linequeue_create();
+		chunk->inperiod = 0;
+		chunk->matched = 0;
+		chunk->done = 0;
+		chunk->full = 0;
+		job->next = ld->end;
+
+		__atomic_store_n( &job->nchunks, job->nchunks + 1,
+				__ATOMIC_RELEASE );
+		sem_post( &job->work );
+	}
+}
+
+
+
+/* Return true if there's a recall, it isn't paused, and the client has
+ * taken all lines up to now. */
+static int job_can_feed( World *wld )
+{
+	return wld->recall_job != NULL && !wld->recall_job->paused &&
+			wld->client_status == ST_CONNECTED &&
+			wld->client_bulkqueue->count == 0;
+}
+
+
+
+/* Send up to budget of the lines the threads found to the client, in
+ * order. Returns the number of lines sent. Once all logfiles are done,
+ * the history is next. */
+static long job_feed_chunks( World *wld, long budget )
+{
+	Recalljob *job = wld->recall_job;
+	Recallchunk *chunk;
+	Line *line;
+	long sent = 0;
+	int done;
+
+	while( sent < budget && job->delivered < job->nchunks )
+	{
+		chunk = &job->chunks[job->delivered % RECALL_WINDOW];
+		done = __atomic_load_n( &chunk->done, __ATOMIC_ACQUIRE );
+		if( !done && !__atomic_load_n( &chunk->full, __ATOMIC_ACQUIRE ) )
+			break;
+
+		while( sent < budget &&
+				( line = linequeue_pop( chunk->lines ) ) )
+		{
+			linequeue_append( wld->client_toqueue, line );
+			sent++;
+		}
+		if( chunk->lines->count > 0 )
+			break;
+
+		/* The thread is waiting for us to take its lines. */
+		if( !done )
+		{
+			__atomic_store_n( &chunk->full, 0, __ATOMIC_RELEASE );
+			sem_post( &chunk->resume );
+			break;
+		}
+
+		linequeue_destroy( chunk->lines );
+		job->params->lines_inperiod += chunk->inperiod;
+		job->params->lines_matched += chunk->matched;
+		job->delivered++;
+		job_queue_chunks( wld );
+	}
+
+	job->sent += sent;
+	job->page_left -= sent;
+
+	/* If lines left the history in the meantime, they are in the
+	 * logfiles now, and the cursor finds them there. */
+	if( job->queued_all && job->delivered == job->nchunks )
+	{
+		job->threaded = 0;
+		if( job->at < job->histstart )
+			job->at = job->histstart;
+	}
+
+	return sent;
+}
+
+
+
+/* Inspect the next lines, until up to budget of them have been recalled,
+ * or RECALL_SCAN have been inspected. Returns true if the recall is done. */
+static int job_feed_history( World *wld, long budget )
+{
+	Recalljob *job = wld->recall_job;
+	Params *params = job->params;
+	long matched = params->lines_matched, scanned = 0, sent;
+	Line *line, *next;
+
+	if( job->cur_kept )
+		line = cursor_next( wld, &job->cur );
+	else
+		line = job_seek( wld );
+
+	while( line != NULL )
+	{
+		if( params->lines == 0 && line->time > params->to )
+			break;
+		if( job->remaining == 0 )
+			break;
+
+		/* Pass over the blocks of history lines without a match. */
+		next = job_pass_block( wld );
+		if( next != NULL )
+		{
+			line = next;
+			continue;
+		}
+
+		if( job->remaining > 0 )
+			job->remaining--;
+
+		recall_match_one_line( params, line, wld->client_toqueue );
+
+		/* Remember where we are. */
+		if( line->time == job->at )
+			job->skip++;
+		else
+		{
+			job->at = line->time;
+			job->skip = 1;
+		}
+
+		if( params->lines_matched - matched >= budget ||
+				++scanned >= RECALL_SCAN )
+			break;
+
+		line = cursor_next( wld, &job->cur );
+	}
+
+	sent = params->lines_matched - matched;
+	job->sent += sent;
+	job->page_left -= sent;
+
+	/* Stopped before the end? Then keep the cursor, if we can. */
+	if( line != NULL && ( sent >= budget || scanned >= RECALL_SCAN ) )
+	{
+		job->cur_kept = ( job->cur.log != NULL );
+		if( !job->cur_kept )
+			cursor_done( &job->cur );
+		return 0;
+	}
+
+	cursor_done( &job->cur );
+	job->cur_kept = 0;
+	return 1;
+}
+
+
+
+/* Position the cursor of the job at the next line to inspect. Return that
+ * line. */
+static Line *job_seek( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	Line *line;
+	long n;
+
+	/* Looking for words in a period, the word index of the logfiles
+	 * can skip the lines without them. */
+	cursor_init( wld, &job->cur );
+	if( job->params->lines == 0 )
+	{
+		job->cur.find = job->params->find;
+		job->cur.nfind = job->params->nfind;
+	}
+
+	line = cursor_seek( wld, &job->cur, job->at );
+	for( n = 0; line && n < job->skip && line->time == job->at; n++ )
+		line = cursor_next( wld, &job->cur );
+
+	return line;
+}
+
+
+
+/* If the cursor of the job is at the first line of a block of history
+ * lines, and the bloom filter of the block says none of them match, pass
+ * over the block, as if its lines had been inspected. That is, if all of
+ * them would have been. Returns the line after the block, or NULL if the
+ * block has to be inspected line by line after all.
+ *
+ * In memory, the bloom filters have the trigrams of the lines. In the spill
+ * file, they only have the words, which is enough for the words we're
+ * looking for. */
+static Line *job_pass_block( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	Params *params = job->params;
+	Histmark *hmark;
+	Spillmark *smark;
+	Line *line;
+	time_t maxtime, last;
+	long n, step;
+
+	if( ( hmark = cursor_block( wld, &job->cur ) ) != NULL )
+	{
+		if( !params->bloom_use ||
+				recall_match_bloom( params, hmark->bloom ) )
+			return NULL;
+		step = HISTORY_INDEX_STEP;
+		maxtime = hmark->maxtime;
+
+		/* The time of the last line of the block, and how many of
+		 * the lines before it have that time as well. */
+		last = hmark[1].line->prev->time;
+		line = hmark[1].line->prev;
+		for( n = 0; n < step && line->time == last; n++ )
+			line = line->prev;
+	}
+	else if( ( smark = cursor_spill_block( wld, &job->cur ) ) != NULL )
+	{
+		if( params->nfind == 0 || logindex_bloom_match( smark->bloom,
+				SPILL_BLOOM_SIZE, params->find,
+				params->nfind ) )
+			return NULL;
+		step = SPILL_INDEX_STEP;
+		maxtime = smark->maxtime;
+		last = smark->last;
+		n = smark->lastrun;
+	}
+	else
+		return NULL;
+
+	if( ( params->lines == 0 && maxtime > params->to ) ||
+			( job->remaining >= 0 && job->remaining < step ) )
+		return NULL;
+
+	if( job->remaining > 0 )
+		job->remaining -= step;
+	params->lines_inperiod += step;
+
+	/* Remember where we are, like for the lines one by one. */
+	if( n == step && last == job->at )
+		job->skip += n;
+	else
+	{
+		job->at = last;
+		job->skip = n;
+	}
+
+	return cursor_skip_block( wld, &job->cur );
+}
+
+
+
+/* Free the chunks that haven't been sent to the client. */
+static void job_drop_chunks( Recalljob *job )
+{
+	Recallchunk *chunk;
+
+	for( ; job->delivered < job->nchunks; job->delivered++ )
+	{
+		chunk = &job->chunks[job->delivered % RECALL_WINDOW];
+		logday_close( chunk->ld );
+		linequeue_destroy( chunk->lines );
+	}
+}
+
+
+
+/* Stop the threads, and free the job. */
+static void job_free( World *wld )
+{
+	Recalljob *job = wld->recall_job;
+	int i;
+
+	__atomic_store_n( &job->cancel, 1, __ATOMIC_RELEASE );
+	for( i = 0; i < RECALL_MAXTHREADS; i++ )
+		sem_post( &job->work );
+	for( i = 0; i < RECALL_WINDOW; i++ )
+		sem_post( &job->chunks[i].resume );
+	for( i = 0; i < job->nthreads; i++ )
+		pthread_join( job->threads[i], NULL );
+
+	job_drop_chunks( job );
+	cursor_done( &job->cur );
+
+	if( job->notify[0] > -1 )
+	{
+		close( job->notify[0] );
+		close( job->notify[1] );
+	}
+	sem_destroy( &job->work );
+	for( i = 0; i < RECALL_WINDOW; i++ )
+		sem_destroy( &job->chunks[i].resume );
+
+	params_free( job->params );
+	free( job->params );
+	free( job );
+	wld->recall_job = NULL;
+	wld->recall_fd = -1;
+}
+
+
+
+/* A thread. Takes the queued logfiles, one at a time, and searches them.
+ * This thread must not touch anything but what the job allows. */
+static void *job_main( void *arg )
+{
+	Recalljob *job = arg;
+	Recallchunk *chunk;
+	Params params;
+	long n;
+
+	/* Our own copy of the params, for the counters and the buffer
+	 * of the stripped line. And of the regex; regexec() may lock it. */
+	params = *job->params;
+	params.strip = NULL;
+	params.stripsize = 0;
+	if( params.search_str != NULL && !params.search_literal )
+		recall_regcomp( &params );
+
+	for(;;)
+	{
+		while( sem_wait( &job->work ) == -1 )
+			continue;
+		if( __atomic_load_n( &job->cancel, __ATOMIC_ACQUIRE ) )
+			break;
+
+		n = __atomic_fetch_add( &job->taken, 1, __ATOMIC_ACQ_REL );
+		if( n >= __atomic_load_n( &job->nchunks, __ATOMIC_ACQUIRE ) )
+			break;
+
+		chunk = &job->chunks[n % RECALL_WINDOW];
+		job_search_day( job, &params, chunk );
+
+		/* Hand the chunk back, and wake up the main thread. */
+		__atomic_store_n( &chunk->done, 1, __ATOMIC_RELEASE );
+		job_notify( job );
+	}
+
+	if( params.search_str != NULL && !params.search_literal )
+		regfree( &params.search_re );
+	free( params.strip );
+	return NULL;
+}
+
+
+
+/* Search the logfile of chunk, and put the matching lines that are in the
+ * period (and older than the history) in the chunk. */
+static void job_search_day( Recalljob *job, Params *params,
+		Recallchunk *chunk )
+{
+	Logday *ld = chunk->ld;
+	Cursor cur;
+	Line line;
+	long off = -1;
+
+	params->lines_inperiod = 0;
+	params->lines_matched = 0;
+
+	/* Only cursor_log_step() looks at the cursor. */
+	cur.cands = NULL;
+	cur.ncands = 0;
+	cur.cand = 0;
+	if( params->nfind > 0 )
+		cur.cands = logindex_lookup( ld->file, params->find,
+				params->nfind, &cur.ncands );
+
+	if( ( cur.cands == NULL || cur.ncands > 0 ) && logday_load( ld ) == 0 )
+	{
+		off = logday_seek( ld, params->from );
+		if( off != -1 )
+			off = cursor_log_step( &cur, ld, off - 1 );
+	}
+
+	for( ; off != -1; off = cursor_log_step( &cur, ld, off ) )
+	{
+		if( __atomic_load_n( &job->cancel, __ATOMIC_RELAXED ) )
+			break;
+
+		logday_get( ld, off, &line );
+		if( line.time >= job->histstart || line.time > params->to )
+			break;
+
+		recall_match_one_line( params, &line, chunk->lines );
+
+		/* Don't get too far ahead of the client. */
+		if( chunk->lines->count >= RECALL_BATCH &&
+				job_wait_sent( job, chunk ) )
+			break;
+	}
+
+	chunk->inperiod = params->lines_inperiod;
+	chunk->matched = params->lines_matched;
+
+	free( cur.cands );
+	logday_close( ld );
+	chunk->ld = NULL;
+}
+
+
+
+/* Hand the lines in chunk to the main thread, and wait until it has sent
+ * them. Returns true if the recall was cancelled in the meantime. */
+static int job_wait_sent( Recalljob *job, Recallchunk *chunk )
+{
+	__atomic_store_n( &chunk->full, 1, __ATOMIC_RELEASE );
+	job_notify( job );
+
+	while( sem_wait( &chunk->resume ) == -1 )
+		continue;
+
+	return __atomic_load_n( &job->cancel, __ATOMIC_ACQUIRE );
+}
+
+
+
+/* Wake up the main thread. */
+static void job_notify( Recalljob *job )
+{
+	while( write( job->notify[1], "", 1 ) == -1 && errno == EINTR )
+		continue;
 }
@@ -25,10 +25,31 @@
 
 
 
-/* The recall command. Parse argstr, and recall lines (or print an error
- * to the user). */
+/* The recall command. Parse argstr, and start a recall (or print an error
+ * to the user). The lines are produced later, by world_recall_feed(). */
 extern void world_recall_command( World *wld, char *argstr );
 
+/* Continue a recall that paused after recall_page lines. */
+extern void world_recall_more( World *wld );
+
+/* Stop the recall, and tell the user. */
+extern void world_recall_cancel( World *wld );
+
+/* If the client has taken the lines recalled so far, recall some more, by
+ * appending them to client_toqueue (as bulk lines). Finishes the recall
+ * when it's done. */
+extern void world_recall_feed( World *wld );
+
+/* Return true if world_recall_feed() has something to do right now. */
+extern int world_recall_pending( World *wld );
+
+/* Handle the FD of a recall searching the logfiles in the background
+ * (recall_fd), which is readable when the threads found something. */
+extern void world_recall_handle_fd( World *wld );
+
+/* Stop the recall, if any, without finishing it, and free all associated
+ * resources. */
+extern void world_recall_stop( World *wld );
 
 
 #endif  /* ifndef MOOPROXY__HEADER__RECALL */
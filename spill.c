@@ -0,0 +1,606 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "global.h"
+#include "spill.h"
+#include "misc.h"
+#include "logindex.h"
+
+
+
+/* Records are padded to a multiple of this. */
+#define SPILL_ALIGN ( sizeof( long ) )
+/* The mapping of the spill file is grown in steps of this many bytes. */
+#define SPILL_MAPCHUNK ( 4 * 1024 * 1024 )
+
+/* The size of a record holding a string of len bytes. The string is
+ * followed by at least one \0. */
+#define RECORD_SIZE( len ) ( sizeof( Spillrec ) + \
+		( ( len ) + SPILL_ALIGN ) / SPILL_ALIGN * SPILL_ALIGN )
+
+/* The record at offset. */
+#define RECORD( wld, offset ) ( (Spillrec *) ( ( wld )->spill_map + \
+		( offset ) ) )
+
+
+
+/* The header of a record in the spill file. The string follows it. */
+typedef struct Spillrec Spillrec;
+struct Spillrec
+{
+	time_t time;
+	long day;
+	long len;
+	/* Size of the previous record, so we can walk backwards. */
+	long prevsize;
+	long flags;
+};
+
+
+
+static int open_spill_file( World *wld );
+static int map_spill_file( World *wld, long needed );
+static void spill_error( World *wld, char *what, int err );
+static void drop_oldest_record( World *wld );
+static void compact_spill_file( World *wld );
+static void add_index_mark( World *wld, time_t t, long offset );
+static void index_record( World *wld, Line *line );
+static long region_start( World *wld, int region );
+static long region_end( World *wld, int region );
+
+
+
+extern int world_spill_append( World *wld, Line *line, int region )
+{
+	static char padding[SPILL_ALIGN];
+	struct iovec iov[3];
+	Spillrec rec;
+	long size = RECORD_SIZE( line->len );
+	long limit = wld->spill_size * 1024;
+
+	/* Spilling is disabled, or we gave up on it. */
+	if( limit <= 0 || wld->spill_broken )
+		return 1;
+
+	/* This line doesn't fit, no matter what. */
+	if( size > limit )
+		return 1;
+
+	if( wld->spill_fd == -1 && open_spill_file( wld ) )
+		return 1;
+
+	/* Make room, by dropping the oldest records. */
+	while( wld->spill_end - wld->spill_start + size > limit )
+		drop_oldest_record( wld );
+	compact_spill_file( wld );
+
+	/* Records must stay in chronological order, so if a later region
+	 * already has records, the line goes there as well. */
+	if( wld->spill_count[SPILL_BUFFERED] > 0 )
+		region = SPILL_BUFFERED;
+	else if( wld->spill_count[SPILL_INACTIVE] > 0 &&
+			region == SPILL_HISTORY )
+		region = SPILL_INACTIVE;
+
+	rec.time = line->time;
+	rec.day = line->day;
+	rec.len = line->len;
+	rec.prevsize = wld->spill_lastsize;
+	rec.flags = line->flags;
+
+	/* The header, the string, and the \0 plus padding. */
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof( Spillrec );
+	iov[1].iov_base = line->str;
+	iov[1].iov_len = line->len;
+	iov[2].iov_base = padding;
+	iov[2].iov_len = size - sizeof( Spillrec ) - line->len;
+
+	if( writev( wld->spill_fd, iov, 3 ) != size )
+	{
+		spill_error( wld, "writing", errno );
+		return 1;
+	}
+
+	if( map_spill_file( wld, wld->spill_end + size ) )
+		return 1;
+
+	if( wld->spill_since_mark++ % SPILL_INDEX_STEP == 0 )
+		add_index_mark( wld, line->time, wld->spill_end );
+	index_record( wld, line );
+
+	/* Extend the region. The later regions are empty, so they move
+	 * along with it. */
+	wld->spill_end += size;
+	if( region <= SPILL_INACTIVE )
+		wld->spill_inactend = wld->spill_end;
+	if( region == SPILL_HISTORY )
+		wld->spill_histend = wld->spill_end;
+
+	wld->spill_lastsize = size;
+	wld->spill_count[region]++;
+
+	return 0;
+}
+
+
+
+extern void world_spill_trim( World *wld )
+{
+	long limit = wld->spill_size * 1024;
+
+	if( wld->spill_fd == -1 )
+		return;
+
+	while( wld->spill_end - wld->spill_start > limit )
+		drop_oldest_record( wld );
+	compact_spill_file( wld );
+
+	if( limit <= 0 )
+		world_spill_close( wld );
+}
+
+
+
+extern void world_spill_inactive_to_history( World *wld )
+{
+	wld->spill_histend = wld->spill_inactend;
+	wld->spill_count[SPILL_HISTORY] += wld->spill_count[SPILL_INACTIVE];
+	wld->spill_count[SPILL_INACTIVE] = 0;
+}
+
+
+
+extern void world_spill_buffered_to_inactive( World *wld )
+{
+	wld->spill_inactend = wld->spill_end;
+	wld->spill_count[SPILL_INACTIVE] += wld->spill_count[SPILL_BUFFERED];
+	wld->spill_count[SPILL_BUFFERED] = 0;
+}
+
+
+
+extern void world_spill_forget( World *wld )
+{
+	while( wld->spill_count[SPILL_HISTORY] > 0 )
+		drop_oldest_record( wld );
+
+	compact_spill_file( wld );
+}
+
+
+
+extern void world_spill_close( World *wld )
+{
+	if( wld->spill_map != NULL )
+		munmap( wld->spill_map, wld->spill_maplen );
+	if( wld->spill_fd > -1 )
+		close( wld->spill_fd );
+	if( wld->spill_file != NULL )
+		unlink( wld->spill_file );
+	free( wld->spill_file );
+	free( wld->spill_index );
+	free( wld->spill_strip );
+
+	/* Positions of the records we had are history now. */
+	wld->spill_base += wld->spill_end;
+	wld->spill_map = NULL;
+	wld->spill_maplen = 0;
+	wld->spill_fd = -1;
+	wld->spill_file = NULL;
+	wld->spill_index = NULL;
+	wld->spill_index_first = 0;
+	wld->spill_index_count = 0;
+	wld->spill_index_alloc = 0;
+	wld->spill_since_mark = 0;
+	wld->spill_strip = NULL;
+	wld->spill_stripsize = 0;
+	wld->spill_start = 0;
+	wld->spill_histend = 0;
+	wld->spill_inactend = 0;
+	wld->spill_end = 0;
+	wld->spill_lastsize = 0;
+	wld->spill_count[SPILL_HISTORY] = 0;
+	wld->spill_count[SPILL_INACTIVE] = 0;
+	wld->spill_count[SPILL_BUFFERED] = 0;
+}
+
+
+
+extern void world_spill_get( World *wld, long offset, Line *line )
+{
+	Spillrec *rec = RECORD( wld, offset );
+
+	line->str = (char *) ( rec + 1 );
+	line->next = NULL;
+	line->prev = NULL;
+	line->len = rec->len;
+	line->day = rec->day;
+	line->time = rec->time;
+	line->flags = rec->flags;
+}
+
+
+
+extern long world_spill_first( World *wld, int region )
+{
+	if( wld->spill_count[region] == 0 )
+		return -1;
+
+	return region_start( wld, region );
+}
+
+
+
+extern long world_spill_last( World *wld, int region )
+{
+	long end = region_end( wld, region );
+
+	if( wld->spill_count[region] == 0 )
+		return -1;
+
+	/* The last record of the file knows no successor to tell us its
+	 * size, so we remember that one separately. */
+	if( end == wld->spill_end )
+		return end - wld->spill_lastsize;
+
+	return end - RECORD( wld, end )->prevsize;
+}
+
+
+
+extern long world_spill_next( World *wld, long offset, int region )
+{
+	offset += RECORD_SIZE( RECORD( wld, offset )->len );
+
+	if( offset >= region_end( wld, region ) )
+		return -1;
+
+	return offset;
+}
+
+
+
+extern long world_spill_prev( World *wld, long offset, int region )
+{
+	/* Check this first; the prevsize of the oldest record is stale. */
+	if( offset <= region_start( wld, region ) )
+		return -1;
+
+	return offset - RECORD( wld, offset )->prevsize;
+}
+
+
+
+extern long world_spill_pos_first( World *wld, int region )
+{
+	return region_start( wld, region ) + wld->spill_base;
+}
+
+
+
+extern long world_spill_pos_end( World *wld, int region )
+{
+	return region_end( wld, region ) + wld->spill_base;
+}
+
+
+
+extern long world_spill_pos_next( World *wld, long offset )
+{
+	return offset + RECORD_SIZE( RECORD( wld, offset )->len ) +
+			wld->spill_base;
+}
+
+
+
+extern long world_spill_at( World *wld, long pos, long end )
+{
+	long offset = pos - wld->spill_base;
+
+	if( offset < wld->spill_start )
+		offset = wld->spill_start;
+
+	if( offset >= end - wld->spill_base || offset >= wld->spill_end )
+		return -1;
+
+	return offset;
+}
+
+
+
+extern long world_spill_seek( World *wld, time_t t, long *mark )
+{
+	long low = wld->spill_index_first, high = wld->spill_index_count;
+	long mid, offset = world_spill_first( wld, SPILL_HISTORY );
+
+	/* Find the last index mark in the history region older than t. */
+	while( low < high )
+	{
+		mid = ( low + high ) / 2;
+		if( wld->spill_index[mid].time < t &&
+				wld->spill_index[mid].offset <
+				wld->spill_histend )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if( low > wld->spill_index_first )
+		offset = wld->spill_index[low - 1].offset;
+
+	/* And scan forward from there. */
+	while( offset != -1 && RECORD( wld, offset )->time < t )
+		offset = world_spill_next( wld, offset, SPILL_HISTORY );
+
+	/* The first mark at or after the record. */
+	if( low > wld->spill_index_first )
+		low--;
+	while( offset != -1 && low < wld->spill_index_count &&
+			wld->spill_index[low].offset < offset )
+		low++;
+	*mark = low;
+
+	return offset;
+}
+
+
+
+/* Create the spill file. Any old spill file is truncated, its contents
+ * are of no use to us. Returns nonzero on failure. */
+static int open_spill_file( World *wld )
+{
+	if( wld->spill_file == NULL )
+		xasprintf( &wld->spill_file, "%s/%s/%s/%s", get_homedir(),
+				CONFIGDIR, SPILLDIR, wld->name );
+
+	wld->spill_fd = open( wld->spill_file, O_RDWR | O_CREAT | O_TRUNC |
+			O_APPEND, S_IRUSR | S_IWUSR );
+	if( wld->spill_fd < 0 )
+	{
+		spill_error( wld, "opening", errno );
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/* Make sure the mapping of the spill file covers at least the first needed
+ * bytes. Returns nonzero on failure. */
+static int map_spill_file( World *wld, long needed )
+{
+	long len;
+	char *map;
+
+	if( needed <= wld->spill_maplen )
+		return 0;
+
+	/* Grow in large steps, to keep the number of remaps down. */
+	len = ( needed + SPILL_MAPCHUNK - 1 ) / SPILL_MAPCHUNK *
+			SPILL_MAPCHUNK;
+
+	if( wld->spill_map != NULL )
+		munmap( wld->spill_map, wld->spill_maplen );
+	wld->spill_map = NULL;
+	wld->spill_maplen = 0;
+
+	map = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			wld->spill_fd, 0 );
+	if( map == MAP_FAILED )
+	{
+		spill_error( wld, "mapping", errno );
+		return 1;
+	}
+
+	wld->spill_map = map;
+	wld->spill_maplen = len;
+	return 0;
+}
+
+
+
+/* Something went wrong with the spill file. Tell the user, throw away
+ * the spill file, and stop spilling until spill_size is changed. */
+static void spill_error( World *wld, char *what, int err )
+{
+	world_msg_client( wld, "Error %s spill file %s: %s. Lines evicted "
+			"from the buffer will be dropped.", what,
+			wld->spill_file, strerror( err ) );
+
+	/* The new lines in the spill file are lost now. */
+	wld->dropped_inactive_lines += wld->spill_count[SPILL_INACTIVE];
+	wld->dropped_buffered_lines += wld->spill_count[SPILL_BUFFERED];
+
+	world_spill_close( wld );
+	wld->spill_broken = 1;
+}
+
+
+
+/* Remove the oldest record from the spill file. Dropped new lines are
+ * counted, like the ones dropped from memory. */
+static void drop_oldest_record( World *wld )
+{
+	long offset = wld->spill_start;
+
+	if( offset < wld->spill_histend )
+		wld->spill_count[SPILL_HISTORY]--;
+	else if( offset < wld->spill_inactend )
+	{
+		wld->spill_count[SPILL_INACTIVE]--;
+		wld->dropped_inactive_lines++;
+	}
+	else
+	{
+		wld->spill_count[SPILL_BUFFERED]--;
+		wld->dropped_buffered_lines++;
+	}
+
+	wld->spill_start += RECORD_SIZE( RECORD( wld, offset )->len );
+	if( wld->spill_histend < wld->spill_start )
+		wld->spill_histend = wld->spill_start;
+	if( wld->spill_inactend < wld->spill_start )
+		wld->spill_inactend = wld->spill_start;
+
+	/* Index marks of dropped records are useless now. */
+	while( wld->spill_index_first < wld->spill_index_count &&
+			wld->spill_index[wld->spill_index_first].offset <
+			wld->spill_start )
+		wld->spill_index_first++;
+}
+
+
+
+/* Dropped records leave dead space at the start of the file. Once that
+ * outweighs the live records, move the live records to the start of the
+ * file, and truncate it. */
+static void compact_spill_file( World *wld )
+{
+	long i, start = wld->spill_start;
+	long live = wld->spill_end - start;
+
+	if( start == 0 || ( live > 0 && ( start < SPILL_MAPCHUNK ||
+			start < live ) ) )
+		return;
+
+	memmove( wld->spill_map, wld->spill_map + start, live );
+	if( ftruncate( wld->spill_fd, live ) < 0 )
+	{
+		spill_error( wld, "truncating", errno );
+		return;
+	}
+
+	wld->spill_start = 0;
+	wld->spill_base += start;
+	wld->spill_histend -= start;
+	wld->spill_inactend -= start;
+	wld->spill_end -= start;
+
+	/* Shift the index marks along. */
+	wld->spill_index_count -= wld->spill_index_first;
+	memmove( wld->spill_index, wld->spill_index +
+			wld->spill_index_first, wld->spill_index_count *
+			sizeof( Spillmark ) );
+	wld->spill_index_first = 0;
+	for( i = 0; i < wld->spill_index_count; i++ )
+		wld->spill_index[i].offset -= start;
+
+	if( live == 0 )
+	{
+		wld->spill_lastsize = 0;
+		wld->spill_since_mark = 0;
+	}
+}
+
+
+
+/* Add a mark for the record at offset with time t to the time index. */
+static void add_index_mark( World *wld, time_t t, long offset )
+{
+	if( wld->spill_index_count == wld->spill_index_alloc )
+	{
+		wld->spill_index_alloc = wld->spill_index_alloc * 2 + 64;
+		wld->spill_index = xrealloc( wld->spill_index,
+				wld->spill_index_alloc * sizeof( Spillmark ) );
+	}
+
+	wld->spill_index[wld->spill_index_count].time = t;
+	wld->spill_index[wld->spill_index_count].offset = offset;
+	wld->spill_index[wld->spill_index_count].maxtime = t;
+	wld->spill_index[wld->spill_index_count].last = t;
+	wld->spill_index[wld->spill_index_count].lastrun = 0;
+	memset( wld->spill_index[wld->spill_index_count].bloom, 0,
+			SPILL_BLOOM_SIZE );
+	wld->spill_index_count++;
+}
+
+
+
+/* Add the line that was just appended to the block of the last mark of the
+ * time index. */
+static void index_record( World *wld, Line *line )
+{
+	Spillmark *mark;
+
+	/* The mark of the block was dropped already. */
+	if( wld->spill_index_first == wld->spill_index_count )
+		return;
+	mark = &wld->spill_index[wld->spill_index_count - 1];
+
+	if( wld->spill_stripsize < line->len + 1 )
+	{
+		wld->spill_stripsize = line->len + 1;
+		wld->spill_strip = xrealloc( wld->spill_strip,
+				wld->spill_stripsize );
+	}
+	strcpy_noansi( wld->spill_strip, line->str );
+	logindex_bloom_add( mark->bloom, SPILL_BLOOM_SIZE, wld->spill_strip );
+
+	if( line->time > mark->maxtime )
+		mark->maxtime = line->time;
+	if( line->time == mark->last )
+		mark->lastrun++;
+	else
+	{
+		mark->last = line->time;
+		mark->lastrun = 1;
+	}
+}
+
+
+
+/* Return the offset where region starts. */
+static long region_start( World *wld, int region )
+{
+	switch( region )
+	{
+		case SPILL_HISTORY:
+		return wld->spill_start;
+		case SPILL_INACTIVE:
+		return wld->spill_histend;
+		default:
+		return wld->spill_inactend;
+	}
+}
+
+
+
+/* Return the offset where region ends. */
+static long region_end( World *wld, int region )
+{
+	switch( region )
+	{
+		case SPILL_HISTORY:
+		return wld->spill_histend;
+		case SPILL_INACTIVE:
+		return wld->spill_inactend;
+		default:
+		return wld->spill_end;
+	}
+}
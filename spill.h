@@ -0,0 +1,95 @@
+/*
+ *
+ *  mooproxy - a smart proxy for MUD/MOO connections
+ *  Copyright 2001-2011 Marcel Moreaux
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2 dated June, 1991.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+
+
+#ifndef MOOPROXY__HEADER__SPILL
+#define MOOPROXY__HEADER__SPILL
+
+
+
+#include "world.h"
+
+
+
+/* The spill file holds lines that were evicted from the history, inactive
+ * and buffered queues because buffer_size was exceeded. The records in the
+ * file are in chronological order, and are divided into three consecutive
+ * regions, which mirror the queues they were evicted from. All records in
+ * the spill file are older than any line in the corresponding queues.
+ *
+ * Records are identified by their offset in the file. An offset of -1
+ * means "no such record". */
+
+
+
+/* Append line to the spill file, in the given region (one of SPILL_*).
+ * line is not consumed. Returns 0 if the line was spilled, nonzero if it
+ * was not (spilling is disabled, or failed), in which case the caller
+ * should consider the line dropped. */
+extern int world_spill_append( World *wld, Line *line, int region );
+
+/* Drop the oldest records until the spill file is no larger than
+ * spill_size. If spilling is disabled and the file is empty, close it. */
+extern void world_spill_trim( World *wld );
+
+/* Move all inactive records to the history region. */
+extern void world_spill_inactive_to_history( World *wld );
+
+/* Move all buffered records to the inactive region. */
+extern void world_spill_buffered_to_inactive( World *wld );
+
+/* Discard all records in the history region. */
+extern void world_spill_forget( World *wld );
+
+/* Close and remove the spill file, and free all associated resources. */
+extern void world_spill_close( World *wld );
+
+/* Fill in line with the contents of the record at offset. line->str
+ * points into the spill file and must not be freed or modified, and it
+ * is only valid until the next modification of the spill file. */
+extern void world_spill_get( World *wld, long offset, Line *line );
+
+/* Return the offset of the first/last record in region. */
+extern long world_spill_first( World *wld, int region );
+extern long world_spill_last( World *wld, int region );
+
+/* Return the offset of the record after/before offset, staying within
+ * region. */
+extern long world_spill_next( World *wld, long offset, int region );
+extern long world_spill_prev( World *wld, long offset, int region );
+
+/* Positions identify records like offsets do, but they stay valid when
+ * the spill file is compacted or reopened. Return the position of the
+ * first record of region, of the end of region, and of the record after
+ * the one at offset. */
+extern long world_spill_pos_first( World *wld, int region );
+extern long world_spill_pos_end( World *wld, int region );
+extern long world_spill_pos_next( World *wld, long offset );
+
+/* Return the offset of the record at position pos, or of the oldest record
+ * if that one has been dropped already. Returns -1 if that's not before
+ * position end. */
+extern long world_spill_at( World *wld, long pos, long end );
+
+/* Return the offset of the first history record with a time of at least
+ * t. Uses the time index to avoid scanning the entire history region. Puts
+ * the index of the first mark at or after the record in mark. */
+extern long world_spill_seek( World *wld, time_t t, long *mark );
+
+
+
+#endif  /* ifndef MOOPROXY__HEADER__SPILL */
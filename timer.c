@@ -20,9 +20,9 @@
 
 #include "world.h"
 #include "timer.h"
-#include "log.h"
 #include "misc.h"
 #include "network.h"
+#include "log.h"
 
 
 
@@ -53,9 +53,10 @@ extern void world_timer_init( World *wld, time_t t )
 
 extern void world_timer_tick( World *wld, time_t t )
 {
-	struct tm *ts;
+	struct tm tms, *ts = &tms;
 
-	ts = localtime( &t );
+	/* A copy, because the tick functions may call localtime() too. */
+	tms = *localtime( &t );
 
 	/* Seconds */
 	if( wld->timer_prev_sec != ts->tm_sec )
@@ -109,13 +110,19 @@ static void tick_second( World *wld, time_t t )
 /* Called each time a minute elapses. */
 static void tick_minute( World *wld, time_t t )
 {
-	/* Try and sync written logdata to disk. The sooner it hits the
-	 * actual disk, the better. */
-	world_sync_logdata( wld );
-
 	/* If we're connected, decrease the reconnect delay every minute. */
 	if( wld->reconnect_delay != 0 && wld->server_status == ST_CONNECTED )
 		world_decrease_reconnect_delay( wld );
+
+	/* Give back the memory of buffers that have been idle a while. */
+	world_shrink_buffers( wld );
+
+	/* See if recompressing an old logfile or compacting its index is
+	 * done. */
+	world_log_reap_tasks( wld );
+
+	/* Get the logfile of tomorrow ready, if it's nearly midnight. */
+	world_log_prepare_next( wld, t );
 }
 
 
@@ -31,6 +31,11 @@
 #include "line.h"
 #include "panic.h"
 #include "network.h"
+#include "spill.h"
+#include "logspool.h"
+#include "logtail.h"
+#include "log.h"
+#include "recall.h"
 
 
 
@@ -46,6 +51,16 @@ static World **worlds_list = NULL;
 static void register_world( World *wld );
 static void unregister_world( World *wld );
 static Line *message_client( World *wld, char *prefix, char *str );
+static void replay_spill_region( World *wld, int region );
+static void mark_bulk( Linequeue *queue, Line *after );
+static void add_history_mark( World *wld, Line *line );
+static void recall_one_line( Linequeue *queue, Line *line );
+static void drop_loggable_line( World *wld, Line *line );
+static void spool_loggable_lines( World *wld, unsigned long target );
+static int spool_from( World *wld, Linequeue *queue, Line *line );
+static unsigned long report_queue( World *wld, char *name, Linequeue *queue );
+static unsigned long report_buffer( World *wld, char *name, long used,
+		unsigned long cost );
 
 
 
@@ -104,12 +119,12 @@ extern World *world_create( char *wldname )
 	wld->reconnect_at = 0;
 
 	wld->server_rxqueue = linequeue_create();
+	wld->server_rxpartial = linequeue_create();
+	wld->intern_table = interntable_create( INTERN_TABLE_SIZE );
 	wld->server_toqueue = linequeue_create();
 	wld->server_txqueue = linequeue_create();
-	wld->server_rxbuffer = xmalloc( NET_BBUFFER_ALLOC ); /* See (1) */
-	wld->server_rxfull = 0;
-	wld->server_txbuffer = xmalloc( NET_BBUFFER_ALLOC ); /* See (1) */
-	wld->server_txfull = 0;
+	wld->server_rxbuffer = buffer_create(); /* See (1) */
+	wld->server_txbuffer = buffer_create(); /* See (1) */
 
 	/* Data related to the client connection */
 	wld->client_status = ST_DISCONNECTED;
@@ -123,20 +138,69 @@ extern World *world_create( char *wldname )
 	wld->client_last_notconnmsg = 0;
 
 	wld->client_rxqueue = linequeue_create();
+	wld->client_rxpartial = linequeue_create();
 	wld->client_toqueue = linequeue_create();
 	wld->client_txqueue = linequeue_create();
-	wld->client_rxbuffer = xmalloc( NET_BBUFFER_ALLOC ); /* See (1) */
-	wld->client_rxfull = 0;
-	wld->client_txbuffer = xmalloc( NET_BBUFFER_ALLOC ); /* See (1) */
-	wld->client_txfull = 0;
+	wld->client_bulkqueue = linequeue_create();
+	wld->client_live_deficit = 0;
+	wld->client_bulk_deficit = 0;
+	wld->client_bulk_held = 0;
+	wld->client_bulk_poll = NET_BULK_POLL;
+	wld->client_rxbuffer = buffer_create(); /* See (1) */
+	wld->client_txbuffer = buffer_create(); /* See (1) */
 
 	/* Miscellaneous */
 	wld->buffered_lines = linequeue_create();
 	wld->inactive_lines = linequeue_create();
 	wld->history_lines = linequeue_create();
+	wld->history_index = NULL;
+	wld->history_index_first = 0;
+	wld->history_index_count = 0;
+	wld->history_index_alloc = 0;
+	wld->history_since_mark = 0;
+	wld->history_index_built = 0;
+	wld->history_index_next = NULL;
+	wld->history_index_strip = NULL;
+	wld->history_index_stripsize = 0;
 	wld->dropped_inactive_lines = 0;
 	wld->dropped_buffered_lines = 0;
 	wld->easteregg_last = 0;
+	wld->recall_job = NULL;
+	wld->recall_fd = -1;
+	wld->replay_parts = 0;
+	wld->replay_after[0] = linequeue_create();
+	wld->replay_after[1] = linequeue_create();
+
+	/* Spill file */
+	wld->spill_file = NULL;
+	wld->spill_fd = -1;
+	wld->spill_broken = 0;
+	wld->spill_map = NULL;
+	wld->spill_maplen = 0;
+	wld->spill_start = 0;
+	wld->spill_histend = 0;
+	wld->spill_inactend = 0;
+	wld->spill_end = 0;
+	wld->spill_base = 0;
+	wld->spill_lastsize = 0;
+	wld->spill_count[SPILL_HISTORY] = 0;
+	wld->spill_count[SPILL_INACTIVE] = 0;
+	wld->spill_count[SPILL_BUFFERED] = 0;
+	wld->spill_index = NULL;
+	wld->spill_index_first = 0;
+	wld->spill_index_count = 0;
+	wld->spill_index_alloc = 0;
+	wld->spill_since_mark = 0;
+	wld->spill_strip = NULL;
+	wld->spill_stripsize = 0;
+
+	/* Log spool */
+	wld->logspool_file = NULL;
+	wld->logspool_fd = -1;
+	wld->logspool_broken = 0;
+	wld->logspool_start = 0;
+	wld->logspool_end = 0;
+	wld->logspool_count = 0;
 
 	/* Timer stuff */
 	wld->timer_prev_sec = -1;
@@ -154,10 +218,15 @@ extern World *world_create( char *wldname )
 	wld->log_currenttime = 0;
 	wld->log_currenttimestr = NULL;
 	wld->log_fd = -1;
-	wld->log_buffer = xmalloc( NET_BBUFFER_ALLOC ); /* See (1) */
-	wld->log_bfull = 0;
+	wld->log_buffer = buffer_create(); /* See (1) */
+	wld->log_writer = NULL;
+	wld->log_writer_fd = -1;
+	wld->log_syncwait = linequeue_create();
+	wld->log_syncs_wanted = 0;
+	wld->log_syncs_done = 0;
 	wld->log_lasterror = NULL;
 	wld->log_lasterrtime = 0;
+	wld->logtail = NULL;
 
 	/* MCP stuff */
 	wld->mcp_negotiated = 0;
@@ -179,10 +248,24 @@ extern World *world_create( char *wldname )
 	wld->newinfostring = xstrdup( DEFAULT_NEWINFOSTRING );
 	wld->newinfostring_parsed = parse_ansi_tags( wld->newinfostring );
 	wld->context_lines = DEFAULT_CONTEXTLINES;
+	wld->recall_page = DEFAULT_RECALLPAGE;
 	wld->buffer_size = DEFAULT_BUFFERSIZE;
 	wld->logbuffer_size = DEFAULT_LOGBUFFERSIZE;
+	wld->spill_size = DEFAULT_SPILLSIZE;
+	wld->netbuffer_size = DEFAULT_NETBUFFERSIZE;
+	wld->line_limit = DEFAULT_LINELIMIT;
+	wld->intern_lines = DEFAULT_INTERNLINES;
 	wld->logging = DEFAULT_LOGGING;
 	wld->log_timestamps = DEFAULT_LOGTIMESTAMPS;
+	wld->log_sync = DEFAULT_LOGSYNC;
+	wld->log_sync_interval = DEFAULT_LOGSYNCINTERVAL;
+	wld->log_sync_bytes = DEFAULT_LOGSYNCBYTES;
+	wld->log_compress = DEFAULT_LOGCOMPRESS;
+	wld->log_recompress = DEFAULT_LOGRECOMPRESS;
+	wld->log_spool_size = DEFAULT_LOGSPOOLSIZE;
+	wld->log_spool_dir = xstrdup( DEFAULT_LOGSPOOLDIR );
+	wld->log_tail = DEFAULT_LOGTAIL;
+	wld->log_tail_queue = DEFAULT_LOGTAILQUEUE;
 	wld->easteregg_version = DEFAULT_EASTEREGGS;
 
 	/* Add to the list of worlds */
@@ -192,11 +275,14 @@ extern World *world_create( char *wldname )
 
 	/* (1) comment for allocations of several buffers:
 	 * 
-	 * We allocate using NET_BBUFFER_ALLOC rather than NET_BUFFER_LEN,
+	 * The buffers allocate NET_BUFFER_SLACK bytes more than their size,
 	 * because the buffers need to be longer than their "pretend length",
 	 * so we can fit in some additional things even when the buffer is
 	 * completely full with lines.
 	 *
+	 * The buffers start out at NET_BUFFER_MINSIZE, grow on demand up to
+	 * netbuffer_size, and shrink again when idle. See buffer.h.
+	 *
 	 * Some things that we need to fit in there:
 	 *
 	 *   - For the log buffer, a \n after the last line.
@@ -257,10 +343,12 @@ extern void world_destroy( World *wld )
 		close( wld->server_connecting_fd );
 
 	linequeue_destroy( wld->server_rxqueue );
+	linequeue_destroy( wld->server_rxpartial );
+	interntable_destroy( wld->intern_table );
 	linequeue_destroy( wld->server_toqueue );
 	linequeue_destroy( wld->server_txqueue );
-	free( wld->server_rxbuffer );
-	free( wld->server_txbuffer );
+	buffer_destroy( wld->server_rxbuffer );
+	buffer_destroy( wld->server_txbuffer );
 
 	/* Data related to client connection */
 	if( wld->client_fd > -1 )
@@ -269,25 +357,41 @@ extern void world_destroy( World *wld )
 	free( wld->client_prev_address );
 
 	linequeue_destroy( wld->client_rxqueue );
+	linequeue_destroy( wld->client_rxpartial );
 	linequeue_destroy( wld->client_toqueue );
 	linequeue_destroy( wld->client_txqueue );
-	free( wld->client_rxbuffer );
-	free( wld->client_txbuffer );
+	linequeue_destroy( wld->client_bulkqueue );
+	buffer_destroy( wld->client_rxbuffer );
+	buffer_destroy( wld->client_txbuffer );
 
 	/* Miscellaneous */
+	world_recall_stop( wld );
+	linequeue_destroy( wld->replay_after[0] );
+	linequeue_destroy( wld->replay_after[1] );
 	linequeue_destroy( wld->buffered_lines );
 	linequeue_destroy( wld->inactive_lines );
 	linequeue_destroy( wld->history_lines );
+	free( wld->history_index );
+	free( wld->history_index_strip );
+
+	/* Spill file */
+	world_spill_close( wld );
 
 	/* Logging */
+	world_log_stop( wld );
+	linequeue_destroy( wld->log_syncwait );
 	linequeue_destroy( wld->log_queue );
 	linequeue_destroy( wld->log_current );
 	free( wld->log_currenttimestr );
-	if( wld->log_fd > -1 )
-		close( wld->log_fd );
-	free( wld->log_buffer );
+	buffer_destroy( wld->log_buffer );
 	free( wld->log_lasterror );
 
+	/* Log spool. Lines left in it are logged next time. */
+	world_logspool_close( wld );
+
+	/* Log tail */
+	world_logtail_close( wld );
+
 	/* MCP stuff */
 	free( wld->mcp_key );
 	free( wld->mcp_initmsg );
@@ -302,6 +406,7 @@ extern void world_destroy( World *wld )
 	free( wld->infostring_parsed );
 	free( wld->newinfostring );
 	free( wld->newinfostring_parsed );
+	free( wld->log_spool_dir );
 
 	/* The world itself */
 	free( wld );
@@ -459,67 +564,358 @@ extern void world_trim_dynamic_queues( World *wld )
 {
 	unsigned long *bll = &wld->buffered_lines->size;
 	unsigned long *ill = &wld->inactive_lines->size;
-	unsigned long *hll = &wld->history_lines->size;
 	unsigned long limit;
+	Line *line;
 
 	/* Trim the normal buffers. The data is distributed over
 	 * buffered_lines, inactive_lines and history_lines. We will trim
-	 * them in reverse order until everything is small enough. */
+	 * them in reverse order until everything is small enough.
+	 * Trimmed lines are moved to the spill file, if possible. */
 	limit = wld->buffer_size * 1024;
 
 	/* First, the history lines. Remove oldest lines. */
-	while( *bll + *ill + *hll > limit && wld->history_lines->head != NULL )
-		line_destroy( linequeue_pop( wld->history_lines ) );
+	while( world_buffer_usage( wld ) > limit &&
+			wld->history_lines->head != NULL )
+	{
+		line = linequeue_pop( wld->history_lines );
+		/* The index marks are in order, only the first can point
+		 * at this line. */
+		if( wld->history_index_first < wld->history_index_count &&
+				wld->history_index[wld->history_index_first].
+				line == line )
+			wld->history_index_first++;
+		/* The block being indexed may have gone with it. */
+		if( wld->history_index_built < wld->history_index_first )
+		{
+			wld->history_index_built = wld->history_index_first;
+			wld->history_index_next = NULL;
+		}
+		world_spill_append( wld, line, SPILL_HISTORY );
+		line_destroy( line );
+	}
 
 	/* Next, the inactive lines. These are important, so we count
 	 * the number of dropped lines. Remove oldest lines. */
 	while( *bll + *ill > limit && wld->inactive_lines->head != NULL )
 	{
-		line_destroy( linequeue_pop( wld->inactive_lines ) );
-		wld->dropped_inactive_lines++;
+		line = linequeue_pop( wld->inactive_lines );
+		if( world_spill_append( wld, line, SPILL_INACTIVE ) )
+			wld->dropped_inactive_lines++;
+		line_destroy( line );
 	}
 
 	/* Finally, the buffered lines. These are important, so we count
 	 * the number of dropped lines. Remove oldest lines. */
 	while( *bll > limit && wld->buffered_lines->head != NULL )
 	{
-		line_destroy( linequeue_pop( wld->buffered_lines ) );
-		wld->dropped_buffered_lines++;
+		line = linequeue_pop( wld->buffered_lines );
+		if( world_spill_append( wld, line, SPILL_BUFFERED ) )
+			wld->dropped_buffered_lines++;
+		line_destroy( line );
 	}
 
+	/* The spill file has a limit of its own. */
+	world_spill_trim( wld );
+
 	/* Trim the logbuffers. The data is distributed over log_current and
 	 * log_queue. We will trim them in reverse order until everything is
-	 * small enough. */
+	 * small enough. The lines evicted above may have passed the cost of
+	 * their strings on to the loggable lines, so this comes after. */
 	limit = wld->logbuffer_size * 1024;
 
-	/* First log_queue. These are very important, so we count the number
-	 * of dropped lines. Remove newest lines. */
-	while( wld->log_queue->size + wld->log_current->size > limit &&
+	/* If the log can't keep up, move the newest lines to the log spool,
+	 * making room for at least half of logbuffer_size. From then on,
+	 * new lines go to the spool directly, until it's empty again. */
+	if( world_logbuffer_usage( wld ) > limit && wld->logspool_count == 0 )
+		spool_loggable_lines( wld, limit / 2 );
+
+	/* If that's not possible, drop lines. First log_queue. These are
+	 * very important, so we count the number of dropped lines. Remove
+	 * newest lines. */
+	while( world_logbuffer_usage( wld ) > limit &&
 			wld->log_queue->head != NULL )
 	{
-		line_destroy( linequeue_popend( wld->log_queue ) );
+		drop_loggable_line( wld, linequeue_popend( wld->log_queue ) );
 		wld->dropped_loggable_lines++;
 	}
 
 	/* Next, log_current. These are very important, so we count the number
 	 * of dropped lines. Remove newest lines. */
-	while( wld->log_current->size > limit &&
+	while( world_logbuffer_usage( wld ) > limit &&
 			wld->log_current->head != NULL )
 	{
-		line_destroy( linequeue_popend( wld->log_current ) );
+		drop_loggable_line( wld, linequeue_popend( wld->log_current ) );
 		wld->dropped_loggable_lines++;
 	}
 }
 
 
 
+/* Destroy a loggable line that is dropped because logbuffer_size was
+ * exceeded. If the client is held until the line has been synced to disk,
+ * it should not wait for this line anymore. */
+static void drop_loggable_line( World *wld, Line *line )
+{
+	if( line->flags & LINE_SYNC )
+		wld->log_syncs_done++;
+	line_destroy( line );
+}
+
+
+
+/* Move the newest loggable lines to the log spool, until the loggable
+ * lines in memory take no more than target bytes. The lines must go to the
+ * spool in chronological order, so first find the oldest line that has to
+ * go, and then spool it and everything after it. */
+static void spool_loggable_lines( World *wld, unsigned long target )
+{
+	unsigned long usage = world_logbuffer_usage( wld );
+	Linequeue *queue = wld->log_queue, *firstqueue = NULL;
+	Line *line = queue->tail, *first = NULL;
+
+	/* log_queue holds the newest lines, log_current the ones before. */
+	while( usage > target )
+	{
+		if( line == NULL && queue == wld->log_current )
+			break;
+		if( line == NULL )
+		{
+			queue = wld->log_current;
+			line = queue->tail;
+			continue;
+		}
+
+		usage -= line_cost( line );
+		first = line;
+		firstqueue = queue;
+		line = line->prev;
+	}
+
+	if( first == NULL )
+		return;
+
+	/* If spooling fails halfway, the lines already in the spool end up
+	 * in the logfile after the ones that stayed in memory. Out of order,
+	 * but not lost. */
+	if( spool_from( wld, firstqueue, first ) )
+		return;
+	if( firstqueue == wld->log_current )
+		spool_from( wld, wld->log_queue, wld->log_queue->head );
+}
+
+
+
+/* Move line and all lines after it in queue to the log spool. Returns
+ * nonzero if spooling failed, in which case the remaining lines stay. */
+static int spool_from( World *wld, Linequeue *queue, Line *line )
+{
+	Line *next;
+
+	for( ; line != NULL; line = next )
+	{
+		next = line->next;
+		if( world_logspool_append( wld, line ) )
+			return 1;
+		line_destroy( linequeue_remove( queue, line ) );
+	}
+
+	return 0;
+}
+
+
+
+extern unsigned long world_buffer_usage( World *wld )
+{
+	return wld->buffered_lines->size + wld->inactive_lines->size +
+			wld->history_lines->size;
+}
+
+
+
+extern unsigned long world_logbuffer_usage( World *wld )
+{
+	return wld->log_queue->size + wld->log_current->size +
+			world_log_unwritten( wld );
+}
+
+
+
+extern void world_shrink_buffers( World *wld )
+{
+	buffer_shrink( wld->server_rxbuffer, NET_BUFFER_IDLE );
+	buffer_shrink( wld->server_txbuffer, NET_BUFFER_IDLE );
+	buffer_shrink( wld->client_rxbuffer, NET_BUFFER_IDLE );
+	buffer_shrink( wld->client_txbuffer, NET_BUFFER_IDLE );
+	buffer_shrink( wld->log_buffer, NET_BUFFER_IDLE );
+	world_logtail_shrink( wld );
+}
+
+
+
+extern void world_memory_report( World *wld )
+{
+	unsigned long lines = 0, buffers = 0, other = 0, used, limit, cost;
+	struct { char *name; Linequeue *queue; } queues[] = {
+		{ "buffered (new)", wld->buffered_lines },
+		{ "inactive (possibly new)", wld->inactive_lines },
+		{ "history", wld->history_lines },
+		{ "log queue", wld->log_queue },
+		{ "log current day", wld->log_current },
+		{ "held for log sync", wld->log_syncwait },
+		{ "server receive", wld->server_rxqueue },
+		{ "server partial line", wld->server_rxpartial },
+		{ "server to client", wld->server_toqueue },
+		{ "server transmit", wld->server_txqueue },
+		{ "client receive", wld->client_rxqueue },
+		{ "client partial line", wld->client_rxpartial },
+		{ "client to server", wld->client_toqueue },
+		{ "client transmit", wld->client_txqueue },
+		{ "client transmit (bulk)", wld->client_bulkqueue },
+		{ "waiting for spill (1)", wld->replay_after[0] },
+		{ "waiting for spill (2)", wld->replay_after[1] }
+	};
+	int i;
+
+	world_msg_client( wld, "Estimated memory usage of world %s "
+			"(including allocator overhead):", wld->name );
+	world_msg_client( wld, "" );
+
+	/* The line queues. The queue objects themselves count as other. */
+	world_msg_client( wld, "  %-22s %10s %12s", "Queue", "Lines", "KiB" );
+	for( i = 0; i < sizeof( queues ) / sizeof( queues[0] ); i++ )
+	{
+		lines += report_queue( wld, queues[i].name, queues[i].queue );
+		other += malloc_cost( sizeof( Linequeue ) );
+	}
+	world_msg_client( wld, "" );
+
+	/* The buffers. */
+	world_msg_client( wld, "  %-22s %10s %12s", "Buffer", "Used KiB",
+			"Alloc KiB" );
+	buffers += report_buffer( wld, "server receive",
+			wld->server_rxbuffer->full,
+			buffer_cost( wld->server_rxbuffer ) );
+	buffers += report_buffer( wld, "server transmit",
+			wld->server_txbuffer->full,
+			buffer_cost( wld->server_txbuffer ) );
+	buffers += report_buffer( wld, "client receive",
+			wld->client_rxbuffer->full,
+			buffer_cost( wld->client_rxbuffer ) );
+	buffers += report_buffer( wld, "client transmit",
+			wld->client_txbuffer->full,
+			buffer_cost( wld->client_txbuffer ) );
+	buffers += report_buffer( wld, "log", world_log_unwritten( wld ),
+			buffer_cost( wld->log_buffer ) +
+			world_log_writer_cost( wld ) );
+	cost = world_logtail_cost( wld, &used );
+	if( cost > 0 )
+		buffers += report_buffer( wld, "log tail (all)", used, cost );
+	for( i = 0, used = 0; i < NET_MAXAUTHCONN; i++ )
+		used += wld->auth_read[i];
+	buffers += report_buffer( wld, "authentication (all)", used,
+			NET_MAXAUTHCONN * malloc_cost( NET_MAXAUTHLEN ) );
+	world_msg_client( wld, "" );
+
+	/* Everything else we know about: the world itself, the history
+	 * index, the privileged addresses, the interning table, and so on.
+	 * The buffer objects are included in the buffers. */
+	other += malloc_cost( sizeof( World ) ) + malloc_cost(
+			wld->history_index_alloc * sizeof( Histmark ) ) +
+			malloc_cost( wld->history_index_stripsize ) +
+			malloc_cost( sizeof( Linequeue ) ) +
+			wld->auth_privaddrs->size +
+			malloc_cost( sizeof( Interntable ) ) + malloc_cost(
+			wld->intern_table->size * sizeof( Sharedstr * ) );
+
+	if( wld->intern_table->hits > 0 )
+	{
+		world_msg_client( wld, "  Shared text: %lu lines from the "
+				"server were identical to a recent line.",
+				wld->intern_table->hits );
+		world_msg_client( wld, "" );
+	}
+
+	/* The spill file is on disk, but its time index is not. */
+	if( wld->spill_fd > -1 )
+	{
+		world_msg_client( wld, "  Spill file: %lu history, %lu "
+				"possibly new, %lu certainly new lines, "
+				"%.1f KiB on disk.",
+				wld->spill_count[SPILL_HISTORY],
+				wld->spill_count[SPILL_INACTIVE],
+				wld->spill_count[SPILL_BUFFERED],
+				( wld->spill_end - wld->spill_start ) /
+				1024.0 );
+		world_msg_client( wld, "" );
+		other += malloc_cost( wld->spill_index_alloc *
+				sizeof( Spillmark ) ) +
+				malloc_cost( wld->spill_stripsize );
+	}
+
+	/* The log spool is on disk entirely. */
+	if( wld->logspool_count > 0 )
+	{
+		world_msg_client( wld, "  Log spool: %lu unlogged lines, "
+				"%.1f KiB on disk.", wld->logspool_count,
+				( wld->logspool_end - wld->logspool_start ) /
+				1024.0 );
+		world_msg_client( wld, "" );
+	}
+
+	world_msg_client( wld, "  Total: %.1f KiB (lines %.1f KiB, buffers "
+			"%.1f KiB, other %.1f KiB).", ( lines + buffers +
+			other ) / 1024.0, lines / 1024.0, buffers / 1024.0,
+			other / 1024.0 );
+
+	/* And how that relates to the configured limits. */
+	used = world_buffer_usage( wld );
+	limit = wld->buffer_size * 1024;
+	world_msg_client( wld, "  buffer_size: %.1f of %lu KiB used (%.1f%%).",
+			used / 1024.0, limit / 1024, ( limit > 0 ) ?
+			used * 100.0 / limit : 0.0 );
+	used = world_logbuffer_usage( wld );
+	limit = wld->logbuffer_size * 1024;
+	world_msg_client( wld, "  logbuffer_size: %.1f of %lu KiB used "
+			"(%.1f%%).", used / 1024.0, limit / 1024,
+			( limit > 0 ) ? used * 100.0 / limit : 0.0 );
+}
+
+
+
+/* Report one line queue for world_memory_report(). Returns its size. */
+static unsigned long report_queue( World *wld, char *name, Linequeue *queue )
+{
+	world_msg_client( wld, "  %-22s %10lu %12.1f", name, queue->count,
+			queue->size / 1024.0 );
+
+	return queue->size;
+}
+
+
+
+/* Report one buffer for world_memory_report(). used is the number of bytes
+ * in use, cost the estimated memory cost of the buffer. Returns cost. */
+static unsigned long report_buffer( World *wld, char *name, long used,
+		unsigned long cost )
+{
+	world_msg_client( wld, "  %-22s %10.1f %12.1f", name, used / 1024.0,
+			cost / 1024.0 );
+
+	return cost;
+}
+
+
+
 extern void world_recall_and_pass( World *wld )
 {
 	Linequeue *il = wld->inactive_lines;
 	Linequeue *bl = wld->buffered_lines;
 	Linequeue *queue;
 	Line *line, *recalled;
-	int nocontext = 0, noposnew = 0, nocernew = 0;
+	unsigned long sil = wld->spill_count[SPILL_INACTIVE];
+	unsigned long sbl = wld->spill_count[SPILL_BUFFERED];
+	Line *mark = wld->client_toqueue->tail, *split[2];
+	int nocontext = 0, noposnew = 0, nocernew = 0, i;
 
 	if( wld->context_lines > 0 )
 	{
@@ -545,18 +941,24 @@ extern void world_recall_and_pass( World *wld )
 	}
 
 	/* Possibly new lines. */
-	if( il->count > 0 )
+	if( il->count + sil > 0 )
 	{
 		/* Inform the user about them. */
 		world_newmsg_client( wld, "%s%lu possibly new line%s "
-			"(%.1f%% of buffer).",
+			"(%.1f%% of buffer%s).",
 			( nocontext == 0 ) ? "" : "No context lines. ",
-			il->count, ( il->count == 1 ) ? "" : "s",
-			il->size / 10.24 / wld->buffer_size );
+			il->count + sil, ( il->count + sil == 1 ) ? "" : "s",
+			il->size / 10.24 / wld->buffer_size,
+			( sil > 0 ) ? ", rest from spill file" : "" );
 
 		/* If nocontext was 1, we reported on it now. Clear it. */
 		nocontext = 0;
 
+		/* The spilled ones are older, pass those first. */
+		if( sil > 0 )
+			split[wld->replay_parts] = wld->client_toqueue->tail;
+		replay_spill_region( wld, SPILL_INACTIVE );
+
 		/* Pass the lines. These are already in the history path, so
 		 * they need to be duplicated and be NOHISTed. */
 		line = wld->inactive_lines->head;
@@ -573,24 +975,43 @@ extern void world_recall_and_pass( World *wld )
 		noposnew = 1;
 
 	/* Certainly new lines. */
-	if( bl->count > 0 )
+	if( bl->count + sbl > 0 )
 	{
 		/* Inform the user about them. */
 		world_newmsg_client( wld, "%s%s%lu certainly new line%s "
-			"(%.1f%% of buffer).",
+			"(%.1f%% of buffer%s).",
 			( nocontext == 0 ) ? "" : "No context lines. ",
 			( noposnew == 0 ) ? "" : "No possibly new lines. ",
-			bl->count, ( bl->count == 1 ) ? "" : "s",
-			bl->size / 10.24 / wld->buffer_size );
+			bl->count + sbl, ( bl->count + sbl == 1 ) ? "" : "s",
+			bl->size / 10.24 / wld->buffer_size,
+			( sbl > 0 ) ? ", rest from spill file" : "" );
 
 		/* If nocontext/noposnew were 1, we reported. Clear them. */
 		nocontext = 0;
 		noposnew = 0;
 
-		/* Pass the lines. Since these are just waiting to be passed
-		 * to a client, and never have been in history, they don't
-		 * need to be fiddled with and can be passed in one go. */
-		linequeue_merge( wld->client_toqueue, wld->buffered_lines );
+		/* The spilled ones are older, pass those first. They stay
+		 * in the spill file, where they are now possibly new. */
+		if( sbl > 0 )
+			split[wld->replay_parts] = wld->client_toqueue->tail;
+		replay_spill_region( wld, SPILL_BUFFERED );
+		world_spill_buffered_to_inactive( wld );
+
+		/* Pass copies of the lines, like the possibly new ones, as
+		 * the lines from the server may overtake them. The lines
+		 * themselves are possibly new now, and join the inactive
+		 * lines right away, so they stay in order. */
+		for( line = bl->head; line != NULL; line = line->next )
+		{
+			recalled = line_dup( line );
+			recalled->flags = LINE_RECALLED;
+			linequeue_append( wld->client_toqueue, recalled );
+		}
+		while( ( line = linequeue_pop( bl ) ) != NULL )
+			if( line->flags & LINE_NOHIST )
+				line_destroy( line );
+			else
+				linequeue_append( il, line );
 	}
 	else
 		/* Flag no possibly new lines for later reporting. */
@@ -625,6 +1046,138 @@ extern void world_recall_and_pass( World *wld )
 			( wld->dropped_buffered_lines == 1 ) ? "has" : "have" );
 		wld->dropped_buffered_lines = 0;
 	}
+
+	/* All of it may be overtaken by the lines from the server, so those
+	 * don't wait for the replay. */
+	mark_bulk( wld->client_toqueue, mark );
+
+	/* The lines after a part of the spill file wait for it, the last
+	 * part first. */
+	for( i = wld->replay_parts - 1; i >= 0; i-- )
+		while( ( line = split[i] ? split[i]->next :
+				wld->client_toqueue->head ) != NULL )
+			linequeue_append( wld->replay_after[i],
+					linequeue_remove( wld->client_toqueue,
+					line ) );
+}
+
+
+
+extern void world_replay_feed( World *wld )
+{
+	Line spilled, *recalled;
+	long offset, budget = SPILL_REPLAY_BATCH;
+
+	if( !world_replay_pending( wld ) )
+		return;
+
+	while( budget > 0 && wld->replay_parts > 0 )
+	{
+		offset = world_spill_at( wld, wld->replay_pos[0],
+				wld->replay_end[0] );
+
+		/* This part is done, the lines after it can go as well. */
+		if( offset == -1 )
+		{
+			linequeue_merge( wld->client_toqueue,
+					wld->replay_after[0] );
+			linequeue_merge( wld->replay_after[0],
+					wld->replay_after[1] );
+			wld->replay_pos[0] = wld->replay_pos[1];
+			wld->replay_end[0] = wld->replay_end[1];
+			wld->replay_parts--;
+			continue;
+		}
+
+		world_spill_get( wld, offset, &spilled );
+		recalled = line_create( xstrdup( spilled.str ), spilled.len );
+		recalled->flags = LINE_RECALLED | LINE_BULK;
+		recalled->time = spilled.time;
+		recalled->day = spilled.day;
+		linequeue_append( wld->client_toqueue, recalled );
+
+		wld->replay_pos[0] = world_spill_pos_next( wld, offset );
+		budget--;
+	}
+}
+
+
+
+extern int world_replay_pending( World *wld )
+{
+	return wld->replay_parts > 0 && wld->client_status == ST_CONNECTED &&
+			wld->client_bulkqueue->count == 0;
+}
+
+
+
+extern void world_replay_stop( World *wld )
+{
+	linequeue_merge( wld->client_toqueue, wld->replay_after[0] );
+	linequeue_merge( wld->client_toqueue, wld->replay_after[1] );
+	wld->replay_parts = 0;
+}
+
+
+
+/* Have the lines in the given region of the spill file passed to the
+ * client, as the next part of the replay (see world_replay_feed()). They
+ * are copied a batch at a time, once the client has taken the previous
+ * batch, so the memory stays bounded, however much was spilled. */
+static void replay_spill_region( World *wld, int region )
+{
+	if( wld->spill_count[region] == 0 )
+		return;
+
+	wld->replay_pos[wld->replay_parts] = world_spill_pos_first( wld,
+			region );
+	wld->replay_end[wld->replay_parts] = world_spill_pos_end( wld,
+			region );
+	wld->replay_parts++;
+}
+
+
+
+/* Flag the lines in queue after the line after (or all lines, if after is
+ * NULL) as bulk. */
+static void mark_bulk( Linequeue *queue, Line *after )
+{
+	Line *line;
+
+	for( line = after ? after->next : queue->head; line; line = line->next )
+		line->flags |= LINE_BULK;
+}
+
+
+
+/* Add line to the time index of the history. If the index is full, and at
+ * least half of it are marks of lines that left the memory, make room by
+ * dropping those instead of growing it. */
+static void add_history_mark( World *wld, Line *line )
+{
+	if( wld->history_index_count == wld->history_index_alloc &&
+			wld->history_index_first > 0 &&
+			wld->history_index_first >=
+			wld->history_index_count / 2 )
+	{
+		wld->history_index_count -= wld->history_index_first;
+		wld->history_index_built -= wld->history_index_first;
+		memmove( wld->history_index, wld->history_index +
+				wld->history_index_first,
+				wld->history_index_count * sizeof( Histmark ) );
+		wld->history_index_first = 0;
+	}
+
+	if( wld->history_index_count == wld->history_index_alloc )
+	{
+		wld->history_index_alloc = wld->history_index_alloc * 2 + 64;
+		wld->history_index = xrealloc( wld->history_index,
+				wld->history_index_alloc * sizeof( Histmark ) );
+	}
+
+	wld->history_index[wld->history_index_count].time = line->time;
+	wld->history_index[wld->history_index_count].line = line;
+	wld->history_index_count++;
 }
 
 
@@ -668,7 +1221,115 @@ extern void world_login_server( World *wld, int override )
 
 extern void world_inactive_to_history( World *wld )
 {
+	Line *line;
+
+	/* Index the lines joining the history. */
+	for( line = wld->inactive_lines->head; line; line = line->next )
+		if( wld->history_since_mark++ % HISTORY_INDEX_STEP == 0 )
+			add_history_mark( wld, line );
+
 	linequeue_merge( wld->history_lines, wld->inactive_lines );
+	world_spill_inactive_to_history( wld );
+}
+
+
+
+extern void world_history_forget( World *wld )
+{
+	linequeue_clear( wld->history_lines );
+	wld->history_index_first = 0;
+	wld->history_index_count = 0;
+	wld->history_since_mark = 0;
+	wld->history_index_built = 0;
+	wld->history_index_next = NULL;
+}
+
+
+
+extern Line *world_history_seek( World *wld, time_t t, long *mark )
+{
+	long low = wld->history_index_first, high = wld->history_index_count;
+	long mid;
+	Line *line = wld->history_lines->head;
+
+	/* Find the last index mark older than t. */
+	while( low < high )
+	{
+		mid = ( low + high ) / 2;
+		if( wld->history_index[mid].time < t )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if( low > wld->history_index_first )
+		line = wld->history_index[low - 1].line;
+
+	/* And scan forward from there. The next mark isn't older than t, so
+	 * it's not before the line we end up at. */
+	while( line != NULL && line->time < t )
+		line = line->next;
+
+	if( mark != NULL )
+		*mark = low;
+
+	return line;
+}
+
+
+
+extern void world_history_index( World *wld )
+{
+	long budget = HISTORY_BLOOM_BUDGET, len;
+	Histmark *mark;
+	Line *line;
+
+	/* Only a mark followed by another one has a complete block. */
+	while( budget > 0 && wld->history_index_built + 1 <
+			wld->history_index_count )
+	{
+		mark = &wld->history_index[wld->history_index_built];
+
+		line = wld->history_index_next;
+		if( line == NULL )
+		{
+			memset( mark->bloom, 0, HISTORY_BLOOM_SIZE );
+			mark->maxtime = mark->time;
+			line = mark->line;
+		}
+
+		for( ; line != mark[1].line && budget > 0; line = line->next )
+		{
+			if( wld->history_index_stripsize < line->len + 1 )
+			{
+				wld->history_index_stripsize = line->len + 1;
+				wld->history_index_strip = xrealloc(
+						wld->history_index_strip,
+						wld->history_index_stripsize );
+			}
+			len = strcpy_noansi( wld->history_index_strip,
+					line->str );
+			bloom_add_trigrams( mark->bloom,
+					wld->history_index_strip, len );
+
+			if( line->time > mark->maxtime )
+				mark->maxtime = line->time;
+			budget -= line->len + 1;
+		}
+
+		/* Done with this block, or with this turn. */
+		wld->history_index_next = NULL;
+		if( line == mark[1].line )
+			wld->history_index_built++;
+		else
+			wld->history_index_next = line;
+	}
+}
+
+
+
+extern int world_history_index_pending( World *wld )
+{
+	return wld->history_index_built + 1 < wld->history_index_count;
 }
 
 
@@ -676,44 +1337,46 @@ extern void world_inactive_to_history( World *wld )
 extern Linequeue *world_recall_history( World *wld, long count )
 {
 	Linequeue *queue;
-	Line *line, *recalled;
-	char *str;
-	long len;
+	Line *line, spilled;
+	long offset, prev;
 
 	/* Create our queue. */
 	queue = linequeue_create();
 
-	/* If we have no lines or count <= 0, return the empty queue. */
-	line = wld->history_lines->tail;
-	if( line == NULL || count < 1 )
+	/* If count <= 0, return the empty queue. */
+	if( count < 1 )
 		return queue;
 
 	/* Seek back from the end of the history, to the first line we 
 	 * should display. */
-	for( ; line->prev != NULL && count > 1; count-- )
+	line = wld->history_lines->tail;
+	for( ; line != NULL && line->prev != NULL && count > 1; count-- )
 		line = line->prev;
+	if( line != NULL )
+		count--;
+
+	/* If the history in memory didn't have enough lines, continue
+	 * seeking back in the spill file. */
+	offset = -1;
+	if( count > 0 )
+		offset = world_spill_last( wld, SPILL_HISTORY );
+	for( ; offset != -1 && count > 1; count-- )
+	{
+		prev = world_spill_prev( wld, offset, SPILL_HISTORY );
+		if( prev == -1 )
+			break;
+		offset = prev;
+	}
 
-	/* Copy the lines to our local queue. */
-	while( line != NULL )
+	/* Copy the lines to our local queue, oldest (spilled) first. */
+	for( ; offset != -1; offset = world_spill_next( wld, offset,
+			SPILL_HISTORY ) )
 	{
-		/* Copy the string, without ASCII BELLs. */
-		str = xmalloc( line->len + 1 );
-		len = strcpy_nobell( str, line->str );
-
-		/* Resize it, if necessary. */
-		if( len != line->len )
-			str = xrealloc( str, len + 1 );
-
-		/* Make it into a proper line object... */
-		recalled = line_create( str, len );
-		recalled->flags = LINE_RECALLED;
-		recalled->time = line->time;
-		recalled->day = line->day;
-
-		/* And put it in our queue. */
-		linequeue_append( queue, recalled );
-		line = line->next;
+		world_spill_get( wld, offset, &spilled );
+		recall_one_line( queue, &spilled );
 	}
+	for( ; line != NULL; line = line->next )
+		recall_one_line( queue, line );
 
 	/* All done, return the queue. */
 	return queue;
@@ -721,6 +1384,33 @@ extern Linequeue *world_recall_history( World *wld, long count )
 
 
 
+/* Append a copy of line to queue, for world_recall_history(). */
+static void recall_one_line( Linequeue *queue, Line *line )
+{
+	Line *recalled;
+	char *str;
+	long len;
+
+	/* Copy the string, without ASCII BELLs. */
+	str = xmalloc( line->len + 1 );
+	len = strcpy_nobell( str, line->str );
+
+	/* Resize it, if necessary. */
+	if( len != line->len )
+		str = xrealloc( str, len + 1 );
+
+	/* Make it into a proper line object... */
+	recalled = line_create( str, len );
+	recalled->flags = LINE_RECALLED;
+	recalled->time = line->time;
+	recalled->day = line->day;
+
+	/* And put it in our queue. */
+	linequeue_append( queue, recalled );
+}
+
+
+
 extern void world_rebind_port( World *wld )
 {
 	BindResult *result = wld->bindresult;
@@ -882,15 +1572,16 @@ extern int world_enable_ace( World *wld )
 	free( status );
 
 	/* We fail if the string doesn't fit into the buffer. */
-	if( wld->client_txfull + strlen( tmp ) > NET_BBUFFER_ALLOC )
+	if( buffer_reserve( wld->client_txbuffer, strlen( tmp ),
+			wld->netbuffer_size * 1024 ) < strlen( tmp ) )
 	{
 		free( tmp );
 		return 0;
 	}
 
 	/* Append the string to the buffer. */
-	strcpy( wld->client_txbuffer + wld->client_txfull, tmp );
-	wld->client_txfull += strlen( tmp );
+	strcpy( wld->client_txbuffer->data + wld->client_txbuffer->full, tmp );
+	wld->client_txbuffer->full += strlen( tmp );
 	free( tmp );
 
 	/* Construct the string that will be prepended to each line:
@@ -920,6 +1611,7 @@ extern int world_enable_ace( World *wld )
 
 	/* Recall enough lines to fill the "output window". */
 	queue = world_recall_history( wld, rows - 4 );
+	mark_bulk( queue, NULL );
 	linequeue_merge( wld->client_toqueue, queue );
 	linequeue_destroy( queue );
 
@@ -930,14 +1622,18 @@ extern int world_enable_ace( World *wld )
 
 extern void world_disable_ace( World *wld )
 {
+	Buffer *buf;
+
 	/* Send "reset terminal" to the client, so the clients terminal is
 	 * not left in a messed up state.
 	 * ACE deactivation should always succeed, so if the ansi sequence
 	 * doesn't fit in the buffer, we'll still do all the other stuff. */
-	if( wld->client_txfull + 2 < NET_BBUFFER_ALLOC )
+	if( buffer_reserve( wld->client_txbuffer, 2,
+			wld->netbuffer_size * 1024 ) >= 2 )
 	{
-		wld->client_txbuffer[wld->client_txfull++] = '\x1B';
-		wld->client_txbuffer[wld->client_txfull++] = 'c';
+		buf = wld->client_txbuffer;
+		buf->data[buf->full++] = '\x1B';
+		buf->data[buf->full++] = 'c';
 	}
 
 	free( wld->ace_prestr );
@@ -1011,15 +1707,16 @@ extern void world_easteregg_server( World *wld, Line *line )
 
 extern int world_start_shutdown( World *wld, int force, int fromsig )
 {
+	long unwritten = world_log_unwritten( wld );
 	Line *line;
 
 	/* Unlogged data? Refuse if not forced. */
 	if( !force && wld->log_queue->size + wld->log_current->size +
-			wld->log_bfull > 0 )
+			unwritten > 0 )
 	{
 		long unlogged_lines = 1 + wld->log_queue->count +
-				wld->log_current->count + wld->log_bfull / 80;
-		long unlogged_kib = ( wld->log_bfull + wld->log_queue->size +
+				wld->log_current->count + unwritten / 80;
+		long unlogged_kib = ( unwritten + wld->log_queue->size +
 				wld->log_current->size + 512 ) / 1024;
 		world_msg_client( wld, "There are approximately %li lines "
 				"(%liKiB) not yet logged to disk. ",
@@ -1034,6 +1731,12 @@ extern int world_start_shutdown( World *wld, int force, int fromsig )
 	if( wld->ace_enabled )
 		world_disable_ace( wld );
 
+	/* Lines in the log spool are safe on disk, they're not lost. */
+	if( wld->logspool_count > 0 )
+		world_msg_client( wld, "%lu lines in the log spool will be "
+				"logged when mooproxy starts again.",
+				wld->logspool_count );
+
 	/* We're good, proceed. */
 	line = world_msg_client( wld, "Shutting down%s (reason: %s).",
 			force ? " forcibly" : "",
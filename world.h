@@ -26,9 +26,19 @@
 
 #include "global.h"
 #include "line.h"
+#include "buffer.h"
 
 
 
+/* The log writer thread. Opaque, see log.c. */
+typedef struct Logwriter Logwriter;
+
+/* The log tail socket and its subscribers. Opaque, see logtail.c. */
+typedef struct Logtail Logtail;
+
+/* A recall running in the background. Opaque, see recall.c. */
+typedef struct Recalljob Recalljob;
+
 /* World flags */
 #define WLD_ACTIVATED		0x00000001
 #define WLD_NOTCONNECTED	0x00000002
@@ -40,6 +50,7 @@
 #define WLD_LOGLINKUPDATE	0x00000080
 #define WLD_REBINDPORT		0x00000100
 #define WLD_SHUTDOWN		0x00000200
+#define WLD_LOGTAILUPDATE	0x00000400
 
 /* Server/client statuses */
 #define ST_DISCONNECTED		0x01
@@ -48,6 +59,17 @@
 #define ST_CONNECTED		0x04
 #define ST_RECONNECTWAIT	0x05
 
+/* Log sync policies */
+#define LOG_SYNC_NONE		0
+#define LOG_SYNC_INTERVAL	1
+#define LOG_SYNC_BYTES		2
+#define LOG_SYNC_GROUP		3
+
+/* Spill file regions */
+#define SPILL_HISTORY		0
+#define SPILL_INACTIVE		1
+#define SPILL_BUFFERED		2
+
 /* Authentication connection statuses */
 #define AUTH_ST_WAITNET		0x01
 #define AUTH_ST_VERIFY		0x02
@@ -79,6 +101,38 @@ struct BindResult
 
 
 
+/* Spillmark struct. An entry in the time index of the spill file. For the
+ * block of records up to the next mark, bloom holds the words in them (see
+ * logindex_bloom_add()), and maxtime the newest time among them. The last
+ * lastrun records of the block have time last. */
+typedef struct Spillmark Spillmark;
+struct Spillmark
+{
+	time_t time;
+	long offset;
+	time_t maxtime;
+	time_t last;
+	long lastrun;
+	unsigned char bloom[SPILL_BLOOM_SIZE];
+};
+
+
+
+/* Histmark struct. An entry in the time index of the history lines in
+ * memory. Once the block of lines up to the next mark has been indexed,
+ * bloom holds the trigrams in them (see bloom_add_trigrams()), and maxtime
+ * the newest time among them. */
+typedef struct Histmark Histmark;
+struct Histmark
+{
+	time_t time;
+	Line *line;
+	time_t maxtime;
+	unsigned char bloom[HISTORY_BLOOM_SIZE];
+};
+
+
+
 /* The World struct. Contains all configuration and state information for a
  * world. */
 typedef struct World World;
@@ -131,12 +185,12 @@ struct World
 	time_t reconnect_at;
 
 	Linequeue *server_rxqueue;
+	Linequeue *server_rxpartial;
+	Interntable *intern_table;
 	Linequeue *server_toqueue;
 	Linequeue *server_txqueue;
-	char *server_rxbuffer;
-	long server_rxfull;
-	char *server_txbuffer;
-	long server_txfull;
+	Buffer *server_rxbuffer;
+	Buffer *server_txbuffer;
 
 	/* Data related to the client connection */
 	int client_status;
@@ -151,20 +205,81 @@ struct World
 	time_t client_last_notconnmsg;
 
 	Linequeue *client_rxqueue;
+	Linequeue *client_rxpartial;
 	Linequeue *client_toqueue;
 	Linequeue *client_txqueue;
-	char *client_rxbuffer;
-	long client_rxfull;
-	char *client_txbuffer;
-	long client_txfull;
+	/* Bulk lines waiting for the client, the deficits of the live and
+	 * the bulk lines, whether the bulk lines are held back until the
+	 * client has read more (see world_flush_client_txbuf()), and when to
+	 * look at them again (in microseconds). */
+	Linequeue *client_bulkqueue;
+	long client_live_deficit;
+	long client_bulk_deficit;
+	int client_bulk_held;
+	long client_bulk_poll;
+	Buffer *client_rxbuffer;
+	Buffer *client_txbuffer;
 
 	/* Miscellaneous */
 	Linequeue *buffered_lines;
 	Linequeue *inactive_lines;
 	Linequeue *history_lines;
+	Histmark *history_index;
+	long history_index_first;
+	long history_index_count;
+	long history_index_alloc;
+	long history_since_mark;
+	/* The marks before history_index_built have been indexed. The next
+	 * line to index is history_index_next (NULL if that's the line of
+	 * the mark). strip holds the line being indexed, without ANSI. */
+	long history_index_built;
+	Line *history_index_next;
+	char *history_index_strip;
+	long history_index_stripsize;
 	long dropped_inactive_lines;
 	long dropped_buffered_lines;
 	time_t easteregg_last;
+	Recalljob *recall_job;
+	int recall_fd;
+	/* Spilled new lines that are yet to be passed to the client, in up
+	 * to two parts (see world_recall_and_pass()). Each part runs from
+	 * position replay_pos to replay_end in the spill file, and the lines
+	 * in replay_after wait for it. */
+	int replay_parts;
+	long replay_pos[2];
+	long replay_end[2];
+	Linequeue *replay_after[2];
+
+	/* Spill file */
+	char *spill_file;
+	int spill_fd;
+	int spill_broken;
+	char *spill_map;
+	long spill_maplen;
+	long spill_start;
+	long spill_histend;
+	long spill_inactend;
+	long spill_end;
+	/* How far the records have moved to the start of the file so far,
+	 * see world_spill_pos_first(). */
+	long spill_base;
+	long spill_lastsize;
+	unsigned long spill_count[3];
+	Spillmark *spill_index;
+	long spill_index_first;
+	long spill_index_count;
+	long spill_index_alloc;
+	long spill_since_mark;
+	char *spill_strip;
+	long spill_stripsize;
+
+	/* Log spool */
+	char *logspool_file;
+	int logspool_fd;
+	int logspool_broken;
+	long logspool_start;
+	long logspool_end;
+	unsigned long logspool_count;
 
 	/* Timer stuff */
 	int timer_prev_sec;
@@ -182,10 +297,15 @@ struct World
 	time_t log_currenttime;
 	char *log_currenttimestr;
 	int log_fd;
-	char *log_buffer;
-	long log_bfull;
+	Buffer *log_buffer;
+	Logwriter *log_writer;
+	int log_writer_fd;
+	Linequeue *log_syncwait;
+	unsigned long log_syncs_wanted;
+	unsigned long log_syncs_done;
 	char *log_lasterror;
 	time_t log_lasterrtime;
+	Logtail *logtail;
 
 	/* MCP stuff */
 	int mcp_negotiated;
@@ -209,10 +329,24 @@ struct World
 	char *newinfostring;
 	char *newinfostring_parsed;
 	long context_lines;
+	long recall_page;
 	long buffer_size;
 	long logbuffer_size;
+	long spill_size;
+	long netbuffer_size;
+	long line_limit;
+	int intern_lines;
 	int logging;
 	int log_timestamps;
+	int log_sync;
+	long log_sync_interval;
+	long log_sync_bytes;
+	long log_compress;
+	long log_recompress;
+	long log_spool_size;
+	char *log_spool_dir;
+	int log_tail;
+	long log_tail_queue;
 	int easteregg_version;
 };
 
@@ -264,10 +398,37 @@ extern void world_decrease_reconnect_delay( World *wld );
  * This puts a limit on the amount of memory these queues will occupy. */
 extern void world_trim_dynamic_queues( World *wld );
 
+/* Return the number of bytes counted against buffer_size: the memory
+ * occupied by the buffered, inactive and history lines. */
+extern unsigned long world_buffer_usage( World *wld );
+
+/* Return the number of bytes counted against logbuffer_size: the memory
+ * occupied by the loggable lines, and any unwritten data in the log buffer. */
+extern unsigned long world_logbuffer_usage( World *wld );
+
+/* Shrink the network and log buffers that have been idle for at least
+ * NET_BUFFER_IDLE seconds. */
+extern void world_shrink_buffers( World *wld );
+
+/* Send the client a report on the estimated memory usage of this world,
+ * broken down by queue and buffer. */
+extern void world_memory_report( World *wld );
+
 /* Replicate the configured number of history lines to provide context for
  * the newly connected client, and then pass all buffered lines. */
 extern void world_recall_and_pass( World *wld );
 
+/* If the client has taken the spilled new lines passed to it so far, pass
+ * some more, and the lines that were waiting for them. */
+extern void world_replay_feed( World *wld );
+
+/* Return true if world_replay_feed() has something to do right now. */
+extern int world_replay_pending( World *wld );
+
+/* Stop passing spilled new lines to the client. The lines that were
+ * waiting for them go to client_toqueue. */
+extern void world_replay_stop( World *wld );
+
 /* (Auto-)login to the server. If autologin is enabled, log in.
  * If autologin is disabled, only log in if override is non-zero. */
 extern void world_login_server( World *wld, int override );
@@ -276,6 +437,22 @@ extern void world_login_server( World *wld, int override );
  * remove the 'possibly new' status from these lines. */
 extern void world_inactive_to_history( World *wld );
 
+/* Clear all history lines from memory. */
+extern void world_history_forget( World *wld );
+
+/* Return the oldest line in wld->history_lines with a time of at least t,
+ * or NULL if there is none. Uses the time index of the history to skip
+ * most of the lines. If mark is not NULL, the index of the first mark in
+ * the time index at or after that line is put in it. */
+extern Line *world_history_seek( World *wld, time_t t, long *mark );
+
+/* Index up to HISTORY_BLOOM_BUDGET bytes of the history lines that haven't
+ * been indexed yet, into the bloom filters of the time index. */
+extern void world_history_index( World *wld );
+
+/* Return true if there are history lines left to index. */
+extern int world_history_index_pending( World *wld );
+
 /* Recall (at most) count lines from wld->history_lines.
  * Return a newly created Linequeue object with copies of the recalled lines.
  * The lines have their flags set to LINE_RECALLED, and their strings